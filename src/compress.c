@@ -0,0 +1,422 @@
+/** @file
+ * Streaming compression of notebook files
+ *
+ * Gzip is always available, zstd only when built with HAVE_ZSTD.
+ * Compressed input is read with pread from a given offset, so that it
+ * never disturbs the stream it was opened from, and compressed output
+ * goes through a stdio stream so that dumping code stays the same.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+// Bytes of compressed data read or written at once
+#define COMPRESS_CHUNK 65536
+
+// Decompression in progress
+typedef struct Decompressor {
+  compress_t type;
+  int fd;
+  off_t at;
+  bool inside;
+
+  z_stream gz;
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zs;
+  ZSTD_inBuffer zin;
+#endif
+  unsigned char in[COMPRESS_CHUNK];
+} Decompressor;
+
+// Compression in progress, behind a stdio stream
+typedef struct Compressor {
+  compress_t type;
+  int fd;
+
+  z_stream gz;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zs;
+#endif
+  unsigned char out[COMPRESS_CHUNK];
+} Compressor;
+
+static ssize_t gzip_read(Decompressor *d, char *buf, size_t size);
+#ifdef HAVE_ZSTD
+static ssize_t zstd_read(Decompressor *d, char *buf, size_t size);
+#endif
+static ssize_t compressor_write(void *cookie, const char *buf, size_t size);
+static int compressor_close(void *cookie);
+static bool compressor_out(Compressor *c, size_t length);
+
+/** Guess compression from a file name
+ */
+compress_t compress_type(const char *path) {
+  size_t length;
+
+  length = strlen(path);
+  if ((length > 3) && !strcmp(path + length - 3, ".gz"))
+    return COMPRESS_GZIP;
+  if ((length > 4) && !strcmp(path + length - 4, ".zst"))
+    return COMPRESS_ZSTD;
+
+  return COMPRESS_NONE;
+}
+
+/** Recognise compressed data by its magic bytes
+ *
+ * @param start Offset the data starts at
+ */
+compress_t compress_detect(int fd, off_t start) {
+  unsigned char magic[4];
+  ssize_t n;
+
+  n = pread(fd, magic, sizeof(magic), start);
+  if ((n >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b))
+    return COMPRESS_GZIP;
+  if ((n == 4) && (magic[0] == 0x28) && (magic[1] == 0xb5) && (magic[2] == 0x2f) &&
+      (magic[3] == 0xfd))
+    return COMPRESS_ZSTD;
+
+  return COMPRESS_NONE;
+}
+
+/** Pick compression for writing a file
+ *
+ * The name decides, unless it says nothing and the file already exists,
+ * in which case its current compression is kept.
+ */
+compress_t compress_guess(const char *path) {
+  compress_t type;
+  int fd;
+
+  if ((type = compress_type(path)) || ((fd = open(path, O_RDONLY)) < 0))
+    return type;
+  type = compress_detect(fd, 0);
+  close(fd);
+
+  return type;
+}
+
+/** Start decompressing a file
+ *
+ * @param start Offset the compressed data starts at
+ * @return NULL with errno set on failure, ENOTSUP for zstd without HAVE_ZSTD
+ */
+Decompressor *decompress_open(int fd, off_t start, compress_t type) {
+  Decompressor *d;
+
+  if (!(d = calloc(1, sizeof(Decompressor))))
+    return NULL;
+  d->type = type;
+  d->fd = fd;
+  d->at = start;
+
+  switch (type) {
+    case COMPRESS_GZIP:
+      // Accept zlib and gzip headers alike
+      if (inflateInit2(&d->gz, 15 + 32) != Z_OK) {
+        free(d);
+        errno = ENOMEM;
+        return NULL;
+      }
+      return d;
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+      if (!(d->zs = ZSTD_createDCtx())) {
+        free(d);
+        errno = ENOMEM;
+        return NULL;
+      }
+      return d;
+#endif
+    default:
+      free(d);
+      errno = ENOTSUP;
+      return NULL;
+  }
+}
+
+/** Read decompressed data
+ *
+ * @return Bytes read, 0 at the end or -1 on error
+ */
+ssize_t decompress_read(Decompressor *d, char *buf, size_t size) {
+#ifdef HAVE_ZSTD
+  if (d->type == COMPRESS_ZSTD)
+    return zstd_read(d, buf, size);
+#endif
+  return gzip_read(d, buf, size);
+}
+
+/** Get the offset of compressed data consumed so far
+ */
+off_t decompress_offset(Decompressor *d) {
+#ifdef HAVE_ZSTD
+  if (d->type == COMPRESS_ZSTD)
+    return d->at - (d->zin.size - d->zin.pos);
+#endif
+  return d->at - d->gz.avail_in;
+}
+
+/** Stop decompressing
+ */
+void decompress_close(Decompressor *d) {
+  if (!d)
+    return;
+#ifdef HAVE_ZSTD
+  if (d->type == COMPRESS_ZSTD)
+    ZSTD_freeDCtx(d->zs);
+  else
+#endif
+    inflateEnd(&d->gz);
+  free(d);
+}
+
+/** Inflate gzip members one after another
+ */
+static ssize_t gzip_read(Decompressor *d, char *buf, size_t size) {
+  ssize_t n;
+  int ret;
+
+  d->gz.next_out = (Bytef *)buf;
+  d->gz.avail_out = size;
+  while (d->gz.avail_out) {
+    if (!d->gz.avail_in) {
+      if ((n = pread(d->fd, d->in, sizeof(d->in), d->at)) < 0)
+        return -1;
+      if (!n)
+        break;
+      d->at += n;
+      d->gz.next_in = d->in;
+      d->gz.avail_in = n;
+    }
+    d->inside = true;
+    ret = inflate(&d->gz, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      d->inside = false;
+      if (inflateReset(&d->gz) != Z_OK)
+        return -1;
+    } else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+      errno = EILSEQ;
+      return -1;
+    }
+  }
+  n = size - d->gz.avail_out;
+  if (!n && d->inside) {
+    errno = ENODATA;  // cut short
+    return -1;
+  }
+
+  return n;
+}
+
+#ifdef HAVE_ZSTD
+/** Decompress zstd frames one after another
+ */
+static ssize_t zstd_read(Decompressor *d, char *buf, size_t size) {
+  ZSTD_outBuffer out;
+  ssize_t n;
+  size_t ret;
+
+  out.dst = buf;
+  out.size = size;
+  out.pos = 0;
+  while (out.pos < out.size) {
+    if (d->zin.pos == d->zin.size) {
+      if ((n = pread(d->fd, d->in, sizeof(d->in), d->at)) < 0)
+        return -1;
+      if (!n)
+        break;
+      d->at += n;
+      d->zin.src = d->in;
+      d->zin.size = n;
+      d->zin.pos = 0;
+    }
+    ret = ZSTD_decompressStream(d->zs, &out, &d->zin);
+    if (ZSTD_isError(ret)) {
+      errno = EILSEQ;
+      return -1;
+    }
+    d->inside = ret != 0;
+  }
+  if (!out.pos && d->inside) {
+    errno = ENODATA;  // cut short
+    return -1;
+  }
+
+  return out.pos;
+}
+#endif
+
+/** Open a stream that compresses everything written to it
+ *
+ * Closing the stream finishes the compressed data, but leaves the file
+ * descriptor open.
+ *
+ * @param fd File to write compressed data to
+ * @param level Compression level, clamped to what the format supports
+ * @return NULL with errno set on failure, ENOTSUP for zstd without HAVE_ZSTD
+ */
+FILE *compress_writer(int fd, compress_t type, int level) {
+  cookie_io_functions_t io = {NULL, compressor_write, NULL, compressor_close};
+  Compressor *c;
+  FILE *fp;
+
+  if (!(c = calloc(1, sizeof(Compressor))))
+    return NULL;
+  c->type = type;
+  c->fd = fd;
+
+  switch (type) {
+    case COMPRESS_GZIP:
+      if (level < 1)
+        level = Z_DEFAULT_COMPRESSION;
+      else if (level > 9)
+        level = 9;
+      // Gzip header rather than zlib one
+      if (deflateInit2(&c->gz, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(c);
+        errno = ENOMEM;
+        return NULL;
+      }
+      break;
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+      if (level > ZSTD_maxCLevel())
+        level = ZSTD_maxCLevel();
+      if (!(c->zs = ZSTD_createCCtx()) ||
+          ZSTD_isError(ZSTD_CCtx_setParameter(c->zs, ZSTD_c_compressionLevel, level))) {
+        ZSTD_freeCCtx(c->zs);
+        free(c);
+        errno = ENOMEM;
+        return NULL;
+      }
+      break;
+#endif
+    default:
+      free(c);
+      errno = ENOTSUP;
+      return NULL;
+  }
+
+  if (!(fp = fopencookie(c, "w", io))) {
+#ifdef HAVE_ZSTD
+    if (type == COMPRESS_ZSTD)
+      ZSTD_freeCCtx(c->zs);
+    else
+#endif
+      deflateEnd(&c->gz);
+    free(c);
+    return NULL;
+  }
+  setvbuf(fp, NULL, _IOFBF, COMPRESS_CHUNK);
+
+  return fp;
+}
+
+/** Compress a buffer flushed by stdio
+ *
+ * @return Bytes consumed, 0 on error
+ */
+static ssize_t compressor_write(void *cookie, const char *buf, size_t size) {
+  Compressor *c;
+
+  c = (Compressor *)cookie;
+#ifdef HAVE_ZSTD
+  if (c->type == COMPRESS_ZSTD) {
+    ZSTD_inBuffer in = {buf, size, 0};
+    ZSTD_outBuffer out;
+
+    while (in.pos < in.size) {
+      out.dst = c->out;
+      out.size = sizeof(c->out);
+      out.pos = 0;
+      if (ZSTD_isError(ZSTD_compressStream2(c->zs, &out, &in, ZSTD_e_continue)) ||
+          !compressor_out(c, out.pos))
+        return 0;
+    }
+    return size;
+  }
+#endif
+
+  c->gz.next_in = (Bytef *)buf;
+  c->gz.avail_in = size;
+  do {
+    c->gz.next_out = c->out;
+    c->gz.avail_out = sizeof(c->out);
+    if ((deflate(&c->gz, Z_NO_FLUSH) == Z_STREAM_ERROR) ||
+        !compressor_out(c, sizeof(c->out) - c->gz.avail_out))
+      return 0;
+  } while (!c->gz.avail_out);
+
+  return size;
+}
+
+/** Finish compressed data and free the compressor
+ */
+static int compressor_close(void *cookie) {
+  Compressor *c;
+  bool ok;
+  int ret;
+
+  c = (Compressor *)cookie;
+  ok = true;
+#ifdef HAVE_ZSTD
+  if (c->type == COMPRESS_ZSTD) {
+    ZSTD_inBuffer in = {NULL, 0, 0};
+    ZSTD_outBuffer out;
+    size_t left;
+
+    do {
+      out.dst = c->out;
+      out.size = sizeof(c->out);
+      out.pos = 0;
+      left = ZSTD_compressStream2(c->zs, &out, &in, ZSTD_e_end);
+      ok = !ZSTD_isError(left) && compressor_out(c, out.pos);
+    } while (ok && left);
+    ZSTD_freeCCtx(c->zs);
+    free(c);
+    return ok ? 0 : -1;
+  }
+#endif
+
+  do {
+    c->gz.next_out = c->out;
+    c->gz.avail_out = sizeof(c->out);
+    ret = deflate(&c->gz, Z_FINISH);
+    ok = (ret != Z_STREAM_ERROR) && compressor_out(c, sizeof(c->out) - c->gz.avail_out);
+  } while (ok && (ret != Z_STREAM_END));
+  deflateEnd(&c->gz);
+  free(c);
+
+  return ok ? 0 : -1;
+}
+
+/** Write out compressed bytes
+ */
+static bool compressor_out(Compressor *c, size_t length) {
+  ssize_t n;
+  size_t done;
+
+  for (done = 0; done < length; done += n)
+    if ((n = write(c->fd, c->out + done, length - done)) < 0)
+      return false;
+
+  return true;
+}
@@ -0,0 +1,20 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef enum {COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD} compress_t;
+
+struct Decompressor;
+
+compress_t compress_type(const char *path);
+compress_t compress_detect(int fd, off_t start);
+compress_t compress_guess(const char *path);
+FILE *compress_writer(int fd, compress_t type, int level);
+struct Decompressor *decompress_open(int fd, off_t start, compress_t type);
+ssize_t decompress_read(struct Decompressor *d, char *buf, size_t size);
+off_t decompress_offset(struct Decompressor *d);
+void decompress_close(struct Decompressor *d);
+
+#endif
@@ -16,205 +16,3202 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
+#include <sys/stat.h>
 
 #include "user.h"
 #include "data.h"
+#include "compress.h"
+#include "pool.h"
+
+// Bytes read at once from unparsed parts of a file
+#define READ_CHUNK 65536
+
+// Bytes of entry text converted at once when dumping
+#define DUMP_CHUNK 4096
+
+// Longest escape sequence written when exporting
+#define ESCAPE_MAX 8
+
+/** Text buffers shared with a live snapshot
+ *
+ * Entries whose generation is older than the current one were captured
+ * by the live snapshot. Their text is copied before being modified and
+ * their old buffers are kept here until the snapshot is freed. Entries
+ * are also made by loader threads, so the generation is read and bumped
+ * atomically. One read just before a bump only costs an extra copy.
+ */
+static struct Shared {
+  unsigned gen;
+  bool live;
+
+  wchar_t **dead;
+  int count;
+  int size;
+} Shared;
+
+// Number of modifications made to any tree so far
+static unsigned long Changes = 0;
+
+// Entries of all trees, shards are parsed in parallel
+static Pool EntryPool = POOL_INIT(Entry);
+static pthread_mutex_t EntryLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of times sources were checked for changes
+static unsigned Checks = 0;
+
+// File that entries were loaded from, shared by their ranges
+typedef struct Source {
+  int fd;
+  int depth;
+  int refs;
+
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+
+  unsigned checked;
+  bool valid;
+} Source;
+
+// Lines of a stream, of a byte range of a file or of compressed data
+typedef struct Reader {
+  FILE *fp;
+  int fd;
+  struct Decompressor *z;
+  off_t pos, next, end;
+
+  char *chunk;
+  size_t fill, at;
+
+  char *line;
+  size_t size;
+  int error;
+} Reader;
+
+// Parse in progress, fed with raw bytes
+typedef struct Parser {
+  Entry *first, *c, *parent;
+  int base, level, line_nr;
+
+  Source *src;
+  int depth;
+  Range *open;
+  off_t pos;
+
+  char *hold;
+  size_t held, hold_size;
+  wchar_t *line;
+  size_t size;
+
+  bool failed;
+  wchar_t error[ERR_MAX_LEN];
+} Parser;
+
+// Shards of a directory being parsed by several threads
+typedef struct ShardLoad {
+  int dir;
+  char **names;
+  int count, depth;
+  LoadCtl *ctl;
+
+  pthread_mutex_t lock;
+  int next;
+  Result *res;
+} ShardLoad;
+
+// Scan in progress
+typedef struct Scan {
+  scan_t fn;
+  void *arg;
+  bool stopped;
+
+  int base, line;
+} Scan;
+
+// Import in progress, see data_import()
+typedef struct Import {
+  Reader *rd;
+  int c, line, col;
+
+  Entry *first, *parent, *last;
+  long count;
+
+  char *text;
+  size_t length, size;
+  Result res;
+} Import;
+
+// Old entry considered for reuse when merging
+typedef struct MergeItem {
+  Entry *entry;
+  unsigned long deep, flat;
+  int next_deep, next_flat;
+  bool used;
+} MergeItem;
+
+static void snapshot_unref(Snapshot *s);
+static bool entry_shared(Entry *e);
+static bool text_defer(wchar_t *text);
+static void text_free(Entry *e);
+static void entry_free(Entry *e);
+static bool dump_line(FILE *output, int level, bool crossed, bool bold,
+                      wchar_t *text, int length);
+static Entry *merge_list(Entry *parent, Entry *old, Entry *new, Entry **dropped);
+static Result parse_line(Parser *p, wchar_t *line, int length, off_t start);
+static int parse_tabs(wchar_t *line, int length);
+static wchar_t *parse_marks(wchar_t *data, int *length, bool *crossed, bool *bold);
+static void parse_close(Parser *p, Entry *e, off_t end);
+static void parse_start(Parser *p);
+static Result parse_feed(Parser *p, const char *data, size_t length);
+static bool parse_hold(Parser *p, const char *data, size_t length);
+static Result parse_text(Parser *p, const char *text, size_t length);
+static Result parse_end(Parser *p);
+static Result parse_fail(Parser *p, Result res);
+static Result parse_read(Parser *p, Reader *rd, LoadCtl *ctl);
+static Result input_load(FILE *fp, int fd, int depth, bool lazy, LoadCtl *ctl);
+static Result compressed_load(int fd, off_t pos, compress_t type, LoadCtl *ctl);
+static Result scan_file(FILE *input, Scan *s);
+static Result scan_lines(Reader *rd, Scan *s);
+static bool reader_open(Reader *r, FILE *fp, int fd, off_t start, off_t end);
+static void reader_close(Reader *r);
+static ssize_t reader_line(Reader *r);
+static ssize_t reader_fill(Reader *r);
+static int reader_getc(Reader *r);
+static Source *source_new(int fd, int depth);
+static void source_unref(Source *s);
+static bool source_same(Source *s);
+static bool source_valid(Source *s);
+static void range_clear(Range *r);
+static bool range_copy(FILE *output, Range *r);
+static bool bytes_copy(int from, off_t at, off_t end, FILE *output);
+static bool range_join(Range *r, int level, Range *next, int next_level);
+static Range *lazy_new(Source *src, off_t start, int level, int line);
+static void lazy_free(Range *l);
+static ssize_t lazy_line(Reader *r, int level, char **text);
+static bool range_dump(FILE *output, Range *r, int level);
+static unsigned long lazy_hash(Range *l);
+static bool lazy_same(Range *a, Range *b);
+static bool is_dir(FILE *fp);
+static Result shards_load(int dir, int depth, LoadCtl *ctl);
+static void *shards_worker(void *arg);
+static bool shard_valid(const char *name);
+static char *shard_name();
+static bool shard_clean(int dir, SnapItem *items, int count);
+static bool shard_write(int dir, const char *name, SnapItem *items, int count);
+static int items_dump(FILE *output, SnapItem *items, int count);
+static bool export_tabs(FILE *output, int count);
+static bool export_text(Export *x, wchar_t *text, int length);
+static int export_escape(export_t format, wchar_t c, char *out);
+static bool export_open(Export *x, int level);
+static bool export_shut(Export *x, int level);
+static bool export_item(Export *x, Entry *e, int level);
+static bool export_close(Export *x, int level, bool leaf);
+static bool export_unwind(Export *x, int level);
+static bool export_lazy(Export *x, Range *l, int level);
+static void import_next(Import *im);
+static void import_space(Import *im);
+static bool import_fail(Import *im, const wchar_t *what);
+static bool import_room(Import *im);
+static bool import_byte(Import *im, int b);
+static bool import_code(Import *im, unsigned long code);
+static bool import_text(Import *im, Entry *e);
+static bool import_open(Import *im);
+static void import_close(Import *im);
+static bool json_import(Import *im);
+static bool json_string(Import *im);
+static bool json_hex(Import *im, unsigned long *code);
+static bool json_bool(Import *im, bool *to);
+static bool json_skip(Import *im);
+static bool opml_import(Import *im);
+static bool opml_text(Import *im, Entry *e);
+static bool xml_name(Import *im, char *name, size_t size);
+static bool xml_attributes(Import *im, Entry *e);
+static bool xml_entity(Import *im);
+static bool xml_skip(Import *im);
+static Result append_file(int dir, const char *name, Entry *e, const wchar_t *under,
+                          bool *missing);
+static off_t append_find(int fd, off_t size, const wchar_t *under);
+static Result append_end(int fd, off_t size, compress_t type, Entry *e, int level);
+static Result append_insert(int dir, const char *name, int fd, struct stat *st, off_t at,
+                            Entry *e);
+static Result append_shard(int dir, char **names, Entry *e);
 
 /** Format a result
  */
-Result result_new(bool success, void *data, const wchar_t *fmt, ...) {
-  va_list args;
-  Result ret;
+Result result_new(bool success, void *data, const wchar_t *fmt, ...) {
+  va_list args;
+  Result ret;
+
+  ret.success = success;
+  ret.data = data;
+
+  va_start(args, fmt);
+  vswprintf(ret.msg, ERR_MAX_LEN, fmt, args);
+  va_end(args);
+
+  return ret;
+}
+
+/** Create new entry
+ *
+ * New entry is safely zeroed.
+ */
+Result entry_new(int length) {
+  Entry *new;
+
+  pthread_mutex_lock(&EntryLock);
+  new = pool_get(&EntryPool);
+  pthread_mutex_unlock(&EntryLock);
+  if (!new)
+    return result_new(false, NULL, L"Couldn't allocate Entry");
+
+  new->text = calloc(length + 1, sizeof(wchar_t));
+  if (!new->text) {
+    entry_free(new);
+    return result_new(false, NULL, L"Couldn't allocate Entry text buffer");
+  }
+  new->length = length;
+  new->size = length + 1;
+  new->gen = __atomic_load_n(&Shared.gen, __ATOMIC_RELAXED);
+
+  return result_new(true, new, L"Allocated new Entry with %d text buffer", length);
+}
+
+/** Parse input
+ */
+Result data_load(FILE *input) {
+  return data_load_ctl(input, NULL);
+}
+
+/** Parse input under control of another thread
+ *
+ * After every chunk read the number of bytes read so far is stored in
+ * ctl->done and ctl->cancel is checked to stop early.
+ */
+Result data_load_ctl(FILE *input, LoadCtl *ctl) {
+  return input_load(input, fileno(input), 0, false, ctl);
+}
+
+/** Parse input from a file descriptor, e.g. a pipe or a socket
+ *
+ * Reads from the current offset till the end, otherwise the same as
+ * data_load_ctl().
+ */
+Result data_load_fd(int fd, LoadCtl *ctl) {
+  return input_load(NULL, fd, 0, false, ctl);
+}
+
+/** Parse input, leaving deeper levels for later
+ *
+ * Only `depth` levels are parsed, anything below is remembered as a
+ * byte range of the input, to be parsed by entry_expand() or copied as
+ * is when dumping. The file must not be modified in place while any
+ * entry is left unparsed, replacing it by rename is fine. Input that
+ * isn't a regular file or is compressed is parsed whole, same as with
+ * depth 0.
+ *
+ * Every entry also remembers the byte range of itself and its children,
+ * so that unchanged parts can be copied from the input when dumping.
+ */
+Result data_load_lazy(FILE *input, int depth, LoadCtl *ctl) {
+  return input_load(input, fileno(input), depth, true, ctl);
+}
+
+/** Parse a buffer holding a whole notebook
+ */
+Result data_parse(const char *data, size_t length) {
+  Result res;
+  Parser p;
+
+  parse_start(&p);
+  res = parse_feed(&p, data, length);
+  if (!res.success)
+    return parse_fail(&p, res);
+
+  return parse_end(&p);
+}
+
+/** Start parsing input that arrives in chunks
+ *
+ * Chunks may split lines and even characters anywhere.
+ *
+ * @return Parser for parser_feed() and parser_finish()
+ */
+Result parser_new() {
+  Parser *p;
+
+  if (!(p = malloc(sizeof(Parser))))
+    return result_new(false, NULL, L"Couldn't allocate Parser");
+  parse_start(p);
+
+  return result_new(true, p, L"Started parsing");
+}
+
+/** Parse the next chunk of input
+ *
+ * Once a chunk fails, the rest are ignored and parser_finish() fails
+ * the same way, so checking its result is enough.
+ */
+Result parser_feed(Parser *p, const char *data, size_t length) {
+  Result res;
+
+  if (p->failed)
+    return result_new(false, NULL, L"%S", p->error);
+  res = parse_feed(p, data, length);
+  if (!res.success) {
+    p->failed = true;
+    wcscpy(p->error, res.msg);
+  }
+
+  return res;
+}
+
+/** Parse whatever is left of the input and free the parser
+ *
+ * @return The parsed entries, same as data_load()
+ */
+Result parser_finish(Parser *p) {
+  Result res;
+
+  if (p->failed)
+    res = parse_fail(p, result_new(false, NULL, L"%S", p->error));
+  else
+    res = parse_end(p);
+  free(p);
+
+  return res;
+}
+
+/** Read input entry by entry without building a tree
+ *
+ * Every entry is passed to `fn` with its level and is valid only during
+ * the call, so memory use doesn't grow with the input. Returning false
+ * from `fn` stops the scan early. Compressed files and directories are
+ * read the same way as when loading.
+ */
+Result data_scan(FILE *input, scan_t fn, void *arg) {
+  Scan s;
+
+  s.fn = fn;
+  s.arg = arg;
+  s.stopped = false;
+  s.base = 0;
+  s.line = 1;
+
+  return scan_file(input, &s);
+}
+
+/** Parse an entry left unparsed by data_load_lazy()
+ *
+ * Children are parsed the same way, so their own children may again
+ * be left for later. Does nothing for entries that are already parsed.
+ */
+Result entry_expand(Entry *e) {
+  Result res;
+  Reader rd;
+  Parser p;
+  Range *l;
+
+  if (!(l = e->lazy))
+    return result_new(true, e, L"Entry is already parsed");
+  if (!reader_open(&rd, NULL, l->src->fd, l->start, l->end))
+    return result_new(false, e, L"Couldn't allocate read buffer");
+
+  parse_start(&p);
+  p.parent = e;
+  p.base = l->level;
+  p.line_nr = l->line;
+  p.pos = l->start;
+  p.src = l->src;
+  p.depth = l->src->depth;
+  // Children parsed before a failure are freed by parse_read()
+  res = parse_read(&p, &rd, NULL);
+  reader_close(&rd);
+  if (!res.success)
+    return res;
+
+  res = result_new(true, e, L"Parsed lines %d to %d", l->line, p.line_nr - 1);
+  e->child = p.first;
+  e->lazy = NULL;
+  lazy_free(l);
+
+  return res;
+}
+
+/** Scan a file, or every shard of a directory in order
+ */
+static Result scan_file(FILE *input, Scan *s) {
+  Result res;
+  Reader rd;
+  compress_t type;
+  char **names;
+  FILE *fp;
+  off_t pos;
+  int i, fd;
+
+  if (is_dir(input)) {
+    res = data_manifest(fileno(input));
+    if (!res.success)
+      return res;
+    names = (char **)res.data;
+    res = result_new(true, NULL, L"Empty notebook");
+    for (i = 0; names[i] && !s->stopped; i++) {
+      if (((fd = openat(fileno(input), names[i], O_RDONLY)) < 0) || !(fp = fdopen(fd, "r"))) {
+        res = result_new(false, NULL, L"Can't open shard %s: %s", names[i], strerror(errno));
+        if (fd >= 0)
+          close(fd);
+        break;
+      }
+      res = scan_file(fp, s);
+      fclose(fp);
+      if (!res.success)
+        break;
+    }
+    manifest_free(names);
+    return res;
+  }
+
+  pos = ftello(input);
+  type = (pos >= 0) ? compress_detect(fileno(input), pos) : COMPRESS_NONE;
+  if (!reader_open(&rd, type ? NULL : input, -1, pos < 0 ? 0 : pos, 0))
+    return result_new(false, NULL, L"Couldn't allocate line buffer");
+  if (type && !(rd.z = decompress_open(fileno(input), pos, type))) {
+    res = result_new(false, NULL, L"Can't decompress: %s", strerror(errno));
+    reader_close(&rd);
+    return res;
+  }
+  res = scan_lines(&rd, s);
+  if (!res.success && ((rd.error == EILSEQ) || (rd.error == ENODATA)))
+    res = result_new(false, NULL, L"Corrupt compressed data");
+  reader_close(&rd);
+
+  return res;
+}
+
+/** Pass every line to the scan callback as an entry
+ *
+ * Lines are expected to be indented by at least s->base tabs, which
+ * are not counted in levels.
+ */
+static Result scan_lines(Reader *rd, Scan *s) {
+  Result res;
+  Entry e;
+  wchar_t *line, *buffer;
+  const char *from;
+  mbstate_t state;
+  ssize_t n;
+  size_t size;
+  int length, tabs, level, line_nr;
+
+  bzero(&e, sizeof(Entry));
+  line = NULL;
+  size = 0;
+  level = -1;
+  line_nr = s->line;
+
+  while ((n = reader_line(rd)) > 0) {
+    if (n <= 1) continue;    // ignore empty lines
+    if (rd->line[n - 1] == '\n')
+      rd->line[--n] = '\0';  // kill newline char
+
+    if (size < n + 1) {
+      if (!(buffer = realloc(line, (n + 1) * sizeof(wchar_t)))) {
+        res = result_new(false, NULL, L"Couldn't allocate line buffer");
+        goto error;
+      }
+      line = buffer;
+      size = n + 1;
+    }
+    from = rd->line;
+    bzero(&state, sizeof(mbstate_t));
+    length = mbsrtowcs(line, &from, size, &state);
+    if (length < 0) {
+      res = result_new(false, NULL, L"Invalid character at line %d", line_nr);
+      goto error;
+    }
+    if (((tabs = parse_tabs(line, length)) < 0) || (tabs < s->base)) {
+      res = result_new(false, NULL, L"Malformed input at line %d", line_nr);
+      goto error;
+    }
+    if (tabs - s->base > level + 1) {
+      res = result_new(false, NULL, L"Ambiguous indentation at line %d", line_nr);
+      goto error;
+    }
+    level = tabs - s->base;
+
+    e.length = length - tabs - 2;
+    e.text = parse_marks(line + tabs + 2, &e.length, &e.crossed, &e.bold);
+    if (!s->fn(&e, level, s->arg)) {
+      s->stopped = true;
+      break;
+    }
+
+    ++line_nr;
+  }
+
+  if (n < 0) {
+    res = result_new(false, NULL, L"File access error at line %d", line_nr);
+    goto error;
+  }
+  free(line);
+  return result_new(true, NULL, L"Scanned %d lines", line_nr - s->line + 1);
+
+error:
+  free(line);
+  return res;
+}
+
+/** Check if a stream is an open directory
+ */
+static bool is_dir(FILE *fp) {
+  struct stat st;
+
+  return (fileno(fp) >= 0) && !fstat(fileno(fp), &st) && S_ISDIR(st.st_mode);
+}
+
+/** Read the list of shards of a directory
+ *
+ * A directory without a manifest has no shards.
+ *
+ * @param dir Open directory
+ * @return NULL terminated array of names, to be freed with manifest_free()
+ */
+Result data_manifest(int dir) {
+  FILE *fp;
+  char **names, **grown, *line;
+  size_t size;
+  ssize_t n;
+  int fd, count, i;
+
+  if (!(names = calloc(1, sizeof(char *))))
+    return result_new(false, NULL, L"Couldn't allocate manifest");
+  if ((fd = openat(dir, SHARD_MANIFEST, O_RDONLY | O_CLOEXEC)) < 0) {
+    if (errno == ENOENT)
+      return result_new(true, names, L"No manifest");
+    free(names);
+    return result_new(false, NULL, L"Can't open manifest: %s", strerror(errno));
+  }
+  if (!(fp = fdopen(fd, "r"))) {
+    close(fd);
+    free(names);
+    return result_new(false, NULL, L"Can't open manifest: %s", strerror(errno));
+  }
+
+  count = 0;
+  line = NULL;
+  size = 0;
+  while ((n = getline(&line, &size, fp)) > 0) {
+    if (line[n - 1] == '\n')
+      line[--n] = '\0';
+    if (!n) continue;  // ignore empty lines
+    if (!shard_valid(line)) {
+      fclose(fp);
+      free(line);
+      manifest_free(names);
+      return result_new(false, NULL, L"Invalid shard name in manifest: %s", line);
+    }
+    for (i = 0; (i < count) && strcmp(names[i], line); i++);
+    if (i < count) continue;  // listed twice, keep the first one
+    if (!(grown = realloc(names, (count + 2) * sizeof(char *))) ||
+        !(grown[count] = strdup(line))) {
+      fclose(fp);
+      free(line);
+      manifest_free(grown ? grown : names);
+      return result_new(false, NULL, L"Couldn't allocate manifest");
+    }
+    names = grown;
+    names[++count] = NULL;
+  }
+  fclose(fp);
+  free(line);
+
+  return result_new(true, names, L"Listed %d shards", count);
+}
+
+/** Free a list of shards
+ */
+void manifest_free(char **names) {
+  int i;
+
+  for (i = 0; names[i]; i++)
+    free(names[i]);
+  free(names);
+}
+
+/** Parse all shards of a directory
+ *
+ * Shards are parsed in parallel, each the same way data_load_lazy()
+ * parses a file, and their top level entries are joined in the order
+ * of the manifest. The first entry of every shard remembers its name.
+ */
+static Result shards_load(int dir, int depth, LoadCtl *ctl) {
+  ShardLoad sl;
+  Result res;
+  pthread_t threads[SHARD_THREADS];
+  Entry *first, *last, *e;
+  int i, started;
+
+  res = data_manifest(dir);
+  if (!res.success)
+    return res;
+  bzero(&sl, sizeof(ShardLoad));
+  sl.names = (char **)res.data;
+  for (sl.count = 0; sl.names[sl.count]; sl.count++);
+  sl.dir = dir;
+  sl.depth = depth;
+  sl.ctl = ctl;
+  if (!sl.count) {
+    manifest_free(sl.names);
+    return result_new(true, NULL, L"Notebook is empty");
+  }
+  if (!(sl.res = calloc(sl.count, sizeof(Result)))) {
+    manifest_free(sl.names);
+    return result_new(false, NULL, L"Couldn't allocate shard results");
+  }
+  pthread_mutex_init(&sl.lock, NULL);
+
+  for (started = 0; (started < SHARD_THREADS) && (started < sl.count); started++)
+    if (pthread_create(threads + started, NULL, shards_worker, &sl))
+      break;
+  if (!started)
+    shards_worker(&sl);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&sl.lock);
+
+  res = result_new(true, NULL, L"Parsed %d shards", sl.count);
+  first = last = NULL;
+  for (i = 0; i < sl.count; i++) {
+    if (!sl.res[i].success) {
+      if (res.success)
+        res = result_new(false, NULL, L"%s: %S", sl.names[i], sl.res[i].msg);
+      continue;
+    }
+    if (!(e = (Entry *)sl.res[i].data))
+      continue;
+    if (!(e->shard = strdup(sl.names[i])) && res.success)
+      res = result_new(false, NULL, L"Couldn't allocate shard name");
+    e->prev = last;
+    if (last)
+      last->next = e;
+    else
+      first = e;
+    for (last = e; last->next; last = last->next);
+  }
+  free(sl.res);
+  manifest_free(sl.names);
+
+  if (!res.success) {
+    if (first)
+      data_unload(first);
+    return res;
+  }
+  res.data = first;
+
+  return res;
+}
+
+/** Parse shards until there are none left
+ *
+ * Runs in as many threads as there are, touching only its own shards
+ * and, under the lock, the shared counters.
+ */
+static void *shards_worker(void *arg) {
+  ShardLoad *sl;
+  LoadCtl ctl;
+  FILE *fp;
+  int i, fd;
+
+  sl = (ShardLoad *)arg;
+  while (true) {
+    pthread_mutex_lock(&sl->lock);
+    i = sl->next++;
+    pthread_mutex_unlock(&sl->lock);
+    if (i >= sl->count)
+      break;
+
+    if (sl->ctl && sl->ctl->cancel) {
+      sl->res[i] = result_new(false, NULL, L"Loading cancelled");
+      continue;
+    }
+    if (((fd = openat(sl->dir, sl->names[i], O_RDONLY | O_CLOEXEC)) < 0) ||
+        !(fp = fdopen(fd, "r"))) {
+      sl->res[i] = result_new(false, NULL, L"%s", strerror(errno));
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+    bzero(&ctl, sizeof(LoadCtl));
+    sl->res[i] = data_load_lazy(fp, sl->depth, &ctl);
+    if (sl->ctl) {
+      pthread_mutex_lock(&sl->lock);
+      sl->ctl->done += ftello(fp);
+      pthread_mutex_unlock(&sl->lock);
+    }
+    fclose(fp);
+  }
+
+  return NULL;
+}
+
+/** Check if a manifest line is a file in the directory
+ */
+static bool shard_valid(const char *name) {
+  return name[0] && (name[0] != '.') && !strchr(name, '/') &&
+         strcmp(name, SHARD_MANIFEST);
+}
+
+/** Make up a name for a new shard
+ *
+ * Names are random, so that shards added elsewhere don't collide.
+ */
+static char *shard_name() {
+  static unsigned long count = 0;
+  struct timespec ts;
+  unsigned long hash, parts[4];
+  char *name;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  parts[0] = ts.tv_sec;
+  parts[1] = ts.tv_nsec;
+  parts[2] = getpid();
+  parts[3] = ++count;
+  hash = 14695981039346656037UL;
+  for (i = 0; i < sizeof(parts); i++)
+    hash = (hash ^ ((unsigned char *)parts)[i]) * 1099511628211UL;
+
+  if (!(name = malloc(sizeof(SHARD_SUFFIX) + 16)))
+    return NULL;
+  sprintf(name, "%016lx" SHARD_SUFFIX, hash);
+
+  return name;
+}
+
+/** Give every top level entry a shard
+ *
+ * Needed before dumping to a directory, done separately so that the
+ * names stick to the entries and are reused by later dumps.
+ *
+ * @param e Any top level entry
+ */
+Result data_shard(Entry *e) {
+  int count;
+
+  for (; e->parent; e = e->parent);
+  for (; e->prev; e = e->prev);
+  for (count = 0; e; e = e->next) {
+    if (e->shard)
+      continue;
+    if (!(e->shard = shard_name()))
+      return result_new(false, NULL, L"Couldn't allocate shard name");
+    count++;
+  }
+
+  return result_new(true, NULL, L"Named %d shards", count);
+}
+
+/** Dump a tree to a directory
+ */
+Result data_dump_dir(Entry *e, int dir) {
+  Result res;
+  Snapshot *snap;
+
+  res = data_shard(e);
+  if (!res.success)
+    return res;
+  res = data_snapshot(e);
+  if (!res.success)
+    return res;
+  snap = (Snapshot *)res.data;
+  res = snapshot_dump_dir(snap, dir);
+  snapshot_free(snap);
+
+  return res;
+}
+
+/** Dump a snapshot to a directory
+ *
+ * Only shards that changed are written, each replaced by rename, and
+ * the manifest last. Shards left out of the new manifest are removed.
+ * Safe to call from another thread while the tree is being modified.
+ *
+ * @param dir Open directory
+ */
+Result snapshot_dump_dir(Snapshot *s, int dir) {
+  Result res;
+  SnapItem *items;
+  FILE *fp;
+  char **old, *tmp;
+  int i, j, k, fd, written, total;
+
+  res = data_manifest(dir);
+  if (!res.success)
+    return res;
+  old = (char **)res.data;
+  if (!(tmp = malloc(sizeof(SHARD_MANIFEST) + 24))) {
+    manifest_free(old);
+    return result_new(false, NULL, L"Couldn't allocate temporary name");
+  }
+  sprintf(tmp, "." SHARD_MANIFEST ".%d", (int)getpid());
+  fp = NULL;
+  if (((fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) ||
+      !(fp = fdopen(fd, "w"))) {
+    res = result_new(false, NULL, L"Can't write manifest: %s", strerror(errno));
+    goto error;
+  }
+
+  written = total = 0;
+  items = s->items;
+  for (i = 0; i < s->count; i = j, total++) {
+    for (j = i + 1; (j < s->count) && items[j].level; j++);
+    if (!items[i].shard) {
+      res = result_new(false, NULL, L"Entry without a shard");
+      goto error;
+    }
+    if (!shard_clean(dir, items + i, j - i)) {
+      if (!shard_write(dir, items[i].shard, items + i, j - i)) {
+        res = result_new(false, NULL, L"Can't write %s: %s", items[i].shard, strerror(errno));
+        goto error;
+      }
+      written++;
+    }
+    if (fprintf(fp, "%s\n", items[i].shard) < 0) {
+      res = result_new(false, NULL, L"Can't write manifest: %s", strerror(errno));
+      goto error;
+    }
+  }
+  i = !fflush(fp) && !fsync(fd);
+  i = !fclose(fp) && i;
+  fp = NULL;
+  if (!i) {
+    res = result_new(false, NULL, L"Can't write manifest: %s", strerror(errno));
+    goto error;
+  }
+  if (renameat(dir, tmp, dir, SHARD_MANIFEST)) {
+    res = result_new(false, NULL, L"Can't replace manifest: %s", strerror(errno));
+    goto error;
+  }
+
+  for (k = 0; old[k]; k++) {
+    for (i = 0; (i < s->count) && (!items[i].shard || strcmp(items[i].shard, old[k])); i++);
+    if (i == s->count)
+      unlinkat(dir, old[k], 0);
+  }
+  fsync(dir);
+  free(tmp);
+  manifest_free(old);
+
+  return result_new(true, NULL, L"Written %d of %d shards", written, total);
+
+error:
+  if (fp)
+    fclose(fp);
+  if (fd >= 0)
+    unlinkat(dir, tmp, 0);
+  free(tmp);
+  manifest_free(old);
+  return res;
+}
+
+/** Add an entry at the end of a file, or at the end of a top level subtree
+ *
+ * Only top level lines are looked at, and only up to the end of the
+ * subtree. An entry ending up at the end of the file is added with a
+ * single append, otherwise a copy of the file with the entry inserted
+ * replaces it, so the cost grows with the file size. A notebook
+ * directory gets a new shard, or the entry goes into the shard holding
+ * the subtree. Compressed files get another compressed member, so only
+ * appending at their end is possible. A missing file is created.
+ *
+ * @param under Text of the top level entry to add it under, or NULL
+ */
+Result data_append(const char *path, Entry *e, const wchar_t *under) {
+  Result res;
+  struct stat st;
+  const char *name;
+  char **names, *parent;
+  bool missing;
+  int dir, i;
+
+  if (!e->text[0] || wcschr(e->text, L'\n'))
+    return result_new(false, NULL, L"Entry text must be a single non-empty line");
+
+  if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+    if ((dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+      return result_new(false, NULL, L"Can't open %s: %s", path, strerror(errno));
+    res = data_manifest(dir);
+    if (!res.success) {
+      close(dir);
+      return res;
+    }
+    names = (char **)res.data;
+    if (!under)
+      res = append_shard(dir, names, e);
+    else {
+      res = result_new(false, NULL, L"No top level entry '%S'", under);
+      missing = true;
+      for (i = 0; names[i] && missing; i++)
+        res = append_file(dir, names[i], e, under, &missing);
+    }
+    manifest_free(names);
+    close(dir);
+    return res;
+  }
+
+  // Work next to the file, so that its copy can replace it
+  if ((name = strrchr(path, '/'))) {
+    if (!(parent = strndup(path, name - path + 1)))
+      return result_new(false, NULL, L"Couldn't allocate path");
+    dir = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(parent);
+    ++name;
+  } else {
+    dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    name = path;
+  }
+  if (dir < 0)
+    return result_new(false, NULL, L"Can't open directory of %s: %s", path, strerror(errno));
+  res = append_file(dir, name, e, under, &missing);
+  close(dir);
+
+  return res;
+}
+
+/** Add an entry to a single file
+ *
+ * @param missing Set when there's no `under` entry in this file
+ */
+static Result append_file(int dir, const char *name, Entry *e, const wchar_t *under,
+                          bool *missing) {
+  Result res;
+  struct stat st;
+  compress_t type;
+  off_t at;
+  int fd;
+
+  *missing = false;
+  if ((fd = openat(dir, name, O_RDWR | O_APPEND | O_CLOEXEC | (under ? 0 : O_CREAT), 0666)) < 0)
+    return result_new(false, NULL, L"Can't open %s: %s", name, strerror(errno));
+  if (fstat(fd, &st)) {
+    res = result_new(false, NULL, L"Can't stat %s: %s", name, strerror(errno));
+    close(fd);
+    return res;
+  }
+  type = st.st_size ? compress_detect(fd, 0) : compress_type(name);
+
+  at = st.st_size;
+  if (under && type)
+    res = result_new(false, NULL, L"Can't look for '%S' in compressed %s", under, name);
+  else if (under && ((at = append_find(fd, st.st_size, under)) == -2))
+    res = result_new(false, NULL, L"Can't read %s: %s", name, strerror(errno));
+  else if (at == -1) {
+    *missing = true;
+    res = result_new(false, NULL, L"No top level entry '%S'", under);
+  } else if (at == st.st_size)
+    res = append_end(fd, st.st_size, type, e, under ? 1 : 0);
+  else
+    res = append_insert(dir, name, fd, &st, at, e);
+  close(fd);
+
+  return res;
+}
+
+/** Find where the subtree of a top level entry ends
+ *
+ * Deeper lines are skipped without being decoded.
+ *
+ * @return Offset of the next top level line or the file size, -1 when
+ * there's no such entry and -2 on error
+ */
+static off_t append_find(int fd, off_t size, const wchar_t *under) {
+  Reader rd;
+  wchar_t *line, *text, *buffer;
+  const char *from;
+  mbstate_t state;
+  ssize_t n;
+  size_t length, buffer_size;
+  int text_length;
+  bool crossed, bold, found;
+  off_t at;
+
+  if (!reader_open(&rd, NULL, fd, 0, size))
+    return -2;
+  line = NULL;
+  buffer_size = 0;
+  found = false;
+  at = -1;
+
+  while ((n = reader_line(&rd)) > 0) {
+    if (rd.line[0] != '-')
+      continue;
+    if (found) {
+      at = rd.pos - n;
+      break;
+    }
+    if (rd.line[n - 1] == '\n')
+      rd.line[--n] = '\0';
+    if (buffer_size < n + 1) {
+      if (!(buffer = realloc(line, (n + 1) * sizeof(wchar_t)))) {
+        n = -1;
+        break;
+      }
+      line = buffer;
+      buffer_size = n + 1;
+    }
+    from = rd.line;
+    bzero(&state, sizeof(mbstate_t));
+    length = mbsrtowcs(line, &from, buffer_size, &state);
+    if ((length == (size_t)-1) || (length < 2))
+      continue;
+    text_length = length - 2;
+    text = parse_marks(line + 2, &text_length, &crossed, &bold);
+    found = !wcscmp(text, under);
+  }
+  if (found && (at < 0))
+    at = size;
+  free(line);
+  reader_close(&rd);
+
+  return (n < 0) ? -2 : at;
+}
+
+/** Append an entry line with a single write
+ */
+static Result append_end(int fd, off_t size, compress_t type, Entry *e, int level) {
+  FILE *out;
+  char *buf, last;
+  size_t length;
+  ssize_t n;
+  bool ok;
+
+  if (type) {
+    if (!(out = compress_writer(fd, type, COMPRESS_LEVEL)))
+      return result_new(false, NULL, L"Can't compress: %s", strerror(errno));
+    ok = entry_dump(e, level, out);
+    ok = !fclose(out) && ok;
+  } else {
+    if (!(out = open_memstream(&buf, &length)))
+      return result_new(false, NULL, L"Couldn't allocate line buffer");
+    // Don't glue the entry to an unterminated last line
+    ok = (!size || ((pread(fd, &last, 1, size - 1) == 1) && ((last == '\n') ||
+          (putc('\n', out) != EOF)))) && entry_dump(e, level, out);
+    ok = !fclose(out) && ok;
+    ok = ok && ((n = write(fd, buf, length)) == (ssize_t)length);
+    free(buf);
+  }
+  if (!ok || fsync(fd))
+    return result_new(false, NULL, L"Can't append: %s", strerror(errno));
+
+  return result_new(true, NULL, L"Appended entry");
+}
+
+/** Replace a file with its copy that has an entry inserted at `at`
+ */
+static Result append_insert(int dir, const char *name, int fd, struct stat *st, off_t at,
+                            Entry *e) {
+  FILE *out;
+  char *tmp;
+  int copy;
+  bool ok;
+
+  if (!(tmp = malloc(strlen(name) + 24)))
+    return result_new(false, NULL, L"Couldn't allocate temporary name");
+  sprintf(tmp, ".%s.%d", name, (int)getpid());
+  if ((copy = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     st->st_mode & 07777)) < 0) {
+    free(tmp);
+    return result_new(false, NULL, L"Can't write copy of %s: %s", name, strerror(errno));
+  }
+  if (!(out = fdopen(copy, "w"))) {
+    close(copy);
+    unlinkat(dir, tmp, 0);
+    free(tmp);
+    return result_new(false, NULL, L"Can't write copy of %s: %s", name, strerror(errno));
+  }
+
+  ok = bytes_copy(fd, 0, at, out) && entry_dump(e, 1, out) &&
+       bytes_copy(fd, at, st->st_size, out) && !fflush(out) && !fsync(copy);
+  ok = !fclose(out) && ok;
+  ok = ok && !renameat(dir, tmp, dir, name);
+  if (!ok) {
+    unlinkat(dir, tmp, 0);
+    free(tmp);
+    return result_new(false, NULL, L"Can't write copy of %s: %s", name, strerror(errno));
+  }
+  free(tmp);
+
+  return result_new(true, NULL, L"Inserted entry");
+}
+
+/** Add a top level entry to a notebook directory as a new shard
+ */
+static Result append_shard(int dir, char **names, Entry *e) {
+  Result res;
+  FILE *fp;
+  char *name, *tmp;
+  int i, fd;
+  bool ok;
+
+  if (!(name = shard_name()))
+    return result_new(false, NULL, L"Couldn't allocate shard name");
+  if (!(tmp = malloc(sizeof(SHARD_MANIFEST) + 24))) {
+    free(name);
+    return result_new(false, NULL, L"Couldn't allocate temporary name");
+  }
+
+  // The shard first, so that the manifest never lists a missing file
+  fp = NULL;
+  ok = ((fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) >= 0) &&
+       (fp = fdopen(fd, "w")) && entry_dump(e, 0, fp) && !fflush(fp) && !fsync(fd);
+  if (fp)
+    ok = !fclose(fp) && ok;
+  else if (fd >= 0)
+    close(fd);
+  if (!ok) {
+    res = result_new(false, NULL, L"Can't write %s: %s", name, strerror(errno));
+    if (fd >= 0)
+      unlinkat(dir, name, 0);
+    goto cleanup;
+  }
+
+  sprintf(tmp, "." SHARD_MANIFEST ".%d", (int)getpid());
+  fp = NULL;
+  ok = ((fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) >= 0) &&
+       (fp = fdopen(fd, "w"));
+  for (i = 0; ok && names[i]; i++)
+    ok = fprintf(fp, "%s\n", names[i]) >= 0;
+  ok = ok && (fprintf(fp, "%s\n", name) >= 0) && !fflush(fp) && !fsync(fd);
+  if (fp)
+    ok = !fclose(fp) && ok;
+  else if (fd >= 0)
+    close(fd);
+  ok = ok && !renameat(dir, tmp, dir, SHARD_MANIFEST);
+  if (!ok) {
+    res = result_new(false, NULL, L"Can't write manifest: %s", strerror(errno));
+    if (fd >= 0)
+      unlinkat(dir, tmp, 0);
+    unlinkat(dir, name, 0);
+    goto cleanup;
+  }
+  fsync(dir);
+  res = result_new(true, NULL, L"Appended entry as %s", name);
+
+cleanup:
+  free(tmp);
+  free(name);
+  return res;
+}
+
+/** Check if a shard on disk already holds these items
+ *
+ * That's the case when they are a single range covering the whole file
+ * the shard was loaded from, and the file is still in place.
+ */
+static bool shard_clean(int dir, SnapItem *items, int count) {
+  struct stat st;
+  Source *src;
+
+  if ((count != 1) || !(src = items->range.src))
+    return false;
+  if (items->range.start || (items->range.end != src->size) || items->range.level)
+    return false;
+  if (fstatat(dir, items->shard, &st, 0))
+    return false;
+
+  return (st.st_dev == src->dev) && (st.st_ino == src->ino) && source_same(src);
+}
+
+/** Write items to a shard, replacing it by rename
+ */
+static bool shard_write(int dir, const char *name, SnapItem *items, int count) {
+  FILE *fp;
+  char *tmp;
+  int fd;
+  bool ok;
+
+  if (!(tmp = malloc(strlen(name) + 24)))
+    return false;
+  sprintf(tmp, ".%s.%d", name, (int)getpid());
+  if ((fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+    free(tmp);
+    return false;
+  }
+  if (!(fp = fdopen(fd, "w"))) {
+    close(fd);
+    unlinkat(dir, tmp, 0);
+    free(tmp);
+    return false;
+  }
+
+  ok = (items_dump(fp, items, count) == count) && !fflush(fp) && !fsync(fd);
+  ok = !fclose(fp) && ok;
+  ok = ok && !renameat(dir, tmp, dir, name);
+  if (!ok)
+    unlinkat(dir, tmp, 0);
+  free(tmp);
+
+  return ok;
+}
+
+/** Add a line to the tree being parsed
+ *
+ * @param line Line without the newline char, modified in place
+ * @param start Offset of the line in the source
+ */
+static Result parse_line(Parser *p, wchar_t *line, int length, off_t start) {
+  Result res;
+  Entry *new, *c;
+  wchar_t *data;
+  int tabs, level;
+
+  if ((tabs = parse_tabs(line, length)) < 0)
+    return result_new(false, NULL, L"Malformed input at line %d", p->line_nr);
+  level = tabs - p->base;
+
+  res = entry_new(length);
+  if (!res.success)
+    return res;
+  new = (Entry *)res.data;
+
+  if (!p->c) {
+    new->parent = p->parent;
+    p->first = new;
+  } else {
+    c = p->c;
+    if (p->level < level) {
+      if (level - p->level != 1) {
+        data_unload(new);
+        return result_new(false, NULL, L"Ambiguous indentation at line %d", p->line_nr);
+      }
+      new->parent = c;
+      c->child = new;
+      p->level = level;
+    } else {
+      while ((c->parent != p->parent) && (p->level != level)) {
+        parse_close(p, c, start);
+        c = c->parent;
+        --p->level;
+      }
+      if (p->level != level) {
+        data_unload(new);
+        return result_new(false, NULL, L"Couldn't find parent at line %d", p->line_nr);
+      }
+      parse_close(p, c, start);
+      new->parent = c->parent;
+      new->prev = c;
+      c->next = new;
+    }
+  }
+  p->c = c = new;
+  c->range.start = start;
+  c->range.level = tabs;
+
+  c->length = length - tabs - 2;
+  data = parse_marks(line + tabs + 2, &c->length, &c->crossed, &c->bold);
+  wcscpy(c->text, data);
+
+  return result_new(true, c, L"Parsed line %d", p->line_nr);
+}
+
+/** Set the range of an entry whose last child has been parsed
+ *
+ * @param end Offset of the line following the entry and its children
+ */
+static void parse_close(Parser *p, Entry *e, off_t end) {
+  if (!p->src)
+    return;
+  e->range.src = p->src;
+  e->range.end = end;
+  p->src->refs++;
+}
+
+/** Prepare a parser for a whole notebook
+ */
+static void parse_start(Parser *p) {
+  bzero(p, sizeof(Parser));
+  p->line_nr = 1;
+}
+
+/** Parse the next bytes of input
+ *
+ * Complete lines are parsed right where they are, only a line cut by
+ * the end of `data` is copied to be completed by the next call.
+ */
+static Result parse_feed(Parser *p, const char *data, size_t length) {
+  Result res;
+  const char *end, *nl;
+
+  end = data + length;
+  if (p->held) {
+    nl = memchr(data, '\n', length);
+    if (!parse_hold(p, data, nl ? (size_t)(nl - data + 1) : length))
+      return result_new(false, NULL, L"Couldn't allocate line buffer");
+    if (!nl)
+      return result_new(true, NULL, L"Line %d continues", p->line_nr);
+    data = nl + 1;
+    res = parse_text(p, p->hold, p->held);
+    p->held = 0;
+    if (!res.success)
+      return res;
+  }
+
+  while (data < end) {
+    if (!(nl = memchr(data, '\n', end - data))) {
+      if (!parse_hold(p, data, end - data))
+        return result_new(false, NULL, L"Couldn't allocate line buffer");
+      break;
+    }
+    res = parse_text(p, data, nl - data + 1);
+    if (!res.success)
+      return res;
+    data = nl + 1;
+  }
+
+  return result_new(true, NULL, L"Parsed up to line %d", p->line_nr);
+}
+
+/** Keep the start of a line cut by the end of a chunk
+ */
+static bool parse_hold(Parser *p, const char *data, size_t length) {
+  char *hold;
+  size_t size;
+
+  if (p->hold_size < p->held + length) {
+    size = p->hold_size ? p->hold_size : READ_CHUNK;
+    while (size < p->held + length)
+      size *= 2;
+    if (!(hold = realloc(p->hold, size)))
+      return false;
+    p->hold = hold;
+    p->hold_size = size;
+  }
+  memcpy(p->hold + p->held, data, length);
+  p->held += length;
+
+  return true;
+}
+
+/** Parse a line of raw input
+ *
+ * Lines deeper than the source depth aren't decoded at all, they only
+ * extend the byte range of the last parsed entry. Without a source
+ * everything is parsed and no ranges are kept.
+ *
+ * @param length Line length including the newline char, if any
+ */
+static Result parse_text(Parser *p, const char *text, size_t length) {
+  Result res;
+  wchar_t *line;
+  const char *from;
+  mbstate_t state;
+  size_t n;
+  off_t start;
+  int tabs;
+
+  start = p->pos;
+  p->pos += length;
+  if (length <= 1)
+    return result_new(true, NULL, L"Skipped empty line");
+  if (text[length - 1] == '\n')
+    --length;  // kill newline char
+
+  for (tabs = 0; (tabs < length) && (text[tabs] == '\t'); tabs++);
+  if (p->src && p->depth && (tabs >= p->base + p->depth)) {
+    if (!p->open) {
+      if (!p->c || (tabs - p->base != p->level + 1))
+        return result_new(false, NULL, L"Ambiguous indentation at line %d", p->line_nr);
+      if (!(p->open = lazy_new(p->src, start, tabs, p->line_nr)))
+        return result_new(false, NULL, L"Couldn't allocate Range");
+      p->c->lazy = p->open;
+    }
+    p->open->end = p->pos;
+    ++p->line_nr;
+    return result_new(true, NULL, L"Skipped line %d", p->line_nr - 1);
+  }
+  p->open = NULL;
+
+  if (p->size < length + 1) {
+    if (!(line = realloc(p->line, (length + 1) * sizeof(wchar_t))))
+      return result_new(false, NULL, L"Couldn't allocate line buffer");
+    p->line = line;
+    p->size = length + 1;
+  }
+  from = text;
+  bzero(&state, sizeof(mbstate_t));
+  n = mbsnrtowcs(p->line, &from, length, p->size, &state);
+  if ((n == (size_t)-1) || !mbsinit(&state))
+    return result_new(false, NULL, L"Invalid character at line %d", p->line_nr);
+  p->line[n] = L'\0';
+
+  res = parse_line(p, p->line, n, start);
+  if (res.success)
+    ++p->line_nr;
+
+  return res;
+}
+
+/** Parse the rest of the input and free parser buffers
+ *
+ * @return The parsed entries
+ */
+static Result parse_end(Parser *p) {
+  Result res;
+
+  if (p->held) {
+    res = parse_text(p, p->hold, p->held);
+    p->held = 0;
+    if (!res.success)
+      return parse_fail(p, res);
+  }
+  for (; p->c && (p->c != p->parent); p->c = p->c->parent)
+    parse_close(p, p->c, p->pos);
+  free(p->hold);
+  free(p->line);
+
+  return result_new(true, p->first, L"Parsed %d lines", p->line_nr);
+}
+
+/** Give up parsing, freeing parser buffers and anything parsed
+ *
+ * @return `res`, to pass the error on
+ */
+static Result parse_fail(Parser *p, Result res) {
+  free(p->hold);
+  free(p->line);
+  if (p->first) data_unload(p->first);
+
+  return res;
+}
+
+/** Parse everything a reader has to offer
+ *
+ * After every chunk the number of bytes read so far is stored in
+ * ctl->done and ctl->cancel is checked to stop early. On failure
+ * anything parsed so far is freed.
+ */
+static Result parse_read(Parser *p, Reader *rd, LoadCtl *ctl) {
+  Result res;
+  ssize_t n;
+
+  while ((n = reader_fill(rd)) > 0) {
+    if (ctl) {
+      if (ctl->cancel)
+        return parse_fail(p, result_new(false, NULL, L"Loading cancelled at line %d",
+                                        p->line_nr));
+      ctl->done = rd->z ? decompress_offset(rd->z) : rd->next;
+    }
+    if (!(res = parse_feed(p, rd->chunk, n)).success)
+      return parse_fail(p, res);
+  }
+  if (n < 0)
+    return parse_fail(p, result_new(false, NULL, L"File access error at line %d", p->line_nr));
+
+  return parse_end(p);
+}
+
+/** Parse input from a stream or a file descriptor
+ *
+ * @param fp Stream to read, or NULL to read `fd` itself
+ * @param lazy Leave levels below `depth` for later, see data_load_lazy()
+ */
+static Result input_load(FILE *fp, int fd, int depth, bool lazy, LoadCtl *ctl) {
+  Result res;
+  Reader rd;
+  Parser p;
+  Source *src;
+  struct stat st;
+  compress_t type;
+  off_t pos;
+
+  if (fstat(fd, &st))
+    return result_new(false, NULL, L"Can't access input: %s", strerror(errno));
+  if (S_ISDIR(st.st_mode))
+    return shards_load(fd, lazy ? depth : 0, ctl);
+  pos = fp ? ftello(fp) : lseek(fd, 0, SEEK_CUR);
+  if ((pos >= 0) && (type = compress_detect(fd, pos)))
+    return compressed_load(fd, pos, type, ctl);
+  src = NULL;
+  if (lazy && (pos >= 0) && S_ISREG(st.st_mode)) {
+    if (!(src = source_new(fd, depth)))
+      return result_new(false, NULL, L"Couldn't keep input open: %s", strerror(errno));
+  }
+  if (!reader_open(&rd, fp, fp ? -1 : fd, pos < 0 ? 0 : pos, -1)) {
+    if (src) source_unref(src);
+    return result_new(false, NULL, L"Couldn't allocate read buffer");
+  }
+
+  parse_start(&p);
+  p.pos = rd.pos;
+  p.src = src;
+  p.depth = depth;
+  res = parse_read(&p, &rd, ctl);
+
+  reader_close(&rd);
+  if (src) source_unref(src);
+
+  return res;
+}
+
+/** Parse compressed input whole
+ *
+ * @param pos Offset the compressed data starts at
+ */
+static Result compressed_load(int fd, off_t pos, compress_t type, LoadCtl *ctl) {
+  Result res;
+  Reader rd;
+  Parser p;
+
+  if (!reader_open(&rd, NULL, -1, 0, 0))
+    return result_new(false, NULL, L"Couldn't allocate read buffer");
+  if (!(rd.z = decompress_open(fd, pos, type))) {
+    res = result_new(false, NULL, L"Can't decompress: %s", strerror(errno));
+    reader_close(&rd);
+    return res;
+  }
+
+  parse_start(&p);
+  res = parse_read(&p, &rd, ctl);
+  if (!res.success && ((rd.error == EILSEQ) || (rd.error == ENODATA)))
+    res = result_new(false, NULL, L"Corrupt compressed data at line %d", p.line_nr);
+  reader_close(&rd);
+
+  return res;
+}
+
+/** Count the indentation of an entry line
+ *
+ * @return Number of tabs, or -1 if the line isn't an entry
+ */
+static int parse_tabs(wchar_t *line, int length) {
+  int tabs;
+
+  tabs = 0;
+  while ((line[tabs] == L'\t') && (tabs < length))
+    tabs++;
+  if (tabs >= (length - 2))
+    return -1;
+  if (!((line[tabs] == L'-') && (line[tabs+1] == L' ')))
+    return -1;
+
+  return tabs;
+}
+
+/** Strip crossed and bold markers from entry text in place
+ *
+ * @param length Text length, updated to the length without markers
+ * @return Start of the text without markers
+ */
+static wchar_t *parse_marks(wchar_t *data, int *length, bool *crossed, bool *bold) {
+  *crossed = *bold = false;
+  if (*length >= 4) {
+    if ((data[0] == L'~') && (data[1] == L'~') &&
+        (data[*length-1] == L'~') && (data[*length-2] == L'~')) {
+      *crossed = true;
+      data[*length-2] = L'\0';
+      *length -= 4;
+      data += 2;
+    }
+  }
+  if (*length >= 4) {
+    if ((data[0] == L'*') && (data[1] == L'*') &&
+        (data[*length-1] == L'*') && (data[*length-2] == L'*')) {
+      *bold = true;
+      data[*length-2] = L'\0';
+      *length -= 4;
+      data += 2;
+    }
+  }
+
+  return data;
+}
+
+/** Prepare reading lines
+ *
+ * @param fp Stream to read till its end, or NULL to read `fd`
+ * @param fd File to read from `start` to `end` with pread, or till its
+ * end with read if `end` is -1
+ */
+static bool reader_open(Reader *r, FILE *fp, int fd, off_t start, off_t end) {
+  bzero(r, sizeof(Reader));
+  r->fp = fp;
+  r->fd = fd;
+  r->pos = r->next = start;
+  r->end = end;
+  if (!(r->chunk = malloc(READ_CHUNK)))
+    return false;
+
+  return true;
+}
+
+/** Free reader buffers
+ */
+static void reader_close(Reader *r) {
+  decompress_close(r->z);
+  free(r->chunk);
+  free(r->line);
+}
+
+/** Read next line into r->line, including the newline char
+ *
+ * @return Line length, 0 at the end or -1 on error
+ */
+static ssize_t reader_line(Reader *r) {
+  ssize_t n;
+  size_t length, take;
+  char *nl, *line;
+
+  if (r->fp) {
+    if ((n = getline(&r->line, &r->size, r->fp)) < 0)
+      return ferror(r->fp) ? -1 : 0;
+    r->pos += n;
+    return n;
+  }
+
+  length = 0;
+  for (;;) {
+    if ((r->at == r->fill) && ((n = reader_fill(r)) <= 0)) {
+      if (n < 0)
+        return -1;
+      break;
+    }
+    nl = memchr(r->chunk + r->at, '\n', r->fill - r->at);
+    take = nl ? (size_t)(nl - r->chunk - r->at + 1) : r->fill - r->at;
+    if (r->size < length + take + 1) {
+      if (!(line = realloc(r->line, length + take + 1)))
+        return -1;
+      r->line = line;
+      r->size = length + take + 1;
+    }
+    memcpy(r->line + length, r->chunk + r->at, take);
+    length += take;
+    r->at += take;
+    if (nl)
+      break;
+  }
+  if (length)
+    r->line[length] = '\0';
+  r->pos += length;
+
+  return length;
+}
+
+/** Read the next chunk of a stream, a file or of compressed data
+ *
+ * @return Bytes read, 0 at the end or -1 on error
+ */
+static ssize_t reader_fill(Reader *r) {
+  ssize_t n;
+  size_t take;
+
+  if (r->z) {
+    if ((n = decompress_read(r->z, r->chunk, READ_CHUNK)) < 0) {
+      r->error = errno;
+      return -1;
+    }
+    if (!n)
+      return 0;
+  } else if (r->fp) {
+    if (!(n = fread(r->chunk, 1, READ_CHUNK, r->fp)))
+      return ferror(r->fp) ? -1 : 0;
+  } else if (r->end < 0) {
+    while (((n = read(r->fd, r->chunk, READ_CHUNK)) < 0) && (errno == EINTR));
+    if (n <= 0)
+      return n;
+  } else {
+    if (r->next >= r->end)
+      return 0;
+    take = (r->end - r->next < READ_CHUNK) ? r->end - r->next : READ_CHUNK;
+    if ((n = pread(r->fd, r->chunk, take, r->next)) <= 0) {
+      if (!n)
+        errno = ENODATA;  // file got shorter
+      return -1;
+    }
+  }
+  r->next += n;
+  r->fill = n;
+  r->at = 0;
+
+  return n;
+}
+
+/** Read a single byte
+ *
+ * @return The byte, or EOF at the end and on errors, which set r->error
+ */
+static int reader_getc(Reader *r) {
+  ssize_t n;
+  int c;
+
+  if (r->fp) {
+    if (((c = getc_unlocked(r->fp)) == EOF) && ferror(r->fp))
+      r->error = EIO;
+  } else if ((r->at == r->fill) && ((n = reader_fill(r)) <= 0)) {
+    if ((n < 0) && !r->error)
+      r->error = errno ? errno : EIO;
+    c = EOF;
+  } else
+    c = (unsigned char)r->chunk[r->at++];
+  if (c != EOF)
+    ++r->pos;
+
+  return c;
+}
+
+/** Keep a file open for reading unparsed entries
+ */
+static Source *source_new(int fd, int depth) {
+  struct stat st;
+  Source *s;
+
+  if (!(s = calloc(1, sizeof(Source))))
+    return NULL;
+  if (((s->fd = dup(fd)) < 0) || fstat(s->fd, &st)) {
+    if (s->fd >= 0)
+      close(s->fd);
+    free(s);
+    return NULL;
+  }
+  s->depth = depth;
+  s->refs = 1;
+  s->dev = st.st_dev;
+  s->ino = st.st_ino;
+  s->size = st.st_size;
+  s->mtime = st.st_mtim;
+
+  return s;
+}
+
+/** Drop a reference to a source, closing it after the last one
+ */
+static void source_unref(Source *s) {
+  if (--s->refs)
+    return;
+  close(s->fd);
+  free(s);
+}
+
+/** Check if a source is still what was loaded
+ *
+ * Files replaced by rename stay intact, only in place modifications
+ * are caught here. Safe to call from another thread.
+ */
+static bool source_same(Source *s) {
+  struct stat st;
+
+  if (fstat(s->fd, &st))
+    return false;
+  return (st.st_dev == s->dev) && (st.st_ino == s->ino) && (st.st_size == s->size) &&
+         (st.st_mtim.tv_sec == s->mtime.tv_sec) && (st.st_mtim.tv_nsec == s->mtime.tv_nsec);
+}
+
+/** Check if ranges of a source can be copied
+ *
+ * The file is only looked at once for every dump or snapshot.
+ */
+static bool source_valid(Source *s) {
+  if (s->checked != Checks) {
+    s->checked = Checks;
+    s->valid = source_same(s);
+  }
+
+  return s->valid;
+}
+
+/** Forget the source range of an entry
+ */
+static void range_clear(Range *r) {
+  if (!r->src)
+    return;
+  source_unref(r->src);
+  r->src = NULL;
+}
+
+/** Copy a range of the source to the output byte for byte
+ *
+ * Where possible the copy is done by the kernel, without the data ever
+ * reaching this process. Streams without a file descriptor, such as
+ * compressing ones, get the data through stdio. A missing newline at the
+ * end is added.
+ */
+static bool range_copy(FILE *output, Range *r) {
+  char last;
+  int fd;
+
+  if (!bytes_copy(r->src->fd, r->start, r->end, output))
+    return false;
+
+  fd = fileno(output);
+  if ((pread(r->src->fd, &last, 1, r->end - 1) != 1) ||
+      ((last != '\n') && ((fd < 0) ? (putc('\n', output) == EOF) : (write(fd, "\n", 1) != 1))))
+    return false;
+
+  return source_same(r->src);
+}
+
+/** Copy bytes from `at` to `end` of a file to the output
+ *
+ * The output is flushed first and written to directly when it has a
+ * file descriptor.
+ */
+static bool bytes_copy(int from, off_t at, off_t end, FILE *output) {
+  ssize_t n, w, done;
+  size_t take;
+  char *buf;
+  int fd;
+
+  if (fflush(output))
+    return false;
+  fd = fileno(output);
+
+#ifdef __linux__
+  while ((fd >= 0) && (at < end) &&
+         (copy_file_range(from, &at, fd, NULL, end - at, 0) > 0));
+#endif
+  // Not supported between these files, copy what's left by hand
+  if (at < end) {
+    if (!(buf = malloc(READ_CHUNK)))
+      return false;
+    while (at < end) {
+      take = (end - at < READ_CHUNK) ? end - at : READ_CHUNK;
+      if ((n = pread(from, buf, take, at)) <= 0)
+        break;
+      if (fd < 0)
+        done = fwrite(buf, 1, n, output);
+      else
+        for (done = 0; done < n; done += w)
+          if ((w = write(fd, buf + done, n - done)) < 0)
+            break;
+      if (done < n)
+        break;
+      at += n;
+    }
+    free(buf);
+    if (at < end)
+      return false;
+  }
+
+  return true;
+}
+
+/** Extend a range with the one right after it, if possible
+ *
+ * @param level Level `r` is to be dumped at
+ * @param next_level Level `next` is to be dumped at
+ * @return true if `next` is now part of `r`
+ */
+static bool range_join(Range *r, int level, Range *next, int next_level) {
+  if (!r->src || (r->src != next->src) || (r->end != next->start))
+    return false;
+  if ((level != r->level) || (next_level != next->level))
+    return false;
+  r->end = next->end;
+
+  return true;
+}
+
+/** Make a new range of unparsed lines
+ *
+ * @param level Tabs before the first line
+ * @param line Number of the first line
+ */
+static Range *lazy_new(Source *src, off_t start, int level, int line) {
+  Range *l;
+
+  if (!(l = malloc(sizeof(Range))))
+    return NULL;
+  l->src = src;
+  l->start = l->end = start;
+  l->level = level;
+  l->line = line;
+  src->refs++;
+
+  return l;
+}
+
+/** Free a range of unparsed lines
+ */
+static void lazy_free(Range *l) {
+  if (!l)
+    return;
+  source_unref(l->src);
+  free(l);
+}
+
+/** Read next non-empty unparsed line
+ *
+ * @param level Tabs to strip off
+ * @param text Rest of the line, without the newline char
+ * @return Line length, 0 at the end or -1 on error
+ */
+static ssize_t lazy_line(Reader *r, int level, char **text) {
+  ssize_t n;
+  int t;
+
+  while ((n = reader_line(r)) > 0) {
+    if (n <= 1) continue;
+    if (r->line[n - 1] == '\n')
+      r->line[--n] = '\0';
+    for (t = 0; (t < level) && (r->line[t] == '\t'); t++);
+    *text = r->line + t;
+    return n;
+  }
+
+  return n;
+}
+
+/** Write a range of the source at a level
+ *
+ * Ranges already at that level are copied as they are, otherwise the
+ * indentation of every line is changed on the way. Either way it fails
+ * if the source was modified in place meanwhile.
+ */
+static bool range_dump(FILE *output, Range *l, int level) {
+  Reader rd;
+  ssize_t n;
+  char *text;
+  int t;
+
+  if (level == l->level)
+    return range_copy(output, l);
+  if (!reader_open(&rd, NULL, l->src->fd, l->start, l->end))
+    return false;
+  while ((n = lazy_line(&rd, l->level, &text)) > 0) {
+    for (t = level; t > 0; --t)
+      if (putc('\t', output) == EOF) break;
+    if ((t > 0) || (fputs(text, output) == EOF) || (putc('\n', output) == EOF)) {
+      n = -1;
+      break;
+    }
+  }
+  reader_close(&rd);
+
+  return (n == 0) && source_same(l->src);
+}
+
+/** Hash unparsed lines, regardless of their level
+ */
+static unsigned long lazy_hash(Range *l) {
+  unsigned long hash;
+  Reader rd;
+  char *text;
+
+  hash = 14695981039346656037UL;
+  if (!reader_open(&rd, NULL, l->src->fd, l->start, l->end))
+    return hash;
+  while (lazy_line(&rd, l->level, &text) > 0) {
+    for (; *text; text++)
+      hash = (hash ^ (unsigned char)*text) * 1099511628211UL;
+    hash = (hash ^ '\n') * 1099511628211UL;
+  }
+  reader_close(&rd);
+
+  return hash;
+}
+
+/** Compare unparsed lines, regardless of their level
+ */
+static bool lazy_same(Range *a, Range *b) {
+  Reader ra, rb;
+  ssize_t na, nb;
+  char *ta, *tb;
+  bool same;
+
+  if (!reader_open(&ra, NULL, a->src->fd, a->start, a->end))
+    return false;
+  if (!reader_open(&rb, NULL, b->src->fd, b->start, b->end)) {
+    reader_close(&ra);
+    return false;
+  }
+  do {
+    na = lazy_line(&ra, a->level, &ta);
+    nb = lazy_line(&rb, b->level, &tb);
+    same = (na >= 0) && (nb >= 0) && ((na > 0) == (nb > 0)) && (!na || !strcmp(ta, tb));
+  } while (same && na);
+  reader_close(&ra);
+  reader_close(&rb);
+
+  return same;
+}
+
+/** Free a tree recursively
+ */
+void data_unload(Entry *e) {
+  Entry *next;
+
+  // Siblings in a loop, so that long lists don't exhaust the stack
+  for (; e; e = next) {
+    next = e->next;
+    if (e->child)
+      data_unload(e->child);
+
+    lazy_free(e->lazy);
+    range_clear(&e->range);
+    free(e->shard);
+    text_free(e);
+    entry_free(e);
+  }
+}
+
+/** Get the modification counter
+ *
+ * Comparing two readings tells whether anything changed in between.
+ */
+unsigned long data_changes() {
+  return Changes;
+}
+
+/** Note a modification of an entry
+ *
+ * The entry and all its parents no longer match their source ranges.
+ * Everything in here calls it on success, code that modifies entries
+ * directly has to call it as well.
+ *
+ * @param e Modified entry, or NULL if only the top level list changed
+ */
+void entry_touch(Entry *e) {
+  for (; e; e = e->parent)
+    range_clear(&e->range);
+  ++Changes;
+}
+
+/** Write a single entry line
+ *
+ * Output is byte oriented, so that it works on any stream.
+ */
+static bool dump_line(FILE *output, int level, bool crossed, bool bold,
+                      wchar_t *text, int length) {
+  char buf[DUMP_CHUNK + MB_LEN_MAX];
+  mbstate_t state;
+  size_t fill, n;
+  int t, i;
+
+  for (t = level; t > 0; --t)
+    if (putc('\t', output) == EOF) return false;
+
+  if (fputs("- ", output) == EOF) return false;
+
+  if (crossed)
+    if (fputs("~~", output) == EOF) return false;
+  if (bold)
+    if (fputs("**", output) == EOF) return false;
+
+  bzero(&state, sizeof(mbstate_t));
+  for (i = fill = 0; (i < length) && text[i]; ++i) {
+    if ((n = wcrtomb(buf + fill, text[i], &state)) == (size_t)-1) return false;
+    fill += n;
+    if (fill >= DUMP_CHUNK) {
+      if (fwrite(buf, 1, fill, output) != fill) return false;
+      fill = 0;
+    }
+  }
+  if (i < length) return false;
+  if (fill && (fwrite(buf, 1, fill, output) != fill)) return false;
+
+  if (bold)
+    if (fputs("**", output) == EOF) return false;
+  if (crossed)
+    if (fputs("~~", output) == EOF) return false;
+
+  if (putc('\n', output) == EOF) return false;
+
+  return true;
+}
+
+/** Output a single entry, without its children
+ */
+bool entry_dump(Entry *e, int level, FILE *output) {
+  return dump_line(output, level, e->crossed, e->bold, e->text, e->length);
+}
+
+/** Output data
+ *
+ * Unchanged entries are copied from their source along with all their
+ * children, adjacent ones in one go.
+ */
+Result data_dump(Entry *e, FILE *output) {
+  Range copy;
+  bool run;
+  int level, copy_level, line_nr;
+
+  if (is_dir(output))
+    return data_dump_dir(e, fileno(output));
+
+  run = true;
+  level = line_nr = copy_level = 0;
+  copy.src = NULL;
+  ++Checks;
+
+  while (run) {
+    ++line_nr;
+
+    if (e->range.src && source_valid(e->range.src)) {
+      if (!range_join(&copy, copy_level, &e->range, level)) {
+        if (copy.src && !range_dump(output, &copy, copy_level))
+          goto error;
+        copy = e->range;
+        copy_level = level;
+      }
+    } else {
+      if (copy.src && !range_dump(output, &copy, copy_level))
+        goto error;
+      copy.src = NULL;
+      if (!dump_line(output, level, e->crossed, e->bold, e->text, e->length))
+        goto error;
+      if (e->lazy && !range_dump(output, e->lazy, level + 1))
+        goto error;
+    }
+
+    if (e->child && !copy.src) {
+      e = e->child;
+      ++level;
+    } else if (e->next)
+      e = e->next;
+    else {
+      run = false;
+      while (e->parent) {
+        e = e->parent;
+        --level;
+        if (e->next) {
+          e = e->next;
+          run = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (copy.src && !range_dump(output, &copy, copy_level))
+    goto error;
+
+  return result_new(true, NULL, L"Written %d entries", line_nr);
+
+error:
+  return result_new(false, NULL, L"Error occurred. May have written %d entries", line_nr);
+}
+
+/** Recognise an export format by its name or by a file name extension
+ */
+bool export_type(const char *name, export_t *format) {
+  const char *ext;
+
+  ext = (ext = strrchr(name, '.')) ? ext + 1 : name;
+  if (!strcasecmp(ext, "html") || !strcasecmp(ext, "htm"))
+    *format = EXPORT_HTML;
+  else if (!strcasecmp(ext, "json"))
+    *format = EXPORT_JSON;
+  else if (!strcasecmp(ext, "opml"))
+    *format = EXPORT_OPML;
+  else
+    return false;
+
+  return true;
+}
+
+/** Start an export, see export_entry()
+ */
+bool export_start(Export *x, export_t format, FILE *output) {
+  x->format = format;
+  x->output = output;
+  x->level = -1;
+  x->shift = 0;
+  x->count = 0;
+
+  switch (format) {
+    case EXPORT_HTML:
+      return fputs("<ul>\n", output) != EOF;
+    case EXPORT_JSON:
+      return putc('[', output) != EOF;
+    case EXPORT_OPML:
+      return fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<opml version=\"2.0\">\n"
+                   "<head></head>\n<body>\n", output) != EOF;
+  }
+
+  return false;
+}
+
+/** Export a single entry
+ *
+ * Entries have to come in the same order as they are dumped in, which
+ * is how data_scan() passes them, so this works as its callback with
+ * the Export as `arg`. Only the level of the last entry is kept, so
+ * memory use doesn't depend on the size of the tree. An entry is
+ * closed only once the next one shows whether it has children.
+ *
+ * @param level Level of the entry, shifted by x->shift
+ */
+bool export_entry(Entry *e, int level, void *arg) {
+  Export *x;
+
+  x = (Export *)arg;
+  level += x->shift;
+  if (level > x->level + 1)
+    return false;
+  if (level > x->level) {
+    if (level && !export_open(x, level))
+      return false;
+  } else if (!export_unwind(x, level) ||
+             ((x->format == EXPORT_JSON) && (putc(',', x->output) == EOF)))
+    return false;
+  if (!export_item(x, e, level))
+    return false;
+  x->level = level;
+  ++x->count;
+
+  return true;
+}
+
+/** Close all open entries and finish the export
+ */
+bool export_finish(Export *x) {
+  if ((x->level >= 0) && !export_unwind(x, 0))
+    return false;
+  if (!export_shut(x, 0))
+    return false;
+  if (x->format == EXPORT_JSON)
+    return putc('\n', x->output) != EOF;
+
+  return true;
+}
+
+/** Export a tree
+ *
+ * Texts are taken from memory, unparsed parts are read from their
+ * source line by line. Nothing is kept but the current level.
+ */
+Result data_export(Entry *e, export_t format, FILE *output) {
+  Export x;
+  int level;
+  bool run;
+
+  if (!export_start(&x, format, output))
+    goto error;
+
+  run = true;
+  level = 0;
+  while (run) {
+    if (!export_entry(e, level, &x) || (e->lazy && !export_lazy(&x, e->lazy, level + 1)))
+      goto error;
+
+    if (e->child) {
+      e = e->child;
+      ++level;
+    } else if (e->next)
+      e = e->next;
+    else {
+      run = false;
+      while (e->parent) {
+        e = e->parent;
+        --level;
+        if (e->next) {
+          e = e->next;
+          run = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (!export_finish(&x))
+    goto error;
+
+  return result_new(true, NULL, L"Exported %ld entries", x.count);
+
+error:
+  return result_new(false, NULL, L"Error occurred. May have exported %ld entries", x.count);
+}
+
+/** Export unparsed entries of a range
+ *
+ * @param level Level of the first entry in the range
+ */
+static bool export_lazy(Export *x, Range *l, int level) {
+  Result res;
+  Reader rd;
+  Scan s;
+  int shift;
+
+  if (!reader_open(&rd, NULL, l->src->fd, l->start, l->end))
+    return false;
+  s.fn = export_entry;
+  s.arg = x;
+  s.stopped = false;
+  s.base = l->level;
+  s.line = l->line;
+  shift = x->shift;
+  x->shift = level;
+  res = scan_lines(&rd, &s);
+  x->shift = shift;
+  reader_close(&rd);
+
+  return res.success && !s.stopped;
+}
+
+/** Open a list of children of the last entry
+ */
+static bool export_open(Export *x, int level) {
+  switch (x->format) {
+    case EXPORT_HTML:
+      return (putc('\n', x->output) != EOF) && export_tabs(x->output, level) &&
+             (fputs("<ul>\n", x->output) != EOF);
+    case EXPORT_JSON:
+      return fputs(", \"children\": [", x->output) != EOF;
+    case EXPORT_OPML:
+      return fputs(">\n", x->output) != EOF;
+  }
+
+  return false;
+}
+
+/** Close a list, after its last entry was closed
+ */
+static bool export_shut(Export *x, int level) {
+  switch (x->format) {
+    case EXPORT_HTML:
+      return export_tabs(x->output, level) && (fputs("</ul>\n", x->output) != EOF);
+    case EXPORT_JSON:
+      return (putc('\n', x->output) != EOF) && export_tabs(x->output, level) &&
+             (putc(']', x->output) != EOF);
+    case EXPORT_OPML:
+      return level || (fputs("</body>\n</opml>\n", x->output) != EOF);
+  }
+
+  return false;
+}
+
+/** Write an entry, leaving it open for its children
+ *
+ * Crossed entries are struck through in HTML and marked complete in
+ * OPML, the way outliners do it. Bold ones are strong in HTML and
+ * wrapped in bold markup in OPML text.
+ */
+static bool export_item(Export *x, Entry *e, int level) {
+  FILE *out;
+
+  out = x->output;
+  switch (x->format) {
+    case EXPORT_HTML:
+      return export_tabs(out, level + 1) && (fputs("<li>", out) != EOF) &&
+             (!e->crossed || (fputs("<del>", out) != EOF)) &&
+             (!e->bold || (fputs("<strong>", out) != EOF)) &&
+             export_text(x, e->text, e->length) &&
+             (!e->bold || (fputs("</strong>", out) != EOF)) &&
+             (!e->crossed || (fputs("</del>", out) != EOF));
+    case EXPORT_JSON:
+      return (putc('\n', out) != EOF) && export_tabs(out, level + 1) &&
+             (fputs("{\"text\": \"", out) != EOF) && export_text(x, e->text, e->length) &&
+             (fprintf(out, "\", \"crossed\": %s, \"bold\": %s",
+                      e->crossed ? "true" : "false", e->bold ? "true" : "false") > 0);
+    case EXPORT_OPML:
+      return export_tabs(out, level + 1) && (fputs("<outline text=\"", out) != EOF) &&
+             (!e->bold || (fputs("&lt;b&gt;", out) != EOF)) &&
+             export_text(x, e->text, e->length) &&
+             (!e->bold || (fputs("&lt;/b&gt;", out) != EOF)) && (putc('"', out) != EOF) &&
+             (!e->crossed || (fputs(" _complete=\"true\"", out) != EOF));
+  }
+
+  return false;
+}
+
+/** Close an entry
+ *
+ * @param leaf Whether the entry has no children
+ */
+static bool export_close(Export *x, int level, bool leaf) {
+  switch (x->format) {
+    case EXPORT_HTML:
+      return (leaf || export_tabs(x->output, level + 1)) && (fputs("</li>\n", x->output) != EOF);
+    case EXPORT_JSON:
+      return putc('}', x->output) != EOF;
+    case EXPORT_OPML:
+      return leaf ? (fputs("/>\n", x->output) != EOF) :
+             (export_tabs(x->output, level + 1) && (fputs("</outline>\n", x->output) != EOF));
+  }
+
+  return false;
+}
+
+/** Close open entries and lists down to an entry at `level`
+ */
+static bool export_unwind(Export *x, int level) {
+  int l;
+
+  for (l = x->level; l >= level; --l)
+    if (((l < x->level) && !export_shut(x, l + 1)) || !export_close(x, l, l == x->level))
+      return false;
+
+  return true;
+}
+
+/** Write indentation
+ */
+static bool export_tabs(FILE *output, int count) {
+  for (; count > 0; --count)
+    if (putc('\t', output) == EOF) return false;
+
+  return true;
+}
+
+/** Write entry text, escaped for the export format
+ */
+static bool export_text(Export *x, wchar_t *text, int length) {
+  char buf[DUMP_CHUNK + MB_LEN_MAX + ESCAPE_MAX];
+  mbstate_t state;
+  size_t fill, n;
+  int i;
+
+  bzero(&state, sizeof(mbstate_t));
+  for (i = fill = 0; (i < length) && text[i]; ++i) {
+    if (!(n = export_escape(x->format, text[i], buf + fill)) &&
+        ((n = wcrtomb(buf + fill, text[i], &state)) == (size_t)-1))
+      return false;
+    fill += n;
+    if (fill >= DUMP_CHUNK) {
+      if (fwrite(buf, 1, fill, x->output) != fill) return false;
+      fill = 0;
+    }
+  }
+  if (fill && (fwrite(buf, 1, fill, x->output) != fill)) return false;
+
+  return true;
+}
+
+/** Escape a char if the export format needs it
+ *
+ * @param out Buffer for at least ESCAPE_MAX bytes
+ * @return Length of the escape, 0 if the char goes as it is
+ */
+static int export_escape(export_t format, wchar_t c, char *out) {
+  if (format == EXPORT_JSON) {
+    if ((c == L'"') || (c == L'\\'))
+      return sprintf(out, "\\%c", (char)c);
+    if (c < 0x20)
+      return sprintf(out, "\\u%04x", (unsigned)c);
+    return 0;
+  }
+
+  switch (c) {
+    case L'&':
+      return sprintf(out, "&amp;");
+    case L'<':
+      return sprintf(out, "&lt;");
+    case L'>':
+      return sprintf(out, "&gt;");
+    case L'"':
+      return sprintf(out, "&quot;");
+    case L'\t':
+      return sprintf(out, "&#9;");
+  }
+  // Other control chars aren't allowed in XML at all
+  if (c < 0x20)
+    return sprintf(out, " ");
+
+  return 0;
+}
+
+/** Build a tree from an outline exported by another program
+ *
+ * The input is parsed as a stream, keeping nothing but the current
+ * string, so memory use depends only on the size of the tree. JSON is
+ * expected as written by data_export(): a list of entry objects, or a
+ * single one, with other fields skipped. Of OPML only outline elements
+ * with their text and _complete attributes are used. Compressed input
+ * is read the same way as when loading.
+ *
+ * @param format EXPORT_JSON or EXPORT_OPML
+ * @return First top level entry, NULL for an empty outline
+ */
+Result data_import(FILE *input, export_t format) {
+  Import im;
+  Reader rd;
+  compress_t type;
+  off_t pos;
+  bool ok;
+
+  if (format == EXPORT_HTML)
+    return result_new(false, NULL, L"HTML can't be imported");
+
+  pos = ftello(input);
+  type = (pos >= 0) ? compress_detect(fileno(input), pos) : COMPRESS_NONE;
+  if (!reader_open(&rd, type ? NULL : input, -1, pos < 0 ? 0 : pos, 0))
+    return result_new(false, NULL, L"Couldn't allocate read buffer");
+  bzero(&im, sizeof(Import));
+  if (type && !(rd.z = decompress_open(fileno(input), pos, type))) {
+    im.res = result_new(false, NULL, L"Can't decompress: %s", strerror(errno));
+    reader_close(&rd);
+    return im.res;
+  }
+
+  im.rd = &rd;
+  im.line = 1;
+  import_next(&im);
+  ok = (format == EXPORT_JSON) ? json_import(&im) : opml_import(&im);
+  if (ok)
+    im.res = result_new(true, im.first, L"Imported %ld entries", im.count);
+  else if (im.first)
+    data_unload(im.first);
+  free(im.text);
+  reader_close(&rd);
+
+  return im.res;
+}
+
+/** Move on to the next input byte
+ */
+static void import_next(Import *im) {
+  if (im->c == '\n') {
+    ++im->line;
+    im->col = 0;
+  }
+  im->c = reader_getc(im->rd);
+  ++im->col;
+}
+
+/** Skip whitespace
+ */
+static void import_space(Import *im) {
+  while ((im->c == ' ') || (im->c == '\t') || (im->c == '\n') || (im->c == '\r'))
+    import_next(im);
+}
 
-  ret.success = success;
-  ret.data = data;
+/** Stop the import with an error at the current byte
+ *
+ * @return false
+ */
+static bool import_fail(Import *im, const wchar_t *what) {
+  if ((im->c == EOF) && ((im->rd->error == EILSEQ) || (im->rd->error == ENODATA)) && im->rd->z)
+    im->res = result_new(false, NULL, L"Corrupt compressed data");
+  else if ((im->c == EOF) && im->rd->error)
+    im->res = result_new(false, NULL, L"File access error at line %d", im->line);
+  else
+    im->res = result_new(false, NULL, L"%S at line %d, column %d", what, im->line, im->col);
 
-  va_start(args, fmt);
-  vswprintf(ret.msg, ERR_MAX_LEN, fmt, args);
-  va_end(args);
+  return false;
+}
 
-  return ret;
+/** Make sure the current string can take another char
+ */
+static bool import_room(Import *im) {
+  char *text;
+  size_t size;
+
+  if (im->length + MB_LEN_MAX + 1 <= im->size)
+    return true;
+  size = im->size ? 2 * im->size : 256;
+  if (!(text = realloc(im->text, size)))
+    return import_fail(im, L"Couldn't allocate text buffer");
+  im->text = text;
+  im->size = size;
+
+  return true;
 }
 
-/** Create new entry
+/** Add a byte to the current string
  *
- * New entry is safely zeroed.
+ * Entries are single lines, so control chars become spaces.
  */
-Result entry_new(int length) {
-  Entry *new;
+static bool import_byte(Import *im, int b) {
+  if (!import_room(im))
+    return false;
+  im->text[im->length++] = ((unsigned)b < 0x20) ? ' ' : b;
 
-  if (!(new = malloc(sizeof(Entry))))
-    return result_new(false, NULL, L"Couldn't allocate Entry");
-  bzero(new, sizeof(Entry));
+  return true;
+}
 
-  new->text = calloc(length + 1, sizeof(wchar_t));
-  if (!new->text) {
-    free(new);
-    return result_new(false, NULL, L"Couldn't allocate Entry text buffer");
-  }
-  bzero(new->text, (length + 1) * sizeof(wchar_t));
-  new->length = length;
-  new->size = length + 1;
+/** Add an escaped char to the current string
+ */
+static bool import_code(Import *im, unsigned long code) {
+  mbstate_t state;
+  size_t n;
+
+  if ((code > 0x10ffff) || ((code >= 0xd800) && (code < 0xe000)))
+    return import_fail(im, L"Invalid character");
+  if (code < 0x20)
+    return import_byte(im, ' ');
+  if (!import_room(im))
+    return false;
+  bzero(&state, sizeof(mbstate_t));
+  if ((n = wcrtomb(im->text + im->length, (wchar_t)code, &state)) == (size_t)-1)
+    return import_fail(im, L"Character not supported by the locale");
+  im->length += n;
 
-  return result_new(true, new, L"Allocated new Entry with %d text buffer", length);
+  return true;
 }
 
-/** Parse input
+/** Replace entry text with the current string
  */
-Result data_load(FILE *input) {
-  Result ret, res;
-  Entry *new, *r, *c;
-  wchar_t *line, *data;
-  int line_nr, current_level;
+static bool import_text(Import *im, Entry *e) {
+  const char *from;
+  mbstate_t state;
+  wchar_t *text;
+  size_t length;
+
+  if (!import_room(im))
+    return false;
+  im->text[im->length] = '\0';
+  if (!(text = calloc(im->length + 1, sizeof(wchar_t))))
+    return import_fail(im, L"Couldn't allocate Entry text buffer");
+  from = im->text;
+  bzero(&state, sizeof(mbstate_t));
+  if ((length = mbsrtowcs(text, &from, im->length + 1, &state)) == (size_t)-1) {
+    free(text);
+    return import_fail(im, L"Invalid character");
+  }
+  text_free(e);
+  e->text = text;
+  e->length = length;
+  e->size = im->length + 1;
 
-  if (!(line = calloc(LINE_MAX_LEN, sizeof(wchar_t))))
-    return result_new(false, NULL, L"Couldn't allocate line buffer");
-  new = r = c = NULL;
-  current_level = 0;
-  line_nr = 1;
-  errno = 0;
-
-  while (fgetws(line, LINE_MAX_LEN, input)) {
-    new = NULL;
-    int length = wcslen(line);
-    if (length <= 1) continue;  // ignore empty lines
-    line[--length] = L'\0';     // kill newline char
-
-    int level = 0;
-    while ((line[level] == L'\t') && (level < length))
-      level++;
-    if (level >= (length - 2)) {
-      ret = result_new(false, NULL, L"Malformed input at line %d", line_nr);
-      goto error;
-    }
-    if (!((line[level] == L'-') && (line[level+1] == L' '))) {
-      ret = result_new(false, NULL, L"Malformed input at line %d", line_nr);
-      goto error;
-    }
+  return true;
+}
 
-    res = entry_new(length);
-    if (!res.success) {
-      ret = res;
-      goto error;
-    }
+/** Add an entry after the last one, with its children to follow
+ */
+static bool import_open(Import *im) {
+  Entry *e;
+
+  im->res = entry_new(0);
+  if (!im->res.success)
+    return false;
+  e = (Entry *)im->res.data;
+
+  e->parent = im->parent;
+  if (im->last) {
+    im->last->next = e;
+    e->prev = im->last;
+  } else if (im->parent)
+    im->parent->child = e;
+  else
+    im->first = e;
+  im->parent = e;
+  im->last = NULL;
+  ++im->count;
 
-    if (!c)
-      r = c = (Entry *)res.data;
-    else {
-      new = (Entry *)res.data;
+  return true;
+}
 
-      if (current_level < level) {
-        if (level - current_level != 1) {
-          ret = result_new(false, NULL, L"Ambiguous indentation at line %d", line_nr);
-          goto error;
+/** Finish the innermost open entry
+ */
+static void import_close(Import *im) {
+  im->last = im->parent;
+  im->parent = im->parent->parent;
+}
+
+/** Parse JSON entries
+ *
+ * Lists and objects alternate, so which one the parser is in follows
+ * from the state alone, with open entries standing for the nesting.
+ */
+static bool json_import(Import *im) {
+  enum {ENTRY, LIST_START, LIST_NEXT, OBJECT_START, OBJECT_NEXT, KEY} state;
+  bool bare;
+
+  import_space(im);
+  if ((bare = (im->c == '{')))
+    state = ENTRY;
+  else if (im->c == '[') {
+    import_next(im);
+    state = LIST_START;
+  } else
+    return import_fail(im, L"Expected a list of entries");
+
+  for (;;) {
+    import_space(im);
+    switch (state) {
+      case LIST_START:
+      case LIST_NEXT:
+        if (im->c == ']') {
+          import_next(im);
+          if (!im->parent)
+            goto done;
+          state = OBJECT_NEXT;
+          continue;
         }
-        new->parent = c;
-        c->child = new;
-        current_level = level;
-      } else {
-        while (c->parent && (current_level != level)) {
-          c = c->parent;
-          --current_level;
+        if (state == LIST_NEXT) {
+          if (im->c != ',')
+            return import_fail(im, L"Expected ',' or ']'");
+          import_next(im);
+          import_space(im);
         }
-        if (current_level != level) {
-          ret = result_new(false, NULL, L"Couldn't find parent at line %d", line_nr);
-          goto error;
+      // fall through
+      case ENTRY:
+        if (im->c != '{')
+          return import_fail(im, L"Expected an entry");
+        import_next(im);
+        if (!import_open(im))
+          return false;
+        state = OBJECT_START;
+        break;
+      case OBJECT_START:
+      case OBJECT_NEXT:
+        if (im->c == '}') {
+          import_next(im);
+          import_close(im);
+          if (bare && !im->parent)
+            goto done;
+          state = LIST_NEXT;
+          continue;
         }
-        new->parent = c->parent;
-        new->prev = c;
-        c->next = new;
-      }
-      c = new;
+        if (state == OBJECT_NEXT) {
+          if (im->c != ',')
+            return import_fail(im, L"Expected ',' or '}'");
+          import_next(im);
+        }
+        state = KEY;
+        break;
+      case KEY:
+        if (!json_string(im) || !import_room(im))
+          return false;
+        im->text[im->length] = '\0';
+        import_space(im);
+        if (im->c != ':')
+          return import_fail(im, L"Expected ':'");
+        import_next(im);
+        import_space(im);
+        state = OBJECT_NEXT;
+        if (!strcmp(im->text, "text")) {
+          if (!json_string(im) || !import_text(im, im->parent))
+            return false;
+        } else if (!strcmp(im->text, "crossed")) {
+          if (!json_bool(im, &im->parent->crossed))
+            return false;
+        } else if (!strcmp(im->text, "bold")) {
+          if (!json_bool(im, &im->parent->bold))
+            return false;
+        } else if (!strcmp(im->text, "children")) {
+          if (im->c != '[')
+            return import_fail(im, L"Expected a list of entries");
+          import_next(im);
+          state = LIST_START;
+        } else if (!json_skip(im))
+          return false;
+        break;
     }
+  }
+
+done:
+  import_space(im);
+  if ((im->c != EOF) || im->rd->error)
+    return import_fail(im, L"Unexpected data after the entries");
 
-    c->length = length - level - 2;
-    data = line+level+2;
+  return true;
+}
 
-    if (c->length >= 4) {
-      if ((data[0] == L'~') && (data[1] == L'~') &&
-          (data[c->length-1] == L'~') && (data[c->length-2] == L'~')) {
-        c->crossed = true;
-        data[c->length-2] = L'\0';
-        c->length -= 4;
-        data += 2;
+/** Read a JSON string into the current string
+ */
+static bool json_string(Import *im) {
+  unsigned long code, low;
+  bool ok;
+
+  im->length = 0;
+  if (im->c != '"')
+    return import_fail(im, L"Expected a string");
+  import_next(im);
+  while (im->c != '"') {
+    if (im->c == EOF)
+      return import_fail(im, L"Unterminated string");
+    if (im->c != '\\')
+      ok = import_byte(im, im->c);
+    else {
+      import_next(im);
+      switch (im->c) {
+        case '"':
+        case '\\':
+        case '/':
+          ok = import_byte(im, im->c);
+          break;
+        case 'b':
+        case 'f':
+        case 'n':
+        case 'r':
+        case 't':
+          ok = import_byte(im, ' ');
+          break;
+        case 'u':
+          if (!json_hex(im, &code))
+            return false;
+          if ((code >= 0xd800) && (code < 0xdc00)) {
+            // Surrogate pair
+            import_next(im);
+            if (im->c != '\\')
+              return import_fail(im, L"Invalid escape");
+            import_next(im);
+            if ((im->c != 'u') || !json_hex(im, &low) || (low < 0xdc00) || (low >= 0xe000))
+              return import_fail(im, L"Invalid escape");
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          }
+          ok = import_code(im, code);
+          break;
+        default:
+          return import_fail(im, L"Invalid escape");
       }
     }
-    if (c->length >= 4) {
-      if ((data[0] == L'*') && (data[1] == L'*') &&
-          (data[c->length-1] == L'*') && (data[c->length-2] == L'*')) {
-        c->bold = true;
-        data[c->length-2] = L'\0';
-        c->length -= 4;
-        data += 2;
-      }
+    if (!ok)
+      return false;
+    import_next(im);
+  }
+  import_next(im);
+
+  return true;
+}
+
+/** Read the four hex digits of a \u escape, ending at the last one
+ */
+static bool json_hex(Import *im, unsigned long *code) {
+  int i;
+
+  *code = 0;
+  for (i = 0; i < 4; i++) {
+    import_next(im);
+    if (!isxdigit(im->c))
+      return import_fail(im, L"Invalid escape");
+    *code = *code * 16 + (isdigit(im->c) ? im->c - '0' : tolower(im->c) - 'a' + 10);
+  }
+
+  return true;
+}
+
+/** Read a JSON boolean
+ */
+static bool json_bool(Import *im, bool *to) {
+  char word[8];
+  int n;
+
+  for (n = 0; (n < (int)sizeof(word) - 1) && isalpha(im->c); n++) {
+    word[n] = im->c;
+    import_next(im);
+  }
+  word[n] = '\0';
+  if (!strcmp(word, "true"))
+    *to = true;
+  else if (!strcmp(word, "false"))
+    *to = false;
+  else
+    return import_fail(im, L"Expected true or false");
+
+  return true;
+}
+
+/** Skip a JSON value of any kind
+ */
+static bool json_skip(Import *im) {
+  int depth;
+
+  depth = 0;
+  do {
+    import_space(im);
+    switch (im->c) {
+      case '"':
+        if (!json_string(im))
+          return false;
+        break;
+      case '[':
+      case '{':
+        ++depth;
+        import_next(im);
+        break;
+      case ']':
+      case '}':
+      case ',':
+      case ':':
+        if (!depth)
+          return import_fail(im, L"Expected a value");
+        if ((im->c == ']') || (im->c == '}'))
+          --depth;
+        import_next(im);
+        break;
+      default:
+        if (!isalnum(im->c) && (im->c != '-'))
+          return import_fail(im, L"Expected a value");
+        while (isalnum(im->c) || (im->c == '-') || (im->c == '+') || (im->c == '.'))
+          import_next(im);
+        break;
+    }
+  } while (depth > 0);
+
+  return true;
+}
+
+/** Parse OPML outlines
+ *
+ * Everything but tags is skipped, and of tags only outline ones are
+ * used, so the document structure around them isn't checked.
+ */
+static bool opml_import(Import *im) {
+  char name[16];
+  bool closing, outline;
+
+  for (;;) {
+    while ((im->c != '<') && (im->c != EOF))
+      import_next(im);
+    if (im->c == EOF)
+      break;
+    import_next(im);
+    if ((im->c == '?') || (im->c == '!')) {
+      if (!xml_skip(im))
+        return false;
+      continue;
     }
 
-    wcscpy(c->text, data);
+    if ((closing = (im->c == '/')))
+      import_next(im);
+    if (!xml_name(im, name, sizeof(name)))
+      return false;
+    outline = !strcmp(name, "outline");
+    if (closing) {
+      import_space(im);
+      if (im->c != '>')
+        return import_fail(im, L"Expected '>'");
+      if (outline) {
+        if (!im->parent)
+          return import_fail(im, L"Unexpected </outline>");
+        import_close(im);
+      }
+      import_next(im);
+      continue;
+    }
 
-    ++line_nr;
+    if (outline && !import_open(im))
+      return false;
+    if (!xml_attributes(im, outline ? im->parent : NULL))
+      return false;
+    if (im->c == '/') {
+      import_next(im);
+      if (im->c != '>')
+        return import_fail(im, L"Expected '>'");
+      if (outline)
+        import_close(im);
+    }
+    import_next(im);
   }
 
-  if (errno)
-    ret = result_new(false, NULL, L"File access error at line %d", line_nr);
-  else {
-    free(line);
-    return result_new(true, r, L"Parsed %d lines", line_nr);
+  if (im->parent || im->rd->error)
+    return import_fail(im, L"Unclosed outline");
+
+  return true;
+}
+
+/** Set entry text from an OPML text attribute
+ *
+ * Text wrapped in bold markup, which is how outliners export bold
+ * entries, makes the entry bold instead.
+ */
+static bool opml_text(Import *im, Entry *e) {
+  if ((im->length >= 7) && !strncmp(im->text, "<b>", 3) &&
+      !strncmp(im->text + im->length - 4, "</b>", 4)) {
+    memmove(im->text, im->text + 3, im->length - 7);
+    im->length -= 7;
+    e->bold = true;
   }
 
-error:
-  free(line);
-  if (new) free(new);
-  if (r) data_unload(r);
-  return ret;
+  return import_text(im, e);
 }
 
-/** Free a tree recursively
+/** Read a tag or attribute name, cut to fit `name`
  */
-void data_unload(Entry *e) {
-  if (e->child)
-    data_unload(e->child);
-  if (e->next)
-    data_unload(e->next);
+static bool xml_name(Import *im, char *name, size_t size) {
+  size_t n;
+
+  for (n = 0; isalnum(im->c) || (im->c == '_') || (im->c == ':') || (im->c == '-') ||
+       (im->c == '.'); import_next(im))
+    if (n < size - 1)
+      name[n++] = im->c;
+  if (!n)
+    return import_fail(im, L"Expected a name");
+  name[n] = '\0';
 
-  free(e->text);
-  free(e);
+  return true;
 }
 
-/** Output data
+/** Read the attributes of a tag, up to its end
+ *
+ * @param e Entry to set from outline attributes, NULL for other tags
  */
-Result data_dump(Entry *e, FILE *output) {
-  bool run;
-  int level, line_nr, t;
+static bool xml_attributes(Import *im, Entry *e) {
+  char name[16];
+  int quote;
+
+  for (;;) {
+    import_space(im);
+    if ((im->c == '>') || (im->c == '/'))
+      return true;
+    if (!xml_name(im, name, sizeof(name)))
+      return false;
+    import_space(im);
+    if (im->c != '=')
+      return import_fail(im, L"Expected '='");
+    import_next(im);
+    import_space(im);
+    if ((im->c != '"') && (im->c != '\''))
+      return import_fail(im, L"Expected a quoted value");
+    quote = im->c;
+    import_next(im);
+
+    im->length = 0;
+    while (im->c != quote) {
+      if ((im->c == EOF) || (im->c == '<'))
+        return import_fail(im, L"Unterminated value");
+      if (!((im->c == '&') ? xml_entity(im) : import_byte(im, im->c)))
+        return false;
+      import_next(im);
+    }
+    import_next(im);
 
-  run = true;
-  level = line_nr = 0;
+    if (!e)
+      continue;
+    if (!strcmp(name, "text")) {
+      if (!opml_text(im, e))
+        return false;
+    } else if (!strcmp(name, "_complete"))
+      e->crossed = (im->length == 4) && !strncmp(im->text, "true", 4);
+  }
+}
 
-  while (run) {
-    ++line_nr;
+/** Decode an entity, ending at its semicolon
+ */
+static bool xml_entity(Import *im) {
+  char name[12], *end;
+  unsigned long code;
+  int n;
+
+  n = 0;
+  import_next(im);
+  while (im->c != ';') {
+    if ((im->c == EOF) || (n == sizeof(name) - 1))
+      return import_fail(im, L"Malformed entity");
+    name[n++] = im->c;
+    import_next(im);
+  }
+  name[n] = '\0';
 
-    for (t = level; t > 0; --t)
-      if (fwprintf(output, L"\t") != 1) goto error;
+  if (name[0] == '#') {
+    if (name[1] == 'x')
+      code = strtoul(name + 2, &end, 16);
+    else
+      code = strtoul(name + 1, &end, 10);
+    if (*end || (end == name + 1) || (end == name + 2))
+      return import_fail(im, L"Malformed entity");
+    return import_code(im, code);
+  }
+  if (!strcmp(name, "amp"))
+    return import_byte(im, '&');
+  if (!strcmp(name, "lt"))
+    return import_byte(im, '<');
+  if (!strcmp(name, "gt"))
+    return import_byte(im, '>');
+  if (!strcmp(name, "quot"))
+    return import_byte(im, '"');
+  if (!strcmp(name, "apos"))
+    return import_byte(im, '\'');
+
+  return import_fail(im, L"Unknown entity");
+}
 
-    if (fwprintf(output, L"- ") != 2) goto error;
+/** Skip a declaration, processing instruction or comment
+ */
+static bool xml_skip(Import *im) {
+  bool comment;
+  int dashes;
+
+  comment = false;
+  if (im->c == '!') {
+    import_next(im);
+    if (im->c == '-') {
+      import_next(im);
+      if (im->c != '-')
+        return import_fail(im, L"Malformed comment");
+      comment = true;
+      import_next(im);
+    }
+  }
+  for (dashes = 0; im->c != EOF; import_next(im)) {
+    if ((im->c == '>') && (!comment || (dashes >= 2))) {
+      import_next(im);
+      return true;
+    }
+    dashes = (im->c == '-') ? dashes + 1 : 0;
+  }
 
-    if (e->crossed)
-      if (fwprintf(output, L"~~") != 2) goto error;
-    if (e->bold)
-      if (fwprintf(output, L"**") != 2) goto error;
+  return import_fail(im, comment ? L"Unterminated comment" : L"Unterminated tag");
+}
 
-    if (fwprintf(output, L"%S", e->text) != e->length) goto error;
+/** Take a snapshot of a tree
+ *
+ * The snapshot only points to entry texts, which stay intact as long
+ * as whoever modifies them calls entry_own() first. Unchanged entries
+ * are captured as source ranges, without going through their children.
+ * Only one snapshot may be live at a time.
+ *
+ * @return Snapshot to be freed with snapshot_free()
+ */
+Result data_snapshot(Entry *e) {
+  Snapshot *snap;
+  SnapItem *items, *last;
+  bool run, copied;
+  int level, size;
 
-    if (e->bold)
-      if (fwprintf(output, L"**") != 2) goto error;
-    if (e->crossed)
-      if (fwprintf(output, L"~~") != 2) goto error;
+  if (Shared.live)
+    return result_new(false, NULL, L"Another snapshot is in use");
+  if (!(snap = calloc(1, sizeof(Snapshot))))
+    return result_new(false, NULL, L"Couldn't allocate Snapshot");
 
-    if (fwprintf(output, L"\n") != 1) goto error;
+  run = true;
+  level = size = 0;
+  ++Checks;
+  while (run) {
+    if (snap->count == size) {
+      size = size ? size * 2 : 256;
+      if (!(items = realloc(snap->items, size * sizeof(SnapItem)))) {
+        snapshot_unref(snap);
+        free(snap->items);
+        free(snap);
+        return result_new(false, NULL, L"Couldn't allocate Snapshot items");
+      }
+      snap->items = items;
+    }
+    last = snap->count ? snap->items + snap->count - 1 : NULL;
+    copied = e->range.src && source_valid(e->range.src);
+    if (copied) {
+      // Top level entries with shards stay apart
+      if (!last || (!level && e->shard) ||
+          !range_join(&last->range, last->level, &e->range, level)) {
+        snap->items[snap->count++] = (SnapItem) {
+          NULL, 0, level, false, false, {NULL}, e->range, NULL
+        };
+        e->range.src->refs++;
+        last = NULL;
+      }
+    } else {
+      snap->items[snap->count++] = (SnapItem) {
+        e->text, e->length, level, e->crossed, e->bold, {NULL}, {NULL}, NULL
+      };
+      last = NULL;
+      if (e->lazy) {
+        snap->items[snap->count - 1].lazy = *e->lazy;
+        e->lazy->src->refs++;
+      }
+    }
+    // Shard names are copied, top level entries may go away meanwhile
+    if (!last && !level && e->shard &&
+        !(snap->items[snap->count - 1].shard = strdup(e->shard))) {
+      snapshot_unref(snap);
+      free(snap->items);
+      free(snap);
+      return result_new(false, NULL, L"Couldn't allocate shard name");
+    }
 
-    if (e->child) {
+    if (e->child && !copied) {
       e = e->child;
       ++level;
     } else if (e->next)
@@ -233,10 +3230,330 @@ Result data_dump(Entry *e, FILE *output) {
     }
   }
 
-  return result_new(true, NULL, L"Written %d lines", line_nr);
+  Shared.live = true;
+  __atomic_add_fetch(&Shared.gen, 1, __ATOMIC_RELAXED);
 
-error:
-  return result_new(false, NULL, L"Error occurred. May have written %d lines", line_nr);
+  return result_new(true, snap, L"Captured %d entries", snap->count);
+}
+
+/** Output a snapshot
+ *
+ * Safe to call from another thread while the tree is being modified.
+ */
+Result snapshot_dump(Snapshot *s, FILE *output) {
+  int count;
+
+  if (is_dir(output))
+    return snapshot_dump_dir(s, fileno(output));
+  if ((count = items_dump(output, s->items, s->count)) < s->count)
+    return result_new(false, NULL, L"Error occurred. May have written %d items", count);
+
+  return result_new(true, NULL, L"Written %d items", count);
+}
+
+/** Output snapshot items
+ *
+ * @return Number of items written
+ */
+static int items_dump(FILE *output, SnapItem *items, int count) {
+  SnapItem *i;
+  int n;
+
+  for (n = 0; n < count; ++n) {
+    i = items + n;
+    if (i->range.src) {
+      if (!range_dump(output, &i->range, i->level))
+        break;
+    } else if (!dump_line(output, i->level, i->crossed, i->bold, i->text, i->length) ||
+               (i->lazy.src && !range_dump(output, &i->lazy, i->level + 1)))
+      break;
+  }
+
+  return n;
+}
+
+/** Free a snapshot and text buffers detached while it was live
+ */
+void snapshot_free(Snapshot *s) {
+  int i;
+
+  for (i = 0; i < Shared.count; i++)
+    free(Shared.dead[i]);
+  Shared.count = 0;
+  Shared.live = false;
+
+  snapshot_unref(s);
+  free(s->items);
+  free(s);
+}
+
+/** Release sources and shard names held by a snapshot
+ */
+static void snapshot_unref(Snapshot *s) {
+  int i;
+
+  for (i = 0; i < s->count; i++) {
+    if (s->items[i].lazy.src)
+      source_unref(s->items[i].lazy.src);
+    if (s->items[i].range.src)
+      source_unref(s->items[i].range.src);
+    free(s->items[i].shard);
+  }
+}
+
+/** Check if entry text is referenced by the live snapshot
+ */
+static bool entry_shared(Entry *e) {
+  return Shared.live && (e->gen != Shared.gen);
+}
+
+/** Keep a text buffer until the live snapshot goes away
+ */
+static bool text_defer(wchar_t *text) {
+  wchar_t **dead;
+  int size;
+
+  if (Shared.count == Shared.size) {
+    size = Shared.size ? Shared.size * 2 : 64;
+    if (!(dead = realloc(Shared.dead, size * sizeof(wchar_t *))))
+      return false;
+    Shared.dead = dead;
+    Shared.size = size;
+  }
+  Shared.dead[Shared.count++] = text;
+
+  return true;
+}
+
+/** Free entry text, unless the live snapshot still needs it
+ *
+ * If the buffer can't be kept around it is leaked rather than freed
+ * under the snapshot.
+ */
+static void text_free(Entry *e) {
+  if (entry_shared(e))
+    text_defer(e->text);
+  else
+    free(e->text);
+}
+
+/** Return an entry to the pool, its text and ranges already freed
+ */
+static void entry_free(Entry *e) {
+  pthread_mutex_lock(&EntryLock);
+  pool_put(&EntryPool, e);
+  pthread_mutex_unlock(&EntryLock);
+}
+
+/** Make entry text private before modifying it
+ *
+ * Must be called before writing to or reallocating the text buffer.
+ */
+Result entry_own(Entry *e) {
+  wchar_t *text;
+
+  if (!entry_shared(e))
+    return result_new(true, e, L"Entry text is private");
+
+  if (!(text = malloc(e->size * sizeof(wchar_t))))
+    return result_new(false, e, L"Couldn't allocate Entry text buffer");
+  if (!text_defer(e->text)) {
+    free(text);
+    return result_new(false, e, L"Couldn't keep shared Entry text buffer");
+  }
+  wmemcpy(text, e->text, e->size);
+  e->text = text;
+  e->gen = Shared.gen;
+
+  return result_new(true, e, L"Copied shared Entry text");
+}
+
+/** Hash entry text and flags
+ *
+ * @param deep Include all children, recursively
+ */
+unsigned long entry_hash(Entry *e, bool deep) {
+  unsigned long hash;
+  Entry *c;
+  int i;
+
+  hash = 14695981039346656037UL;
+  for (i = 0; i < e->length; i++)
+    hash = (hash ^ e->text[i]) * 1099511628211UL;
+  hash = (hash ^ (e->crossed | (e->bold << 1))) * 1099511628211UL;
+  if (deep && e->lazy)
+    hash = (hash ^ lazy_hash(e->lazy)) * 1099511628211UL;
+  if (deep)
+    for (c = e->child; c; c = c->next)
+      hash = (hash ^ entry_hash(c, true)) * 1099511628211UL;
+
+  return hash;
+}
+
+/** Compare entry text and flags
+ *
+ * @param deep Compare all children as well, recursively
+ */
+bool entry_same(Entry *a, Entry *b, bool deep) {
+  if ((a->length != b->length) || (a->crossed != b->crossed) || (a->bold != b->bold))
+    return false;
+  if (wmemcmp(a->text, b->text, a->length))
+    return false;
+  if (!deep)
+    return true;
+  if (a->lazy || b->lazy)
+    return a->lazy && b->lazy && lazy_same(a->lazy, b->lazy);
+
+  for (a = a->child, b = b->child; a && b; a = a->next, b = b->next)
+    if (!entry_same(a, b, true))
+      return false;
+
+  return !(a || b);
+}
+
+/** Merge a freshly loaded tree into an existing one
+ *
+ * The result has the structure and contents of the new tree, but made
+ * of old entries wherever possible. Siblings are matched by content:
+ * an identical subtree is kept whole, an entry with the same text has
+ * its children merged in turn. The rest of the new tree is moved over.
+ *
+ * New entries that weren't needed are freed. Old entries that had no
+ * match are detached, linked through `next` into `dropped` and left for
+ * the caller to free with data_unload(), once nothing points to them.
+ *
+ * @param old First top level entry of the existing tree
+ * @param new First top level entry of the new tree
+ * @return First top level entry of the merged tree
+ */
+Entry *data_merge(Entry *old, Entry *new, Entry **dropped) {
+  *dropped = NULL;
+  return merge_list(NULL, old, new, dropped);
+}
+
+/** Merge two sibling lists
+ *
+ * If there is no memory for the lookup tables all old siblings are
+ * dropped, which is still a correct merge.
+ */
+static Entry *merge_list(Entry *parent, Entry *old, Entry *new, Entry **dropped) {
+  MergeItem *items, *it;
+  Entry *e, *n, *pick, *first, *last;
+  unsigned long hash;
+  int *heads, count, mask, i;
+
+  count = 0;
+  for (e = old; e; e = e->next)
+    count++;
+  for (mask = 1; mask < count * 2; mask <<= 1);
+  mask--;
+
+  items = NULL;
+  heads = NULL;
+  if (count && new) {
+    items = malloc(count * sizeof(MergeItem));
+    heads = malloc((mask + 1) * 2 * sizeof(int));
+  }
+
+  if (!items || !heads) {
+    while (old) {
+      e = old->next;
+      old->parent = NULL;
+      old->next = *dropped;
+      *dropped = old;
+      old = e;
+    }
+    count = 0;
+  } else {
+    for (i = 0; i <= mask; i++)
+      heads[i * 2] = heads[i * 2 + 1] = -1;
+    for (i = 0, e = old; e; e = e->next, i++) {
+      items[i].entry = e;
+      items[i].used = false;
+      items[i].deep = entry_hash(e, true);
+      items[i].flat = entry_hash(e, false);
+    }
+    // Going backwards keeps the lookup chains in sibling order
+    for (i = count - 1; i >= 0; i--) {
+      items[i].next_deep = heads[(items[i].deep & mask) * 2];
+      heads[(items[i].deep & mask) * 2] = i;
+      items[i].next_flat = heads[(items[i].flat & mask) * 2 + 1];
+      heads[(items[i].flat & mask) * 2 + 1] = i;
+    }
+  }
+
+  first = last = NULL;
+  while (new) {
+    n = new;
+    new = n->next;
+    n->next = NULL;
+    pick = NULL;
+
+    if (count) {
+      hash = entry_hash(n, true);
+      for (i = heads[(hash & mask) * 2]; i >= 0; i = it->next_deep) {
+        it = items + i;
+        if (!it->used && (it->deep == hash) && entry_same(it->entry, n, true)) {
+          pick = it->entry;
+          range_clear(&pick->range);
+          pick->range = n->range;
+          n->range.src = NULL;
+          free(pick->shard);
+          pick->shard = n->shard;
+          n->shard = NULL;
+          data_unload(n);
+          break;
+        }
+      }
+    }
+    if (count && !pick) {
+      hash = entry_hash(n, false);
+      for (i = heads[(hash & mask) * 2 + 1]; i >= 0; i = it->next_flat) {
+        it = items + i;
+        if (!it->used && (it->flat == hash) && entry_same(it->entry, n, false)) {
+          pick = it->entry;
+          pick->child = merge_list(pick, pick->child, n->child, dropped);
+          lazy_free(pick->lazy);
+          pick->lazy = n->lazy;
+          n->lazy = NULL;
+          range_clear(&pick->range);
+          pick->range = n->range;
+          n->range.src = NULL;
+          free(pick->shard);
+          pick->shard = n->shard;
+          n->shard = NULL;
+          n->child = NULL;
+          data_unload(n);
+          break;
+        }
+      }
+    }
+    if (pick)
+      it->used = true;
+    else
+      pick = n;
+
+    pick->parent = parent;
+    pick->prev = last;
+    pick->next = NULL;
+    if (last)
+      last->next = pick;
+    else
+      first = pick;
+    last = pick;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (items[i].used)
+      continue;
+    items[i].entry->parent = NULL;
+    items[i].entry->next = *dropped;
+    *dropped = items[i].entry;
+  }
+  free(items);
+  free(heads);
+
+  return first;
 }
 
 /** Insert new entry
@@ -269,10 +3586,36 @@ Result entry_insert(Entry *e, insert_t dir, int length) {
       e->next = new;
       break;
   }
+  entry_touch(new);
 
   return result_new(true, new, L"Inserted new Entry");
 }
 
+/** Insert a list of entries after an entry
+ *
+ * The list is made of the entry `list` and all its next siblings,
+ * which become next siblings of `e`.
+ *
+ * @return Last inserted entry
+ */
+Entry *entry_splice(Entry *e, Entry *list) {
+  Entry *last;
+
+  for (last = list; ; last = last->next) {
+    last->parent = e->parent;
+    if (!last->next) break;
+  }
+
+  last->next = e->next;
+  if (e->next)
+    e->next->prev = last;
+  list->prev = e;
+  e->next = list;
+  entry_touch(e->parent);
+
+  return last;
+}
+
 /** Indent entry
  *
  * In other terms change the level of the entry.
@@ -284,6 +3627,7 @@ bool entry_indent(Entry *e, indent_t dir) {
     case LEFT:
       if (!e->parent)
         return false;
+      entry_touch(e->parent);
 
       if (e->parent->child == e)
         e->parent->child = e->next;
@@ -303,6 +3647,8 @@ bool entry_indent(Entry *e, indent_t dir) {
     case RIGHT:
       if (!e->prev)
         return false;
+      if (!entry_expand(e->prev).success)
+        return false;
 
       e->parent = e->prev;
       e->prev->next = e->next;
@@ -320,6 +3666,7 @@ bool entry_indent(Entry *e, indent_t dir) {
         e->prev = NULL;
       }
       e->next = NULL;
+      entry_touch(e->parent);
       break;
   }
 
@@ -373,6 +3720,7 @@ bool entry_move(Entry *e, move_t dir) {
       e->prev = o;
       break;
   }
+  entry_touch(e->parent);
 
   return true;
 }
@@ -382,7 +3730,7 @@ bool entry_move(Entry *e, move_t dir) {
 Result entry_delete(Entry *e) {
   Entry *o;
 
-  if (e->child)
+  if (e->child || e->lazy)
     return result_new(false, e, L"Can't delete an entry with children");
   if (!(e->prev || e->next || e->parent))
     return result_new(false, e, L"Can't delete last entry");
@@ -405,8 +3753,11 @@ Result entry_delete(Entry *e) {
       o = e->next;
   }
 
-  free(e->text);
-  free(e);
+  entry_touch(e->parent);
+  range_clear(&e->range);
+  free(e->shard);
+  text_free(e);
+  entry_free(e);
 
   if (!o)
     return result_new(false, o, L"PANIC!");
@@ -1,12 +1,24 @@
 #ifndef DATA_H
 #define DATA_H
 
+struct Source;
+
+typedef struct Range {
+  struct Source *src;
+  off_t start, end;
+  int level, line;
+} Range;
+
 typedef struct Entry {
   wchar_t *text;
   int length;
   int size;
   bool crossed;
   bool bold;
+  unsigned gen;
+  struct Range *lazy;
+  Range range;
+  char *shard;
 
   struct Entry *prev;
   struct Entry *next;
@@ -14,12 +26,46 @@ typedef struct Entry {
   struct Entry *child;
 } Entry;
 
+typedef struct SnapItem {
+  wchar_t *text;
+  int length;
+  int level;
+  bool crossed;
+  bool bold;
+  Range lazy;
+  Range range;
+  char *shard;
+} SnapItem;
+
+typedef struct Snapshot {
+  SnapItem *items;
+  int count;
+} Snapshot;
+
+typedef struct LoadCtl {
+  volatile bool cancel;
+  volatile long done;
+} LoadCtl;
+
 typedef struct Result {
   bool success;
   wchar_t msg[ERR_MAX_LEN];
   void *data;
 } Result;
 
+struct Parser;
+
+typedef bool (*scan_t)(Entry *e, int level, void *arg);
+
+typedef enum {EXPORT_HTML, EXPORT_JSON, EXPORT_OPML} export_t;
+
+typedef struct Export {
+  export_t format;
+  FILE *output;
+  int level, shift;
+  long count;
+} Export;
+
 typedef enum {BEFORE, AFTER} insert_t;
 typedef enum {LEFT, RIGHT} indent_t;
 typedef enum {UP, DOWN} move_t;
@@ -27,9 +73,41 @@ typedef enum {UP, DOWN} move_t;
 Result result_new(bool success, void *data, const wchar_t *fmt, ...);
 Result entry_new(int length);
 Result data_load(FILE *input);
+Result data_load_ctl(FILE *input, LoadCtl *ctl);
+Result data_load_lazy(FILE *input, int depth, LoadCtl *ctl);
+Result data_load_fd(int fd, LoadCtl *ctl);
+Result data_parse(const char *data, size_t length);
+Result parser_new();
+Result parser_feed(struct Parser *p, const char *data, size_t length);
+Result parser_finish(struct Parser *p);
+Result data_scan(FILE *input, scan_t fn, void *arg);
 void data_unload(Entry *e);
+unsigned long data_changes();
+void entry_touch(Entry *e);
 Result data_dump(Entry *e, FILE *output);
+bool entry_dump(Entry *e, int level, FILE *output);
+bool export_type(const char *name, export_t *format);
+bool export_start(Export *x, export_t format, FILE *output);
+bool export_entry(Entry *e, int level, void *arg);
+bool export_finish(Export *x);
+Result data_export(Entry *e, export_t format, FILE *output);
+Result data_import(FILE *input, export_t format);
+Result data_manifest(int dir);
+void manifest_free(char **names);
+Result data_shard(Entry *e);
+Result data_dump_dir(Entry *e, int dir);
+Result data_append(const char *path, Entry *e, const wchar_t *under);
+Entry *data_merge(Entry *old, Entry *new, Entry **dropped);
+unsigned long entry_hash(Entry *e, bool deep);
+bool entry_same(Entry *a, Entry *b, bool deep);
+Result data_snapshot(Entry *e);
+Result snapshot_dump(Snapshot *s, FILE *output);
+Result snapshot_dump_dir(Snapshot *s, int dir);
+void snapshot_free(Snapshot *s);
+Result entry_own(Entry *e);
+Result entry_expand(Entry *e);
 Result entry_insert(Entry *e, insert_t dir, int length);
+Entry *entry_splice(Entry *e, Entry *list);
 bool entry_indent(Entry *e, indent_t dir);
 bool entry_move(Entry *e, move_t dir);
 Result entry_delete(Entry *e);
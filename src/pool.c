@@ -0,0 +1,99 @@
+/** @file
+ * Fixed-size object pools
+ *
+ * A pool hands out same-sized items from slabs of POOL_SLAB_ITEMS,
+ * keeping released items on a free list for reuse. Slabs are only
+ * returned to the system by pool_destroy(), so after warm-up getting
+ * and putting items never touches the heap.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Slab header is padded so that items keep pointer alignment
+#define SLAB_HEADER (((sizeof(PoolSlab) + 15) / 16) * 16)
+
+/** Get item size rounded up so that it can hold a free list link
+ */
+static size_t pool_item_size(Pool *p) {
+  size_t size;
+
+  size = p->size < sizeof(void *) ? sizeof(void *) : p->size;
+  return ((size + sizeof(void *) - 1) / sizeof(void *)) * sizeof(void *);
+}
+
+/** Thread all items of a slab onto the free list
+ */
+static void pool_slab_free(Pool *p, PoolSlab *s) {
+  char *item;
+  size_t size;
+  int i;
+
+  size = pool_item_size(p);
+  item = (char *)s + SLAB_HEADER;
+  for (i = 0; i < POOL_SLAB_ITEMS; i++, item += size) {
+    *(void **)item = p->free;
+    p->free = item;
+  }
+}
+
+/** Get a zeroed item
+ *
+ * @return NULL if a new slab couldn't be allocated
+ */
+void *pool_get(Pool *p) {
+  PoolSlab *s;
+  void *item;
+
+  if (!p->free) {
+    if (!(s = malloc(SLAB_HEADER + pool_item_size(p) * POOL_SLAB_ITEMS)))
+      return NULL;
+    s->next = p->slabs;
+    p->slabs = s;
+    pool_slab_free(p, s);
+  }
+
+  item = p->free;
+  p->free = *(void **)item;
+  bzero(item, p->size);
+
+  return item;
+}
+
+/** Return an item to the pool
+ */
+void pool_put(Pool *p, void *item) {
+  *(void **)item = p->free;
+  p->free = item;
+}
+
+/** Return all items to the pool at once
+ *
+ * The caller guarantees none of the items is in use anymore.
+ */
+void pool_reset(Pool *p) {
+  PoolSlab *s;
+
+  p->free = NULL;
+  for (s = p->slabs; s; s = s->next)
+    pool_slab_free(p, s);
+}
+
+/** Release all slabs
+ */
+void pool_destroy(Pool *p) {
+  PoolSlab *s, *n;
+
+  for (s = p->slabs; s; s = n) {
+    n = s->next;
+    free(s);
+  }
+  p->free = NULL;
+  p->slabs = NULL;
+}
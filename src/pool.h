@@ -0,0 +1,26 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Items carved out of a single malloc'd slab
+#define POOL_SLAB_ITEMS 256
+
+typedef struct PoolSlab {
+  struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct Pool {
+  size_t size;
+  void *free;
+  PoolSlab *slabs;
+} Pool;
+
+#define POOL_INIT(type) {sizeof(type), NULL, NULL}
+
+void *pool_get(Pool *p);
+void pool_put(Pool *p, void *item);
+void pool_reset(Pool *p);
+void pool_destroy(Pool *p);
+
+#endif
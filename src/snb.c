@@ -8,8 +8,10 @@
 #include <stdlib.h>
 
 #include <errno.h>
+#include <getopt.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <string.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -20,6 +22,61 @@
 
 bool use_term_colors = !FORCE_BLACK_BG;
 
+// Options without a short form
+enum {OPT_APPEND = 256, OPT_UNDER};
+
+static struct option long_options[] = {
+  {"help", no_argument, NULL, 'h'},
+  {"version", no_argument, NULL, 'v'},
+  {"locale", required_argument, NULL, 'l'},
+  {"width", required_argument, NULL, 'w'},
+  {"black", no_argument, NULL, 'b'},
+  {"autosave", required_argument, NULL, 'a'},
+  {"depth", required_argument, NULL, 'd'},
+  {"level", required_argument, NULL, 'z'},
+  {"socket", required_argument, NULL, 's'},
+  {"match", required_argument, NULL, 'm'},
+  {"count", no_argument, NULL, 'c'},
+  {"extract", required_argument, NULL, 'x'},
+  {"export", required_argument, NULL, 'e'},
+  {"import", required_argument, NULL, 'i'},
+  {"append", required_argument, NULL, OPT_APPEND},
+  {"under", required_argument, NULL, OPT_UNDER},
+  {NULL, 0, NULL, 0}
+};
+
+// Non-interactive run over a file, see batch_entry()
+static struct Batch {
+  char *match_arg, *path_arg;
+  char *append_arg, *under_arg;
+  wchar_t *match;
+  bool count;
+  bool exporting;
+  Export export;
+  bool importing;
+  export_t import;
+
+  wchar_t **path;
+  int depth, found;
+  bool inside;
+
+  wchar_t **stack;
+  int levels;
+
+  long crossed, uncrossed;
+  long all_crossed, all_uncrossed;
+  long matched;
+  bool open;
+} Batch;
+
+static wchar_t *batch_wcs(const char *s, size_t length);
+static bool batch_entry(Entry *e, int level, void *arg);
+static void batch_path(int level);
+static void batch_flush(int level);
+static int batch_run(FILE *fp);
+static int append_run(char *path);
+static int import_run(FILE *fp);
+
 void usage(char *name) {
   fprintf(stderr, "  Usage: %s [options...] (path)\n\n", name);
 #ifdef DEFAULT_FILE
@@ -36,6 +93,22 @@ void usage(char *name) {
 #endif
   fprintf(stderr, "\t-b        - use term bg color or black (default: %s)\n",
           FORCE_BLACK_BG ? "black" : "term");
+  fprintf(stderr, "\t-a SECS   - autosave after SECS of idleness (0 - off, default: %d)\n",
+          AUTOSAVE_IDLE);
+  fprintf(stderr, "\t-d DEPTH  - parse only DEPTH levels until expanded (0 - all, default: %d)\n",
+          LAZY_DEPTH);
+  fprintf(stderr, "\t-z LEVEL  - compression level for .gz and .zst files (default: %d)\n",
+          COMPRESS_LEVEL);
+  fprintf(stderr, "\t-s PATH   - accept commands on a Unix socket at PATH\n");
+  fprintf(stderr, "\nBatch mode, reads path or '-' for stdin and exits:\n");
+  fprintf(stderr, "\t-m TEXT   - list paths of entries containing TEXT\n");
+  fprintf(stderr, "\t-c        - count crossed and other entries per subtree\n");
+  fprintf(stderr, "\t-x PATH   - print the subtree at PATH, e.g. 'Top" ENTRY_PATH_SEP "Child'\n");
+  fprintf(stderr, "\t-e FORMAT - print the file or the subtree as html, json or opml\n");
+  fprintf(stderr, "\t-i FORMAT - convert the file from json or opml and print it\n");
+  fprintf(stderr, "\t--append TEXT - add an entry at the end of the file\n");
+  fprintf(stderr, "\t--under TEXT  - add it at the end of this top level entry instead, which\n");
+  fprintf(stderr, "\t                rewrites the whole file unless that entry is the last one\n");
   exit(1);
 }
 
@@ -44,6 +117,224 @@ void version() {
   exit(1);
 }
 
+/** Convert part of an argument to wide chars
+ */
+static wchar_t *batch_wcs(const char *s, size_t length) {
+  wchar_t *ret;
+  char *part;
+  size_t n;
+
+  if (!(part = strndup(s, length)))
+    return NULL;
+  n = mbstowcs(NULL, part, 0);
+  if ((n == (size_t)-1) || !(ret = calloc(n + 1, sizeof(wchar_t)))) {
+    free(part);
+    return NULL;
+  }
+  mbstowcs(ret, part, n + 1);
+  free(part);
+
+  return ret;
+}
+
+/** Handle a single entry of the scanned file
+ *
+ * With -x only the first subtree at the given path is considered and
+ * the scan stops right after it. Counted subtrees are the children of
+ * that entry, or top level entries without -x. With -m only matching
+ * entries are listed or counted. With -e entries are exported instead
+ * of being printed as they are.
+ */
+static bool batch_entry(Entry *e, int level, void *arg) {
+  wchar_t **stack, *text;
+  int top;
+
+  if (Batch.depth) {
+    if (Batch.inside && (level < Batch.depth))
+      return false;  // past the subtree
+    if (level <= Batch.found)
+      Batch.found = level + ((level < Batch.depth) && !wcscmp(e->text, Batch.path[level]));
+    if (Batch.found < Batch.depth)
+      return true;
+    Batch.inside = true;
+  }
+  top = Batch.depth;
+
+  if (level <= top)
+    batch_flush(top);
+  if (level >= Batch.levels) {
+    if (!(stack = realloc(Batch.stack, (level + 1) * sizeof(wchar_t *))))
+      return false;
+    Batch.stack = stack;
+    for (; Batch.levels <= level; ++Batch.levels)
+      Batch.stack[Batch.levels] = NULL;
+  }
+  if (!(text = realloc(Batch.stack[level], (e->length + 1) * sizeof(wchar_t))))
+    return false;
+  Batch.stack[level] = wcscpy(text, e->text);
+
+  if (Batch.match && !wcsstr(e->text, Batch.match))
+    return true;
+  ++Batch.matched;
+  if (Batch.count) {
+    if (level >= top) {
+      Batch.open = true;
+      if (e->crossed) ++Batch.crossed;
+      else ++Batch.uncrossed;
+    }
+    if (e->crossed) ++Batch.all_crossed;
+    else ++Batch.all_uncrossed;
+  } else if (Batch.match) {
+    batch_path(level);
+    putchar('\n');
+  } else if (Batch.exporting)
+    return export_entry(e, Batch.depth ? level - Batch.depth + 1 : level, &Batch.export);
+  else
+    entry_dump(e, Batch.depth ? level - Batch.depth + 1 : level, stdout);
+
+  return true;
+}
+
+/** Print texts of an entry and its ancestors
+ */
+static void batch_path(int level) {
+  int l;
+
+  for (l = 0; l <= level; l++)
+    printf(l ? ENTRY_PATH_SEP "%ls" : "%ls", Batch.stack[l]);
+}
+
+/** Print counts of the subtree at `level`, if any
+ */
+static void batch_flush(int level) {
+  if (!Batch.open)
+    return;
+  printf("%ld\t%ld\t", Batch.crossed, Batch.uncrossed);
+  batch_path(level);
+  putchar('\n');
+  Batch.crossed = Batch.uncrossed = 0;
+  Batch.open = false;
+}
+
+/** Run the batch mode over a file
+ *
+ * @return Exit code, 1 when nothing was found
+ */
+static int batch_run(FILE *fp) {
+  Result res;
+  const char *at, *sep;
+  wchar_t **path;
+  int ret;
+
+  if (Batch.match_arg && !(Batch.match = batch_wcs(Batch.match_arg, strlen(Batch.match_arg)))) {
+    fprintf(stderr, "ERROR: Can't convert '%s'\n", Batch.match_arg);
+    return 2;
+  }
+  for (at = Batch.path_arg; at; at = sep ? sep + strlen(ENTRY_PATH_SEP) : NULL) {
+    sep = strstr(at, ENTRY_PATH_SEP);
+    if (!(path = realloc(Batch.path, (Batch.depth + 1) * sizeof(wchar_t *))))
+      return 2;
+    Batch.path = path;
+    if (!(Batch.path[Batch.depth] = batch_wcs(at, sep ? (size_t)(sep - at) : strlen(at)))) {
+      fprintf(stderr, "ERROR: Can't convert '%s'\n", Batch.path_arg);
+      return 2;
+    }
+    ++Batch.depth;
+  }
+
+  if (Batch.exporting && !export_start(&Batch.export, Batch.export.format, stdout)) {
+    perror("Can't write output");
+    return 2;
+  }
+  res = data_scan(fp, batch_entry, NULL);
+  batch_flush(Batch.depth);
+  if (Batch.exporting && res.success && !export_finish(&Batch.export))
+    res = result_new(false, NULL, L"Can't write output");
+  if (Batch.count && res.success)
+    printf("%ld\t%ld\n", Batch.all_crossed, Batch.all_uncrossed);
+
+  ret = 0;
+  if (!res.success) {
+    fwprintf(stderr, L"ERROR: %S.\n", res.msg);
+    ret = 2;
+  } else if (fflush(stdout)) {
+    perror("Can't write output");
+    ret = 2;
+  } else if (Batch.depth && !Batch.inside) {
+    fprintf(stderr, "ERROR: No entry at '%s'\n", Batch.path_arg);
+    ret = 1;
+  } else if (Batch.match && !Batch.matched)
+    ret = 1;
+
+  free(Batch.match);
+  for (; Batch.depth > 0; --Batch.depth)
+    free(Batch.path[Batch.depth - 1]);
+  free(Batch.path);
+  for (; Batch.levels > 0; --Batch.levels)
+    free(Batch.stack[Batch.levels - 1]);
+  free(Batch.stack);
+
+  return ret;
+}
+
+/** Add an entry to a file without loading it
+ *
+ * @return Exit code
+ */
+static int append_run(char *path) {
+  Result res;
+  Entry *e;
+  wchar_t *text, *under;
+
+  under = NULL;
+  if (!(text = batch_wcs(Batch.append_arg, strlen(Batch.append_arg))) ||
+      (Batch.under_arg && !(under = batch_wcs(Batch.under_arg, strlen(Batch.under_arg))))) {
+    fprintf(stderr, "ERROR: Can't convert entry text\n");
+    free(text);
+    return 2;
+  }
+  res = entry_new(wcslen(text));
+  if (res.success) {
+    e = (Entry *)res.data;
+    wcscpy(e->text, text);
+    res = data_append(path, e, under);
+    data_unload(e);
+  }
+  free(text);
+  free(under);
+  if (!res.success) {
+    fwprintf(stderr, L"ERROR: %S.\n", res.msg);
+    return 2;
+  }
+
+  return 0;
+}
+
+/** Convert an outline from another program to the notebook format
+ *
+ * @return Exit code
+ */
+static int import_run(FILE *fp) {
+  Result res;
+  Entry *root;
+
+  res = data_import(fp, Batch.import);
+  if (!res.success) {
+    fwprintf(stderr, L"ERROR: %S.\n", res.msg);
+    return 2;
+  }
+  if (!(root = (Entry *)res.data))
+    return 0;
+  res = data_dump(root, stdout);
+  data_unload(root);
+  if (!res.success || fflush(stdout)) {
+    perror("Can't write output");
+    return 2;
+  }
+
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   FILE *fp;
   Result res;
@@ -56,9 +347,12 @@ int main(int argc, char *argv[]) {
 #else
   ui_scr_width = 0;
 #endif
+  ui_autosave = AUTOSAVE_IDLE;
+  ui_lazy = LAZY_DEPTH;
+  ui_compress = COMPRESS_LEVEL;
 
   locale = "";
-  while ((opt = getopt(argc, argv, "hvl:w:b")) != -1) {
+  while ((opt = getopt_long(argc, argv, "hvl:w:ba:d:z:s:m:cx:e:i:", long_options, NULL)) != -1) {
     switch (opt) {
       case 'b':
         use_term_colors = !use_term_colors;
@@ -72,6 +366,65 @@ int main(int argc, char *argv[]) {
           ui_scr_width = 0;
         }
         break;
+      case 'a':
+        ui_autosave = atoi(optarg);
+        if (ui_autosave < 0) {
+          fprintf(stderr, "WARN: Wrong autosave value, autosave is off\n");
+          fprintf(stderr, "Press enter to continue.\n");
+          fgetc(stdin);
+          ui_autosave = 0;
+        }
+        break;
+      case 'd':
+        ui_lazy = atoi(optarg);
+        if (ui_lazy < 0) {
+          fprintf(stderr, "WARN: Wrong depth value, parsing everything\n");
+          fprintf(stderr, "Press enter to continue.\n");
+          fgetc(stdin);
+          ui_lazy = 0;
+        }
+        break;
+      case 'z':
+        ui_compress = atoi(optarg);
+        if (ui_compress < 1) {
+          fprintf(stderr, "WARN: Wrong compression level, using %d\n", COMPRESS_LEVEL);
+          fprintf(stderr, "Press enter to continue.\n");
+          fgetc(stdin);
+          ui_compress = COMPRESS_LEVEL;
+        }
+        break;
+      case 's':
+        ui_socket = optarg;
+        break;
+      case 'm':
+        Batch.match_arg = optarg;
+        break;
+      case 'c':
+        Batch.count = true;
+        break;
+      case 'x':
+        Batch.path_arg = optarg;
+        break;
+      case 'e':
+        if (!export_type(optarg, &Batch.export.format)) {
+          fprintf(stderr, "ERROR: Unknown export format '%s'\n", optarg);
+          exit(2);
+        }
+        Batch.exporting = true;
+        break;
+      case 'i':
+        if (!export_type(optarg, &Batch.import) || (Batch.import == EXPORT_HTML)) {
+          fprintf(stderr, "ERROR: Can't import format '%s'\n", optarg);
+          exit(2);
+        }
+        Batch.importing = true;
+        break;
+      case OPT_APPEND:
+        Batch.append_arg = optarg;
+        break;
+      case OPT_UNDER:
+        Batch.under_arg = optarg;
+        break;
       case 'l':
         locale = optarg;
         break;
@@ -86,6 +439,7 @@ int main(int argc, char *argv[]) {
   }
 
   fp = NULL;
+  path = NULL;
 
   if (setlocale(LC_ALL, locale) == NULL) {
     fprintf(stderr, "WARN: Couldn't change LC_ALL to '%s'\n", locale);
@@ -93,7 +447,24 @@ int main(int argc, char *argv[]) {
     fgetc(stdin);
   }
 
-  if (optind < argc) {
+  if ((Batch.under_arg && !Batch.append_arg) ||
+      (Batch.exporting && (Batch.match_arg || Batch.count)) ||
+      (Batch.importing && (Batch.match_arg || Batch.count || Batch.path_arg || Batch.exporting)))
+    usage(argv[0]);
+  if (Batch.append_arg) {
+    if (optind < argc)
+      return append_run(argv[optind]);
+#ifdef DEFAULT_FILE
+    return append_run(DEFAULT_FILE);
+#else
+    fprintf(stderr, "ERROR: No file to append to\n");
+    exit(2);
+#endif
+  }
+
+  if ((optind < argc) && !strcmp(argv[optind], "-"))
+    fp = stdin;
+  else if (optind < argc) {
     fp = fopen(argv[optind], "r");
     if (fp == NULL) {
       perror("Can't open your file");
@@ -108,9 +479,23 @@ int main(int argc, char *argv[]) {
   }
 #endif
 
+  if (Batch.match_arg || Batch.count || Batch.path_arg || Batch.exporting || Batch.importing) {
+    if (!fp) {
+      fprintf(stderr, "ERROR: No file to read\n");
+      exit(2);
+    }
+    opt = Batch.importing ? import_run(fp) : batch_run(fp);
+    fclose(fp);
+    return opt;
+  }
+  if (fp == stdin) {
+    fprintf(stderr, "ERROR: Standard input works only in batch mode\n");
+    exit(2);
+  }
+
   UI_File.path = NULL;
   if (fp) {
-    res = data_load(fp);
+    res = data_load_lazy(fp, ui_lazy, NULL);
     UI_File.loaded = true;
     UI_File.path = realpath(path, NULL);
     if (!UI_File.path) {
@@ -6,30 +6,70 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 #include <ncurses.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "user.h"
 #include "data.h"
 #include "ui.h"
 #include "colors.h"
+#include "pool.h"
+#include "compress.h"
 #include "snb.h"
 
+// Line breaks stored without touching the heap
+#define LAYOUT_INLINE 8
+
+// Key codes for bracketed paste markers
+#define KEY_PASTE_START (KEY_MAX + 1)
+#define KEY_PASTE_END   (KEY_MAX + 2)
+#define PASTE_ON        "\033[?2004h"
+#define PASTE_OFF       "\033[?2004l"
+#define PASTE_TIMEOUT   1000
+
+// Saving goes to a temporary file next to the target first
+#define SAVE_TEMPLATE   ".XXXXXX"
+
+// Line breaks of an entry for a given text width
+typedef struct Layout {
+  int width, length;
+  int lines;
+  unsigned version;
+
+  int *breaks;
+  int size;
+  int inline_breaks[LAYOUT_INLINE];
+} Layout;
+
 // Element open cache
 typedef struct ElmOpen {
   Entry *entry;
   bool is;
 
+  struct Layout layout;
+  struct Element *element;
+
   struct ElmOpen *prev;
   struct ElmOpen *next;
 } ElmOpen;
@@ -50,19 +90,128 @@ typedef struct Element {
 } Element;
 
 // Enums to make life a bit saner
+typedef enum {B_NONE, B_CROSSED, B_SINGLE, B_OPENED, B_CLOSED,
+              B_PARTIAL, B_MORE, B_LESS, B_ML
+             } bullet_t;
 typedef enum {BROWSE, EDIT} ui_mode_t;
-typedef enum {BACKWARD, FORWARD} search_t;
-typedef enum {ALL, CURRENT} update_t;
+typedef enum {NONE, CURRENT, ALL} update_t;
 typedef enum {C_UP, C_DOWN, C_LEFT, C_RIGHT} cur_move_t;
 typedef enum {D_LOAD, D_SAVE} dlg_file_path_t;
+typedef enum {TIMER_RESIZE, TIMER_AUTOSAVE, TIMER_WATCH, TIMER_COUNT} ui_timer_t;
+
+// Lookup table from entries to anything
+typedef struct EntryMap {
+  Entry **keys;
+  void **values;
+  int mask, count;
+} EntryMap;
 
 // Cursor position and internal data
 static struct Cursor {
   int x, y;
-  int index;
-  int lx, ex, ey;
+  int index, line;
+  int lx;
 } Cursor;
 
+// What is drawn on a single screen row
+typedef struct Row {
+  Element *elm;
+  unsigned version;
+  int line, lx;
+  bullet_t bullet;
+  int attrs;
+} Row;
+
+#define ROW_CURRENT 0x01
+#define ROW_EDIT    0x02
+#define ROW_CROSSED 0x04
+#define ROW_BOLD    0x08
+#define ROW_LESS    0x10
+#define ROW_MORE    0x20
+
+// Screen contents as last drawn and as about to be drawn
+static struct Frame {
+  Row *rows;
+  Row *next;
+  int size;
+} Frame;
+
+// Bracketed paste buffer
+static struct Paste {
+  wchar_t *text;
+  int length, size;
+} Paste;
+
+// Save running in the background
+static struct Save {
+  bool active;
+  bool done;
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  Snapshot *snap;
+  FILE *fp;
+  char *path, *tmp;
+  compress_t compress;
+  unsigned long changes;
+  struct stat st;
+  Result res;
+  struct Client *client;  // asked for the save over the socket
+} Save = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Load running in the background
+static struct Load {
+  bool done;
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  FILE *fp;
+  char *path;
+  LoadCtl ctl;
+  struct stat st;
+  Result res;
+} Load = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// What the current file looked like when last loaded or saved, the
+// contents hash is only known once the file was looked at after a change
+typedef struct Disk {
+  bool known, hashed;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+  unsigned long hash;
+} Disk;
+
+static Disk FileDisk, FileDeclined;
+
+// Directory watch on the current file
+static struct Watch {
+  int fd, wd;
+  char *path;
+  bool dir;
+} Watch = {-1, -1, NULL, false};
+
+// Connection to the control socket
+typedef struct Client {
+  int fd;
+  char *in, *out;
+  size_t in_len, in_size;
+  size_t out_len, out_size;
+  bool held;  // complete commands wait for the editor or a save
+} Client;
+
+// Control socket of a running instance
+static struct Control {
+  int fd;
+  Client clients[CONTROL_CLIENTS];
+} Control = {.fd = -1};
+
+// Deadlines handled by the main loop
+static struct Timer {
+  bool active;
+  struct timespec at;
+} Timers[TIMER_COUNT];
+
 // Partial drawing internal data
 static struct Partial {
   bool is;
@@ -76,7 +225,6 @@ static struct Undo {
   int size;
   bool crossed;
   bool present;
-  bool root;
 
   insert_t dir;
   struct Entry *other;
@@ -84,18 +232,70 @@ static struct Undo {
 
 // UI global variables
 static WINDOW *scr_main = NULL;
+static WINDOW *scr_status = NULL;
+static wchar_t *status_msg = NULL;
 static ElmOpen *ElmOpenRoot = NULL;
 static ElmOpen *ElmOpenLast = NULL;
+static EntryMap ElmOpenMap = {NULL, NULL, 0, 0};
+static Pool ElmOpenPool = POOL_INIT(ElmOpen);
+static Pool ElementPool = POOL_INIT(Element);
 static Element *Root = NULL;
 static Element *Current = NULL;
 static ui_mode_t Mode = BROWSE;
 static int scr_width, scr_x;
 static int dlg_offset = 1;
 static int dlg_min;
+static unsigned layout_version = 0;
+static update_t Damage = NONE;
+static int Wake[2] = {-1, -1};
+static wchar_t *Bullets[] = {
+  L"", BULLET_CROSSED, BULLET_SINGLE, BULLET_OPENED, BULLET_CLOSED,
+  BULLET_PARTIAL, BULLET_MORE, BULLET_LESS, BULLET_ML
+};
 
 // File loading and saving
 void file_save(char *path);
+void file_export(char *path);
+Entry *file_parse(char *path);
 void file_load(char *path);
+bool file_reload();
+void file_forget(Entry *dropped);
+void *save_worker(void *arg);
+bool save_poll();
+void save_finish();
+void save_wait();
+void save_error(wchar_t *msg);
+bool file_dirty();
+void file_autosave();
+void *load_worker(void *arg);
+unsigned long file_hash(int fd);
+bool file_state(char *path, struct stat *st, unsigned long *hash);
+void disk_set(Disk *d, struct stat *st, unsigned long *hash);
+bool disk_same(Disk *d, struct stat *st);
+void disk_read();
+bool disk_changed(Disk *seen);
+void file_check();
+void watch_update();
+void watch_read();
+
+// Control socket
+bool control_open();
+void control_close();
+void control_accept();
+void control_read(Client *c);
+void control_run(Client *c);
+void control_write(Client *c);
+void control_drop(Client *c);
+void control_do(Client *c, char *line);
+void control_reply(Client *c, const char *fmt, ...);
+bool control_dump(FILE *out, Entry *e, int level);
+Entry *control_find(wchar_t *path);
+Entry *control_top();
+
+// Status indicator
+void status_show(wchar_t *msg);
+void status_hide();
+void status_refresh();
 
 // Dialog windows
 WINDOW *dlg_newwin(wchar_t *title, int color);
@@ -109,117 +309,1161 @@ bool dlg_save();
 bool dlg_reload();
 char *dlg_file_path(wchar_t *title, int color, dlg_file_path_t mode);
 char *dlg_save_as();
+char *dlg_export();
 char *dlg_open();
 void dlg_info_version();
 void dlg_info_file();
+Result dlg_load(long total);
+void dlg_progress(WINDOW *win, int x, long done, long total);
 
 // Cursor for editing mode
 void cursor_update();
 void cursor_home();
 void cursor_end();
 void cursor_move(cur_move_t dir);
+void cursor_recalc();
 void cursor_fix();
 
+// Line breaks cache
+void layout_update(Layout *l, Entry *e, int width);
+void layout_invalidate(Layout *l);
+void layout_free(Layout *l);
+int layout_line(Layout *l, int index);
+int layout_index(Layout *l, Entry *e, int line, int col);
+int text_width(wchar_t *text, int n);
+
 // Editing helpers
 void edit_insert(wchar_t ch);
+void edit_insert_text(wchar_t *text, int length);
 void edit_remove(int offset);
 
+// Bracketed paste
+bool paste_read();
+void paste_do();
+Result paste_parse();
+
 // Element open cache
 Result elmopen_new(Entry *e);
 void elmopen_set(bool to, Entry *s, Entry *e);
 Result elmopen_get(Entry *e);
 void elmopen_forget(Entry *e);
+void elmopen_remove(ElmOpen *t);
 void elmopen_clear();
 
+// Entry lookup tables
+Result entrymap_new(EntryMap *m, int count);
+Result entrymap_room(EntryMap *m);
+unsigned long entrymap_slot(EntryMap *m, Entry *e);
+void entrymap_put(EntryMap *m, Entry *e, void *value);
+void **entrymap_get(EntryMap *m, Entry *e);
+void entrymap_del(EntryMap *m, Entry *e);
+void entrymap_free(EntryMap *m);
+Entry *entry_walk(Entry *e);
+
 // Visible elements tree
 Result vitree_rebuild(Element *s, Element *e);
-Element *vitree_find(Element *e, Entry *en, search_t dir);
+Result vitree_sync(Entry *first);
+void vitree_drop(EntryMap *map, Element *e, bool *lost);
+Element *vitree_find(Entry *en);
+void vitree_focus(Entry *en);
+Result vitree_update(Element *s, Element *e, Entry *en);
+Result vitree_reset(Entry *en);
+Result vitree_insert(Entry *en);
 void vitree_clear(Element *s, Element *e);
 
+// Main loop events
+void ui_wake();
+void timer_set(ui_timer_t id, int ms);
+bool timer_active(ui_timer_t id);
+int timer_next();
+void timer_fire();
+
 // Main modes key handling
 bool browse_do(int type, wchar_t input);
 bool edit_do(int type, wchar_t input);
+bool ui_dispatch(int type, wchar_t input);
+void ui_render();
+void ui_size();
+void ui_resize();
 
 // Element operations
 Result element_new(Entry *e);
+void element_free(Element *e);
+void element_layout(Element *e);
 
 // Drawing
-void element_draw(Element *e);
+int frame_element(Row *rows, Element *e, int y);
+void frame_resize();
+void frame_flush();
+void row_set(Row *r, Element *e, int line);
+void row_draw(int y, Row *r);
+bool row_same(Row *a, Row *b);
+void draw(update_t mode);
 void update(update_t mode);
 
 /** Save current tree to file
  *
- * This will update UI_File as needed.
+ * The tree is captured in a snapshot and written in the background,
+ * first to a temporary file that then replaces the target. Directories
+ * are written shard by shard instead. UI_File is updated once the save
+ * completes.
  *
- * @param path Absolute path to a file (MBS)
+ * @param path Absolute path to a file or directory (MBS)
  */
 void file_save(char *path) {
   Result res;
+  struct stat st;
+  mode_t mask;
   wchar_t *msg;
+  char *tmp;
   FILE *fp;
+  int fd;
 
+  if (Save.active) {
+    dlg_error(DLG_ERR_SAVING);
+    return;
+  }
   if (!(msg = calloc(scr_width, sizeof(wchar_t)))) {
-    dlg_error(L"Can't allocate msg");
+    save_error(L"Can't allocate msg");
+    return;
+  }
+  fp = NULL;
+  fd = -1;
+  tmp = NULL;
+  Save.compress = COMPRESS_NONE;
+  if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+    // Notebooks are written in place, shard by shard
+    res = data_shard(Root->entry);
+    if (!res.success) {
+      swprintf(msg, scr_width, L"%S", res.msg);
+      goto cleanup;
+    }
+    if (!(fp = fopen(path, "r")))
+      goto error;
+  } else {
+    if (!(tmp = malloc(strlen(path) + sizeof(SAVE_TEMPLATE)))) {
+      save_error(L"Can't allocate temporary path");
+      free(msg);
+      return;
+    }
+    sprintf(tmp, "%s" SAVE_TEMPLATE, path);
+
+    if ((fd = mkstemp(tmp)) < 0)
+      goto error;
+    if (stat(path, &st) == 0)
+      fchmod(fd, st.st_mode & 07777);
+    else {
+      mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0666 & ~mask);
+    }
+    if (!(fp = fdopen(fd, "w")))
+      goto error;
+    Save.compress = compress_guess(path);
+  }
+
+  res = data_snapshot(Root->entry);
+  if (!res.success) {
+    swprintf(msg, scr_width, L"%S", res.msg);
+    goto cleanup;
+  }
+
+  Save.snap = (Snapshot *)res.data;
+  Save.changes = data_changes();
+  Save.fp = fp;
+  Save.path = path;
+  Save.tmp = tmp;
+  Save.done = false;
+  if ((errno = pthread_create(&Save.thread, NULL, save_worker, NULL))) {
+    snapshot_free(Save.snap);
+    goto error;
+  }
+  Save.active = true;
+  status_show(STATUS_SAVING);
+  free(msg);
+  return;
+
+error:
+  swprintf(msg, scr_width, L"%s", strerror(errno));
+cleanup:
+  if (fp)
+    fclose(fp);
+  else if (fd >= 0)
+    close(fd);
+  if (tmp && (fd >= 0))
+    unlink(tmp);
+  free(tmp);
+  save_error(msg);
+  free(msg);
+}
+
+/** Write the snapshot and replace the target file
+ *
+ * Runs in its own thread and touches nothing but Save.
+ */
+void *save_worker(void *arg) {
+  Result res;
+  FILE *out;
+
+  if (!Save.compress)
+    res = snapshot_dump(Save.snap, Save.fp);
+  else if (!(out = compress_writer(fileno(Save.fp), Save.compress, ui_compress)))
+    res = result_new(false, NULL, L"Can't compress: %s", strerror(errno));
+  else {
+    res = snapshot_dump(Save.snap, out);
+    if (fclose(out) && res.success)
+      res = result_new(false, NULL, L"Can't compress: %s", strerror(errno));
+  }
+  if (res.success && (fflush(Save.fp) || fsync(fileno(Save.fp))))
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (res.success && !Save.tmp && !file_state(Save.path, &Save.st, NULL))
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (res.success && Save.tmp && fstat(fileno(Save.fp), &Save.st))
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (fclose(Save.fp) && res.success)
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (Save.tmp && res.success && rename(Save.tmp, Save.path))
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (Save.tmp && !res.success)
+    unlink(Save.tmp);
+
+  pthread_mutex_lock(&Save.lock);
+  Save.res = res;
+  Save.done = true;
+  pthread_mutex_unlock(&Save.lock);
+  ui_wake();
+
+  return NULL;
+}
+
+/** Finish the background save if it is done
+ *
+ * @return true if a save has just finished
+ */
+bool save_poll() {
+  bool done;
+
+  if (!Save.active)
+    return false;
+
+  pthread_mutex_lock(&Save.lock);
+  done = Save.done;
+  pthread_mutex_unlock(&Save.lock);
+  if (done)
+    save_finish();
+
+  return done;
+}
+
+/** Wait for the background save and report the result
+ */
+void save_finish() {
+  wchar_t *msg;
+
+  pthread_join(Save.thread, NULL);
+  snapshot_free(Save.snap);
+  free(Save.tmp);
+  Save.active = false;
+
+  if (Save.res.success) {
+    if (UI_File.path && (UI_File.path != Save.path))
+      free(UI_File.path);
+    UI_File.path = Save.path;
+    UI_File.loaded = true;
+    UI_File.saved = Save.changes;
+    disk_set(&FileDisk, &Save.st, NULL);
+    FileDeclined.known = false;
+    watch_update();
+    status_show(STATUS_SAVED);
+    if (Save.client)
+      control_reply(Save.client, "OK\n");
+    Save.client = NULL;
+  } else {
+    status_hide();
+    if (!(msg = calloc(scr_width, sizeof(wchar_t)))) {
+      save_error(L"Can't allocate msg");
+      return;
+    }
+    swprintf(msg, scr_width, L"%S", Save.res.msg);
+    save_error(msg);
+    free(msg);
+  }
+}
+
+/** Report a failed save to whoever asked for it
+ *
+ * Saves asked for over the socket are answered there, without a dialog
+ * in the way of the user.
+ */
+void save_error(wchar_t *msg) {
+  Client *c;
+
+  if (!(c = Save.client)) {
+    dlg_error(msg);
+    return;
+  }
+  Save.client = NULL;
+  control_reply(c, "ERR %ls\n", msg);
+}
+
+/** Block until the background save, if any, is finished
+ */
+void save_wait() {
+  if (Save.active)
+    save_finish();
+}
+
+/** Export the tree in a format picked by the file name
+ *
+ * Unlike saving this runs in the foreground, as export streams the
+ * tree without taking a snapshot.
+ *
+ * @param path Path ending in .html, .json or .opml (MBS)
+ */
+void file_export(char *path) {
+  Result res;
+  export_t format;
+  FILE *fp;
+
+  if (!export_type(path, &format)) {
+    dlg_error(DLG_ERR_EXPORT);
     return;
   }
   if (!(fp = fopen(path, "w"))) {
+    res = result_new(false, NULL, L"%s", strerror(errno));
+    dlg_error(res.msg);
+    return;
+  }
+  res = data_export(Root->entry, format, fp);
+  if (fclose(fp) && res.success)
+    res = result_new(false, NULL, L"%s", strerror(errno));
+  if (res.success)
+    status_show(STATUS_EXPORTED);
+  else
+    dlg_error(res.msg);
+}
+
+/** Check if there are changes since last load or save
+ */
+bool file_dirty() {
+  return data_changes() != UI_File.saved;
+}
+
+/** Save current file if it has changed
+ *
+ * Called once the user has been idle for long enough.
+ */
+void file_autosave() {
+  if (!UI_File.loaded || !file_dirty())
+    return;
+  if (Save.active)
+    timer_set(TIMER_AUTOSAVE, ui_autosave * 1000);
+  else if (disk_changed(NULL))
+    timer_set(TIMER_WATCH, 0);
+  else
+    file_save(UI_File.path);
+}
+
+/** Hash file contents
+ *
+ * Reads with pread, so the file position is left alone.
+ *
+ * @param fd Open file descriptor
+ * @return FNV-1a hash of the whole file
+ */
+unsigned long file_hash(int fd) {
+  unsigned char buf[65536];
+  unsigned long hash;
+  off_t offset;
+  ssize_t n, i;
+
+  hash = 14695981039346656037UL;
+  offset = 0;
+  while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+    for (i = 0; i < n; i++)
+      hash = (hash ^ buf[i]) * 1099511628211UL;
+    offset += n;
+  }
+
+  return hash;
+}
+
+/** Read the state of a file, or of a whole notebook directory
+ *
+ * For a directory the manifest and shards add up: sizes are summed,
+ * the latest mtime is kept and contents are hashed one after another.
+ *
+ * @param hash Where to store the contents hash, or NULL to only stat
+ * @return false with errno set on failure
+ */
+bool file_state(char *path, struct stat *st, unsigned long *hash) {
+  struct stat s;
+  Result res;
+  char **names;
+  int dir, fd, i;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+  if (fstat(fd, st)) {
+    close(fd);
+    return false;
+  }
+  if (!S_ISDIR(st->st_mode)) {
+    if (hash)
+      *hash = file_hash(fd);
+    close(fd);
+    return true;
+  }
+
+  dir = fd;
+  res = data_manifest(dir);
+  if (!res.success) {
+    close(dir);
+    return false;
+  }
+  names = (char **)res.data;
+  st->st_size = 0;
+  if (hash)
+    *hash = 14695981039346656037UL;
+  for (i = -1; (i < 0) || names[i]; i++) {
+    if ((fd = openat(dir, (i < 0) ? SHARD_MANIFEST : names[i], O_RDONLY)) < 0)
+      continue;
+    if (!fstat(fd, &s)) {
+      st->st_size += s.st_size;
+      if (s.st_mtime > st->st_mtime)
+        st->st_mtime = s.st_mtime;
+    }
+    if (hash)
+      *hash = (*hash ^ file_hash(fd)) * 1099511628211UL;
+    close(fd);
+  }
+  manifest_free(names);
+  close(dir);
+
+  return true;
+}
+
+/** Remember file state
+ *
+ * @param hash Contents hash, or NULL if not known
+ */
+void disk_set(Disk *d, struct stat *st, unsigned long *hash) {
+  d->known = true;
+  d->hashed = hash != NULL;
+  d->size = st->st_size;
+  d->mtime = st->st_mtime;
+  d->ino = st->st_ino;
+  d->hash = hash ? *hash : 0;
+}
+
+/** Check if file state matches without looking at the contents
+ */
+bool disk_same(Disk *d, struct stat *st) {
+  return d->known && (d->size == st->st_size) && (d->mtime == st->st_mtime) &&
+         (d->ino == st->st_ino);
+}
+
+/** Read state of the current file from disk, without its contents
+ */
+void disk_read() {
+  struct stat st;
+
+  FileDisk.known = false;
+  FileDeclined.known = false;
+  if (UI_File.loaded && file_state(UI_File.path, &st, NULL))
+    disk_set(&FileDisk, &st, NULL);
+}
+
+/** Check if the current file was changed by someone else
+ *
+ * Contents are only hashed when size, mtime or inode differ, so
+ * touching the file doesn't count as a change once its hash is known.
+ * Until then any such difference does.
+ *
+ * @param seen Where to store the state of a changed file, or NULL
+ * @return true if the file on disk differs from what was last seen
+ */
+bool disk_changed(Disk *seen) {
+  struct stat st;
+  unsigned long hash;
+
+  if (!UI_File.loaded || !FileDisk.known)
+    return false;
+  if (!file_state(UI_File.path, &st, NULL) || disk_same(&FileDisk, &st))
+    return false;
+  if (!file_state(UI_File.path, &st, &hash))
+    return false;
+  if (!FileDisk.hashed || (hash != FileDisk.hash)) {
+    if (seen)
+      disk_set(seen, &st, &hash);
+    return true;
+  }
+  disk_set(&FileDisk, &st, &hash);
+
+  return false;
+}
+
+/** React to the current file being changed by someone else
+ *
+ * Unchanged trees are reloaded right away, otherwise the user is asked,
+ * but only once for each version of the file.
+ */
+void file_check() {
+  Disk seen;
+
+  if (Save.active || (Mode == EDIT)) {
+    timer_set(TIMER_WATCH, WATCH_DELAY);
+    return;
+  }
+  if (!disk_changed(&seen))
+    return;
+
+  if (!file_dirty()) {
+    if (file_reload())
+      status_show(STATUS_RELOADED);
+    return;
+  }
+  if (FileDeclined.known && (FileDeclined.hash == seen.hash))
+    return;
+  if (dlg_file(DLG_CHANGED, DLG_MSG_CHANGED))
+    file_reload();
+  else
+    FileDeclined = seen;
+  update(ALL);
+}
+
+/** Watch the directory of the current file
+ *
+ * The directory is watched rather than the file itself, so that files
+ * replaced by a rename are noticed as well. Notebook directories are
+ * watched themselves.
+ */
+void watch_update() {
+#ifdef __linux__
+  struct stat st;
+  char *name, *dir;
+
+  if (Watch.path && UI_File.loaded && !strcmp(Watch.path, UI_File.path))
+    return;
+
+  if (Watch.wd >= 0)
+    inotify_rm_watch(Watch.fd, Watch.wd);
+  Watch.wd = -1;
+  free(Watch.path);
+  Watch.path = NULL;
+  if (!UI_File.loaded)
+    return;
+
+  if ((Watch.fd < 0) && ((Watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0))
+    return;
+  if (!(Watch.path = strdup(UI_File.path)))
+    return;
+  Watch.dir = !stat(Watch.path, &st) && S_ISDIR(st.st_mode);
+  if (Watch.dir) {
+    Watch.wd = inotify_add_watch(Watch.fd, Watch.path, IN_CLOSE_WRITE | IN_MODIFY |
+                                 IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    return;
+  }
+  name = strrchr(Watch.path, '/');
+  if (!name || !(dir = strndup(Watch.path, name - Watch.path + 1)))
+    return;
+  Watch.wd = inotify_add_watch(Watch.fd, dir, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO |
+                               IN_CREATE);
+  free(dir);
+#endif
+}
+
+/** Consume watch events and schedule a check of the current file
+ */
+void watch_read() {
+#ifdef __linux__
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  char *name;
+  ssize_t n, i;
+
+  if (!Watch.path)
+    name = NULL;
+  else
+    name = strrchr(Watch.path, '/') + 1;
+  while ((n = read(Watch.fd, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < n; i += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)(buf + i);
+      if (!name || !ev->len)
+        continue;
+      // Anything in a notebook but temporary files
+      if (Watch.dir ? (ev->name[0] != '.') : !strcmp(ev->name, name))
+        timer_set(TIMER_WATCH, WATCH_DELAY);
+    }
+  }
+#endif
+}
+
+/** Listen for commands on ui_socket
+ *
+ * A stale socket left by an instance that is gone is replaced, a live
+ * one is not.
+ */
+bool control_open() {
+  struct sockaddr_un addr;
+  int i, fd;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    Control.clients[i].fd = -1;
+  if (!ui_socket)
+    return true;
+  if (strlen(ui_socket) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, ui_socket);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return false;
+  if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    errno = EADDRINUSE;
+    return false;
+  }
+  close(fd);
+  unlink(ui_socket);
+
+  if ((Control.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return false;
+  fcntl(Control.fd, F_SETFL, O_NONBLOCK);
+  fcntl(Control.fd, F_SETFD, FD_CLOEXEC);
+  if (bind(Control.fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(Control.fd, CONTROL_CLIENTS)) {
+    close(Control.fd);
+    Control.fd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+/** Stop listening and drop all clients
+ */
+void control_close() {
+  int i;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    control_drop(&Control.clients[i]);
+  if (Control.fd < 0)
+    return;
+  close(Control.fd);
+  Control.fd = -1;
+  unlink(ui_socket);
+}
+
+/** Take a new connection, if there is room for it
+ */
+void control_accept() {
+  int i, fd;
+
+  while ((fd = accept(Control.fd, NULL, NULL)) >= 0) {
+    for (i = 0; (i < CONTROL_CLIENTS) && (Control.clients[i].fd >= 0); i++);
+    if (i == CONTROL_CLIENTS) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Control.clients[i].fd = fd;
+  }
+}
+
+/** Read from a client and run every complete command line
+ *
+ * Once the buffer is full the lines in it are run to make room, so
+ * only a single line may not be longer than CONTROL_LINE_MAX.
+ */
+void control_read(Client *c) {
+  char *buffer;
+  ssize_t n;
+
+  for (;;) {
+    if (c->in_size - c->in_len < 4096) {
+      if (c->in_size >= CONTROL_LINE_MAX) {
+        if (!c->held)
+          control_run(c);
+        if ((c->fd < 0) || c->held)
+          return;
+        if (c->in_size - c->in_len < 4096) {
+          control_drop(c);  // line too long
+          return;
+        }
+        continue;
+      }
+      if (!(buffer = realloc(c->in, c->in_size + 4096))) {
+        control_drop(c);
+        return;
+      }
+      c->in = buffer;
+      c->in_size += 4096;
+    }
+    if ((n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len - 1)) <= 0)
+      break;
+    c->in_len += n;
+  }
+  if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+    control_drop(c);
+    return;
+  }
+
+  control_run(c);
+}
+
+/** Run the complete command lines a client has sent
+ *
+ * While an entry is being edited commands are held back, so that they
+ * neither change the tree under the editor nor miss the text typed so
+ * far. They also wait for a save the client asked for, so that replies
+ * come in order. The main loop runs held commands later.
+ */
+void control_run(Client *c) {
+  char *line, *nl;
+
+  line = c->in;
+  while ((c->fd >= 0) && (Mode != EDIT) && (Save.client != c) &&
+         (nl = memchr(line, '\n', c->in_len - (line - c->in)))) {
+    *nl = '\0';
+    control_do(c, line);
+    line = nl + 1;
+  }
+  if (c->fd < 0)
+    return;
+  c->in_len -= line - c->in;
+  memmove(c->in, line, c->in_len);
+  c->held = c->in_len && memchr(c->in, '\n', c->in_len);
+}
+
+/** Send as much pending output as the client takes
+ */
+void control_write(Client *c) {
+  ssize_t n;
+
+  while (c->out_len && ((n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL)) > 0)) {
+    c->out_len -= n;
+    memmove(c->out, c->out + n, c->out_len);
+  }
+  if (c->out_len && (errno != EAGAIN) && (errno != EINTR))
+    control_drop(c);
+}
+
+/** Close a client connection
+ */
+void control_drop(Client *c) {
+  if (Save.client == c)
+    Save.client = NULL;
+  if (c->fd >= 0)
+    close(c->fd);
+  free(c->in);
+  free(c->out);
+  bzero(c, sizeof(Client));
+  c->fd = -1;
+}
+
+/** Run a single command
+ *
+ * Commands are tab separated fields, with entry paths written the same
+ * as in batch mode:
+ *
+ *     insert PATH TEXT  - add TEXT as the last child of PATH, or at the
+ *                         end of the top level for an empty PATH
+ *     cross PATH        - cross out an entry
+ *     uncross PATH      - remove crossing out
+ *     query PATH        - print an entry with its children
+ *     save              - save the file, if changed, answered once it
+ *                         is written
+ *
+ * Every command is answered with a line starting with OK or ERR,
+ * preceded by the output of query.
+ */
+void control_do(Client *c, char *line) {
+  Result res;
+  Entry *e, *last;
+  wchar_t *command, *path, *text;
+  FILE *out;
+  char *buf;
+  size_t size, length;
+  bool ok;
+
+  length = strlen(line);
+  if (!(command = calloc(length + 1, sizeof(wchar_t))) ||
+      (mbstowcs(command, line, length + 1) == (size_t)-1)) {
+    control_reply(c, "ERR Invalid characters\n");
+    free(command);
+    return;
+  }
+  path = text = NULL;
+  if ((path = wcschr(command, L'\t'))) {
+    *path++ = L'\0';
+    if ((text = wcschr(path, L'\t')))
+      *text++ = L'\0';
+  }
+  e = path && *path ? control_find(path) : NULL;
+
+  if (!wcscmp(command, L"insert")) {
+    if (!text || !*text || wcschr(text, L'\t'))
+      control_reply(c, "ERR Missing text\n");
+    else if (*path && !e)
+      control_reply(c, "ERR No entry at '%ls'\n", path);
+    else {
+      for (last = e ? e : control_top(); !e && last->next; last = last->next);
+      res = entry_insert(last, AFTER, wcslen(text));
+      if (res.success && e && !entry_indent((Entry *)res.data, RIGHT))
+        res = result_new(false, NULL, L"Couldn't indent entry");
+      if (res.success) {
+        wcscpy(((Entry *)res.data)->text, text);
+        res = vitree_insert((Entry *)res.data);
+        if (!res.success)
+          res = ui_set_root(control_top());
+        update(ALL);
+      }
+      control_reply(c, res.success ? "OK\n" : "ERR %ls\n", res.msg);
+    }
+
+  } else if (!wcscmp(command, L"cross") || !wcscmp(command, L"uncross")) {
+    if (!e)
+      control_reply(c, "ERR No entry at '%ls'\n", path ? path : L"");
+    else {
+      if (e->crossed != (command[0] == L'c')) {
+        e->crossed = !e->crossed;
+        entry_touch(e);
+        update(ALL);
+      }
+      control_reply(c, "OK\n");
+    }
+
+  } else if (!wcscmp(command, L"query")) {
+    if (!e)
+      control_reply(c, "ERR No entry at '%ls'\n", path ? path : L"");
+    else if (!(out = open_memstream(&buf, &size)))
+      control_reply(c, "ERR Couldn't allocate output\n");
+    else {
+      ok = control_dump(out, e, 0);
+      ok = !fclose(out) && ok;
+      control_reply(c, "%s%s\n", ok ? buf : "", ok ? "OK" : "ERR Couldn't read entry");
+      free(buf);
+      update(ALL);  // entries may have been expanded
+    }
+
+  } else if (!wcscmp(command, L"save")) {
+    if (!UI_File.loaded)
+      control_reply(c, "ERR No file\n");
+    else if (Save.active)
+      control_reply(c, "ERR Already saving\n");
+    else if (disk_changed(NULL))
+      control_reply(c, "ERR File changed on disk\n");
+    else if (!file_dirty())
+      control_reply(c, "OK\n");
+    else {
+      // Answered by save_finish() or save_error()
+      Save.client = c;
+      file_save(UI_File.path);
+    }
+
+  } else
+    control_reply(c, "ERR Unknown command\n");
+
+  free(command);
+}
+
+/** Queue a reply to a client and try sending it right away
+ */
+void control_reply(Client *c, const char *fmt, ...) {
+  va_list args;
+  char *buffer;
+  size_t size;
+  int n;
+
+  va_start(args, fmt);
+  n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return;
+  if (c->out_size < c->out_len + n + 1) {
+    size = c->out_len + n + 1;
+    if (!(buffer = realloc(c->out, size))) {
+      control_drop(c);
+      return;
+    }
+    c->out = buffer;
+    c->out_size = size;
+  }
+  va_start(args, fmt);
+  vsnprintf(c->out + c->out_len, n + 1, fmt, args);
+  va_end(args);
+  c->out_len += n;
+
+  control_write(c);
+}
+
+/** Write an entry with all its children
+ */
+bool control_dump(FILE *out, Entry *e, int level) {
+  if (!entry_dump(e, level, out) || !entry_expand(e).success)
+    return false;
+  for (e = e->child; e; e = e->next)
+    if (!control_dump(out, e, level + 1))
+      return false;
+
+  return true;
+}
+
+/** Find an entry by its path
+ *
+ * Entries on the way are parsed if needed.
+ */
+Entry *control_find(wchar_t *path) {
+  Entry *e;
+  wchar_t *sep;
+  size_t length;
+
+  e = control_top();
+  for (;;) {
+    sep = wcsstr(path, L"" ENTRY_PATH_SEP);
+    length = sep ? (size_t)(sep - path) : wcslen(path);
+    for (; e && ((wcslen(e->text) != length) || wcsncmp(e->text, path, length)); e = e->next);
+    if (!e || !sep)
+      return e;
+    if (!entry_expand(e).success)
+      return NULL;
+    e = e->child;
+    path = sep + wcslen(L"" ENTRY_PATH_SEP);
+  }
+}
+
+/** Get the first top level entry
+ */
+Entry *control_top() {
+  Entry *e;
+
+  for (e = Root->entry; e->parent; e = e->parent);
+  for (; e->prev; e = e->prev);
+
+  return e;
+}
+
+/** Show a short message in the top right corner
+ */
+void status_show(wchar_t *msg) {
+  int len;
+
+  status_hide();
+  len = wcslen(msg);
+  if (len > scr_width)
+    return;
+  if (!(scr_status = newwin(1, len, 0, scr_x + scr_width - len)))
+    return;
+  status_msg = msg;
+  leaveok(scr_status, true);
+  wbkgd(scr_status, COLOR_PAIR(COLOR_INFO));
+  wattron(scr_status, A_BOLD | A_REVERSE);
+  waddnwstr(scr_status, msg, len);
+  wattroff(scr_status, A_BOLD | A_REVERSE);
+  wnoutrefresh(scr_status);
+}
+
+/** Remove the status message and uncover the main window
+ */
+void status_hide() {
+  if (!scr_status)
+    return;
+  delwin(scr_status);
+  scr_status = NULL;
+  status_msg = NULL;
+  touchline(scr_main, 0, 1);
+  wnoutrefresh(scr_main);
+}
+
+/** Put the status message back over the main window
+ */
+void status_refresh() {
+  if (!scr_status)
+    return;
+  touchwin(scr_status);
+  wnoutrefresh(scr_status);
+}
+
+/** Parse a file in the background
+ *
+ * Parsing runs behind a progress dialog and can be cancelled.
+ * Errors are reported to the user.
+ *
+ * @param path Absolute path to a file (MBS)
+ * @return Parsed tree, or NULL on failure
+ */
+Entry *file_parse(char *path) {
+  Result res;
+  wchar_t *msg;
+  FILE *fp;
+
+  if (!(msg = calloc(scr_width, sizeof(wchar_t)))) {
+    dlg_error(L"Can't allocate msg");
+    return NULL;
+  }
+  if (!(fp = fopen(path, "r"))) {
     swprintf(msg, scr_width, L"%s", strerror(errno));
     dlg_error(msg);
+    free(msg);
+    return NULL;
+  }
+
+  Load.fp = fp;
+  Load.path = path;
+  if (!file_state(path, &Load.st, NULL))
+    Load.st.st_size = 0;
+  Load.ctl.cancel = false;
+  Load.ctl.done = 0;
+  Load.done = false;
+  if ((errno = pthread_create(&Load.thread, NULL, load_worker, NULL))) {
+    res = result_new(false, NULL, L"%s", strerror(errno));
   } else {
-    res = data_dump(Root->entry, fp);
-    if (res.success) {
-      if (UI_File.path && (UI_File.path != path))
-        free(UI_File.path);
-      UI_File.path = path;
-      UI_File.loaded = true;
-    } else {
-      swprintf(msg, scr_width, L"%S", res.msg);
-      dlg_error(msg);
+    res = dlg_load(Load.st.st_size);
+    pthread_join(Load.thread, NULL);
+    if (res.success && !res.data) {
+      res = entry_new(0);
+      if (res.success)
+        ((Entry *)res.data)->length = 0;
     }
-    fclose(fp);
   }
-  free(msg);
+  fclose(fp);
+
+  if (!res.success && !Load.ctl.cancel) {
+    swprintf(msg, scr_width, L"%S", res.msg);
+    dlg_error(msg);
+  }
+  free(msg);
+
+  return res.success ? (Entry *)res.data : NULL;
+}
+
+/** Load tree from file
+ *
+ * Current tree is only replaced once the new one is parsed, which will
+ * also update UI_File as needed.
+ *
+ * @param path Absolute path to a file (MBS)
+ */
+void file_load(char *path) {
+  Result res;
+  Entry *new, *old;
+
+  if (!(new = file_parse(path)))
+    return;
+
+  save_wait();
+  for (old = Root->entry; old->parent; old = old->parent);
+  for (; old->prev; old = old->prev);
+  res = ui_set_root(new);
+  if (res.success) {
+    data_unload(old);
+    if (UI_File.path && (UI_File.path != path))
+      free(UI_File.path);
+    UI_File.path = path;
+    UI_File.loaded = true;
+    UI_File.saved = data_changes();
+    disk_set(&FileDisk, &Load.st, NULL);
+    FileDeclined.known = false;
+    watch_update();
+  } else
+    dlg_error(res.msg);
+  ui_refresh();
+}
+
+/** Reload current file keeping as much as possible
+ *
+ * The new tree is merged into the current one, so unchanged entries
+ * keep their open state and cached layout, and only the changed parts
+ * of the visual tree are rebuilt. The cursor stays on the same entry
+ * if it's still there.
+ *
+ * @return true if the file was parsed
+ */
+bool file_reload() {
+  Result res;
+  Entry *new, *old, *dropped;
+
+  if (!(new = file_parse(UI_File.path)))
+    return false;
+
+  save_wait();
+  for (old = Root->entry; old->parent; old = old->parent);
+  for (; old->prev; old = old->prev);
+  new = data_merge(old, new, &dropped);
+  res = vitree_sync(new);
+  if (!res.success) {
+    res = ui_set_root(new);
+    if (!res.success)
+      dlg_error(res.msg);
+  }
+  if (dropped) {
+    file_forget(dropped);
+    data_unload(dropped);
+  }
+  UI_File.saved = data_changes();
+  disk_set(&FileDisk, &Load.st, NULL);
+  FileDeclined.known = false;
+  update(ALL);
+
+  return true;
+}
+
+/** Remove all references to entries about to be freed
+ *
+ * @param dropped Subtrees linked through `next`
+ */
+void file_forget(Entry *dropped) {
+  EntryMap map;
+  ElmOpen *t, *n;
+  Entry *e;
+  int count;
+
+  count = 0;
+  for (e = dropped; e; e = entry_walk(e))
+    count++;
+  if (!entrymap_new(&map, count).success) {
+    elmopen_clear();
+    Undo.present = false;
+    return;
+  }
+  for (e = dropped; e; e = entry_walk(e))
+    entrymap_put(&map, e, e);
+
+  for (t = ElmOpenRoot; t; t = n) {
+    n = t->next;
+    if (entrymap_get(&map, t->entry))
+      elmopen_remove(t);
+  }
+  if (Undo.other && entrymap_get(&map, Undo.other))
+    Undo.present = false;
+  entrymap_free(&map);
 }
 
-/** Load tree from file
+/** Parse the file being loaded
  *
- * This will also discard current tree and update UI_File as needed.
- *
- * @param path Absolute path to a file (MBS)
+ * Runs in its own thread and touches nothing but Load.
  */
-void file_load(char *path) {
+void *load_worker(void *arg) {
   Result res;
-  wchar_t *msg;
-  FILE *fp;
 
-  if (!(msg = calloc(scr_width, sizeof(wchar_t)))) {
-    dlg_error(L"Can't allocate msg");
-    return;
-  }
-  if (!(fp = fopen(path, "r"))) {
-    swprintf(msg, scr_width, L"%s", strerror(errno));
-    dlg_error(msg);
-  } else {
-    res = data_load(fp);
-    if (res.success) {
-      res = ui_set_root((Entry *)res.data);
-      if (res.success) {
-        if (UI_File.path && (UI_File.path != path))
-          free(UI_File.path);
-        UI_File.path = path;
-        UI_File.loaded = true;
-      } else {
-        swprintf(msg, scr_width, L"%S", res.msg);
-        dlg_error(msg);
-      }
-      ui_refresh();
-    } else {
-      swprintf(msg, scr_width, L"%S", res.msg);
-      dlg_error(msg);
-    }
-    fclose(fp);
-  }
-  free(msg);
+  res = data_load_lazy(Load.fp, ui_lazy, &Load.ctl);
+  if (res.success && S_ISDIR(Load.st.st_mode))
+    file_state(Load.path, &Load.st, NULL);
+  else if (res.success)
+    fstat(fileno(Load.fp), &Load.st);
+
+  pthread_mutex_lock(&Load.lock);
+  Load.res = res;
+  Load.done = true;
+  pthread_mutex_unlock(&Load.lock);
+  ui_wake();
+
+  return NULL;
 }
 
 /** Setup new dialog window
@@ -291,6 +1535,67 @@ void dlg_info(wchar_t *msg) {
   dlg_simple(DLG_INFO, msg, COLOR_INFO);
 }
 
+/** Show progress of the background load until it is done
+ *
+ * The load can be cancelled with KEY_ABORT.
+ *
+ * @param total Expected number of bytes, or 0 if unknown
+ * @return Result of the load
+ */
+Result dlg_load(long total) {
+  struct pollfd fds[2];
+  WINDOW *win;
+  wchar_t input;
+  char buf[64];
+  bool done;
+  int x, type;
+
+  fds[0].fd = STDIN_FILENO;
+  fds[0].events = POLLIN;
+  fds[1].fd = Wake[0];
+  fds[1].events = POLLIN;
+
+  win = dlg_newwin(DLG_LOAD, COLOR_INFO);
+  x = getcurx(win) + 1;
+  while (true) {
+    pthread_mutex_lock(&Load.lock);
+    done = Load.done;
+    pthread_mutex_unlock(&Load.lock);
+    if (done)
+      break;
+
+    dlg_progress(win, x, Load.ctl.done, total);
+    if ((poll(fds, 2, LOAD_POLL) > 0) && (fds[1].revents & POLLIN))
+      while (read(Wake[0], buf, sizeof(buf)) > 0);
+    timeout(0);
+    type = get_wch((wint_t *)&input);
+    timeout(-1);
+    if ((type == KEY_TYPE) && (input == KEY_ABORT))
+      Load.ctl.cancel = true;
+  }
+  dlg_delwin(win);
+
+  return Load.res;
+}
+
+/** Draw a progress bar with percentage from x to the end of a dialog
+ */
+void dlg_progress(WINDOW *win, int x, long done, long total) {
+  wchar_t cells[] = {PROGRESS_DONE, PROGRESS_LEFT};
+  int i, width, filled, percent;
+
+  percent = total > 0 ? (done * 100) / total : 0;
+  percent = percent > 100 ? 100 : percent;
+  width = scr_width - x - 6;
+  filled = (width * percent) / 100;
+
+  wmove(win, 0, x);
+  for (i = 0; i < width; i++)
+    waddnwstr(win, cells + (i >= filled), 1);
+  wprintw(win, " %3d%%", percent);
+  wrefresh(win);
+}
+
 /** Show a yes/no dialog
  */
 bool dlg_bool(wchar_t *title, wchar_t *msg, int color) {
@@ -589,6 +1894,12 @@ char *dlg_save_as() {
   return dlg_file_path(DLG_SAVEAS, COLOR_WARN, D_SAVE);
 }
 
+/** Show an export dialog
+ */
+char *dlg_export() {
+  return dlg_file_path(DLG_EXPORT, COLOR_WARN, D_SAVE);
+}
+
 /** Show a open file dialog
  */
 char *dlg_open() {
@@ -619,86 +1930,77 @@ void dlg_info_file() {
 
 /** Update cursor internal data
  *
- * This update cursor internal data.
+ * This makes sure the layout of the current element is up to date.
  */
 void cursor_update() {
+  element_layout(Current);
   Cursor.lx = Current->lx + BULLET_WIDTH;
-  Cursor.ex = Cursor.lx + (Current->entry->length % Current->width);
-  Cursor.ey = Current->ly + Current->lines - 1;
 }
 
 /** Move cursor home
  */
 void cursor_home() {
-  Cursor.y = Current->ly;
-  Cursor.x = Cursor.lx;
   Cursor.index = 0;
-  cursor_fix();
+  cursor_recalc();
 }
 
 /** Move cursor end
  */
 void cursor_end() {
-  Cursor.y = Cursor.ey;
-  Cursor.x = Cursor.ex;
   Cursor.index = Current->entry->length;
-  cursor_fix();
+  cursor_recalc();
 }
 
 /** Advance cursor in given direction
  *
- * This basically implements 'the arrow keys'.
+ * This basically implements 'the arrow keys'. Vertical movement tries
+ * to keep the screen column.
  */
 void cursor_move(cur_move_t dir) {
+  Layout *l;
+  int line;
+
+  l = &Current->open->layout;
+  line = layout_line(l, Cursor.index);
   switch (dir) {
     case C_UP:
-      if (Cursor.y > Current->ly) {
-        Cursor.y--;
-        Cursor.index -= Current->width;
-      }
+      if (line > 0)
+        Cursor.index = layout_index(l, Current->entry, line - 1, Cursor.x - Cursor.lx);
       break;
     case C_DOWN:
-      if (Cursor.y < Cursor.ey) {
-        Cursor.y++;
-        if ((Cursor.y == Cursor.ey) && (Cursor.x > Cursor.ex)) {
-          Cursor.x = Cursor.ex;
-          Cursor.index = Current->entry->length;
-        } else
-          Cursor.index += Current->width;
-      }
+      if (line < l->lines - 1)
+        Cursor.index = layout_index(l, Current->entry, line + 1, Cursor.x - Cursor.lx);
       break;
     case C_LEFT:
-      if (Cursor.index > 0) {
-        Cursor.x--;
-        if (Cursor.x < Cursor.lx) {
-          Cursor.x = scr_width - 1;
-          if (Cursor.y > Current->ly)
-            Cursor.y--;
-        }
+      if (Cursor.index > 0)
         Cursor.index--;
-      }
       break;
     case C_RIGHT:
-      if (Cursor.index < Current->entry->length) {
-        Cursor.x++;
-        if (Cursor.x == scr_width) {
-          if (Cursor.y < Cursor.ey) {
-            Cursor.y++;
-            Cursor.x = Cursor.lx;
-          }
-        }
+      if (Cursor.index < Current->entry->length)
         Cursor.index++;
-      }
       break;
   }
-  cursor_fix();
+  cursor_recalc();
 }
 
-/** Recalculate cursor index from current position
+/** Recalculate cursor position from current index
+ *
+ * This finds the line and column, the screen row is only known
+ * once the current element has been drawn (see cursor_fix()).
+ *
+ * If the last line is full the cursor stays on its last column.
  */
 void cursor_recalc() {
-  int index = Cursor.index > 0 ? Cursor.index : 1;
-  Cursor.y = Current->ly + (index / Current->width);
+  Layout *l;
+  int col;
+
+  l = &Current->open->layout;
+  Cursor.line = layout_line(l, Cursor.index);
+  col = text_width(Current->entry->text + l->breaks[Cursor.line],
+                   Cursor.index - l->breaks[Cursor.line]);
+  Cursor.x = Cursor.lx + col;
+  if (Cursor.x >= scr_width)
+    Cursor.x = scr_width - 1;
 }
 
 /** Fix cursor in case we're in partial view
@@ -712,75 +2014,68 @@ void cursor_recalc() {
 void cursor_fix() {
   int y;
 
-  y = Cursor.y;
+  Cursor.y = y = Current->ly + Cursor.line;
   if (Partial.is) {
     if (Cursor.y < Partial.offset) {
       Partial.offset = Cursor.y;
-      Partial.less = true;
-      Partial.more = true;
-      if (Partial.offset == 0) {
-        Partial.less = false;
-        Partial.more = true;
-      }
-      update(CURRENT);
-      y = 0;
+      draw(CURRENT);
     } else if (Cursor.y > (Partial.offset + (LINES - 1))) {
       Partial.offset = Cursor.y - (LINES - 1);
-      Partial.less = true;
-      Partial.more = true;
-      if (Partial.offset == Partial.limit) {
-        Partial.less = true;
-        Partial.more = false;
-      }
-      update(CURRENT);
-      y = LINES - 1;
-    } else
-      y -= Partial.offset;
+      draw(CURRENT);
+    }
+    y -= Partial.offset;
   }
   wmove(scr_main, y, Cursor.x);
 }
 
 /** Handle character entry
- *
- * This also updates and refreshes the screen.
  */
 void edit_insert(wchar_t ch) {
+  edit_insert_text(&ch, 1);
+}
+
+/** Insert text at cursor position
+ *
+ * Only marks the screen for update, drawing happens once all pending
+ * input has been handled.
+ */
+void edit_insert_text(wchar_t *text, int length) {
+  Result res;
   Entry *e;
   wchar_t *new;
+  int lines, size;
 
   e = Current->entry;
 
-  if ((e->length + 2) > e->size) {
-    e->size += scr_width;
-    if (!(new = realloc(e->text, e->size * sizeof(wchar_t)))) {
+  res = entry_own(e);
+  if (!res.success) {
+    dlg_error(res.msg);
+    return;
+  }
+  if ((e->length + length + 1) > e->size) {
+    // Doubling keeps reallocations rare however long the text gets
+    size = e->length + length + 1 + scr_width;
+    if (size < e->size * 2)
+      size = e->size * 2;
+    if (!(new = realloc(e->text, size * sizeof(wchar_t)))) {
       dlg_error(L"Couldn't realloc Entry text buffer");
       return;
     }
     e->text = new;
+    e->size = size;
   }
-  wmemmove(e->text+Cursor.index+1, e->text+Cursor.index, e->length - Cursor.index);
-  e->length++;
-  e->text[Cursor.index] = ch;
+  wmemmove(e->text+Cursor.index+length, e->text+Cursor.index, e->length - Cursor.index);
+  wmemcpy(e->text+Cursor.index, text, length);
+  e->length += length;
   e->text[e->length] = L'\0';
-
-  if (Cursor.ex + 1 == scr_width) {
-    Current->lines++;
-    if (Partial.is) {
-      Partial.limit++;
-      if (Cursor.x == scr_width)
-        Partial.offset++;
-    }
-    update(ALL);
-    cursor_update();
-    cursor_recalc();
-    cursor_move(C_RIGHT);
-    wrefresh(scr_main);
-  } else {
-    update(CURRENT);
-    cursor_update();
-    cursor_move(C_RIGHT);
-    wrefresh(scr_main);
-  }
+  entry_touch(e);
+
+  lines = Current->lines;
+  layout_invalidate(&Current->open->layout);
+  cursor_update();
+  update(Current->lines != lines ? ALL : CURRENT);
+  Cursor.index += length;
+  cursor_recalc();
 }
 
 /** Handle character deletion
@@ -789,12 +2084,12 @@ void edit_insert(wchar_t ch) {
  * of delete and backspace keys. Using other values will probably
  * blow the whole thing up.
  *
- * This also updates and refreshes the screen.
- *
  * @param offset `0` for delete, `-1` for backspace
  */
 void edit_remove(int offset) {
+  Result res;
   Entry *e;
+  int lines;
 
   e = Current->entry;
 
@@ -807,42 +2102,321 @@ void edit_remove(int offset) {
   if ((offset == 0) && (Cursor.index == e->length))
     return;
 
+  res = entry_own(e);
+  if (!res.success) {
+    dlg_error(res.msg);
+    return;
+  }
+
   wmemmove(e->text+Cursor.index+offset, e->text+Cursor.index+offset+1,
            e->length - Cursor.index);
   e->length--;
   e->text[e->length] = L'\0';
+  entry_touch(e);
+
+  lines = Current->lines;
+  layout_invalidate(&Current->open->layout);
+  cursor_update();
+  update(Current->lines != lines ? ALL : CURRENT);
+  Cursor.index += offset;
+  cursor_recalc();
+}
+
+/** Update line breaks for given width
+ *
+ * Lines are broken after the last space that fits, or mid-word if
+ * there is none, taking display width of characters into account.
+ * Line `n` spans text from `breaks[n]` up to `breaks[n+1]`.
+ *
+ * This does nothing if the cached breaks are still valid.
+ */
+void layout_update(Layout *l, Entry *e, int width) {
+  int *new;
+  int i, col, w, start, space;
+
+  if (!l->breaks) {
+    l->breaks = l->inline_breaks;
+    l->size = LAYOUT_INLINE;
+  }
+  if (width < 1)
+    width = 1;
+  if ((l->width == width) && (l->length == e->length))
+    return;
 
-  if (Cursor.ex == Cursor.lx) {
-    Current->lines--;
-    if (Partial.is) {
-      Partial.limit--;
-      if (Partial.offset > 0) {
-        Partial.offset--;
-        if (Partial.offset == 0)
-          Partial.less = false;
+  l->lines = 0;
+  l->breaks[0] = start = col = 0;
+  space = -1;
+  for (i = 0; i <= e->length; i++) {
+    if (i < e->length) {
+      w = text_width(e->text + i, 1);
+      if ((col + w <= width) || (i == start)) {
+        if (e->text[i] == L' ')
+          space = i;
+        col += w;
+        continue;
       }
-    }
-    update(ALL);
-    cursor_update();
-    cursor_recalc();
-    if (offset == -1) {
-      if (Cursor.index == e->length)
-        Cursor.index++;
-      cursor_move(C_LEFT);
-    } else
-      cursor_fix();
-    wrefresh(scr_main);
-  } else {
-    update(CURRENT);
-    cursor_update();
-    if (offset == -1) {
-      if (Cursor.index == e->length)
-        Cursor.index++;
-      cursor_move(C_LEFT);
+      if (space > start) {
+        start = space + 1;
+        col = text_width(e->text + start, i - start);
+        i--;
+      } else {
+        start = i--;
+        col = 0;
+      }
+      space = -1;
     } else
-      cursor_fix();
-    wrefresh(scr_main);
+      start = e->length;
+
+    if (l->lines + 2 > l->size) {
+      if (l->breaks == l->inline_breaks) {
+        if ((new = malloc(l->size * 2 * sizeof(int))))
+          memcpy(new, l->breaks, l->size * sizeof(int));
+      } else
+        new = realloc(l->breaks, l->size * 2 * sizeof(int));
+      if (!new) {
+        // Pretend what's left is a single line
+        l->breaks[l->lines] = e->length;
+        break;
+      }
+      l->breaks = new;
+      l->size *= 2;
+    }
+    l->breaks[++l->lines] = start;
+  }
+
+  l->width = width;
+  l->length = e->length;
+  l->version = ++layout_version;
+}
+
+/** Mark line breaks as stale
+ *
+ * Has to be called whenever the entry text changes.
+ */
+void layout_invalidate(Layout *l) {
+  l->width = 0;
+}
+
+/** Release line breaks buffer
+ */
+void layout_free(Layout *l) {
+  if (l->breaks && (l->breaks != l->inline_breaks))
+    free(l->breaks);
+  l->breaks = NULL;
+  l->width = 0;
+}
+
+/** Find line containing given text index
+ */
+int layout_line(Layout *l, int index) {
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = l->lines - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (l->breaks[mid] <= index)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+/** Find text index at given line and screen column
+ */
+int layout_index(Layout *l, Entry *e, int line, int col) {
+  int i, end, w;
+
+  i = l->breaks[line];
+  end = line < l->lines - 1 ? l->breaks[line + 1] - 1 : e->length;
+  for (; i < end; i++) {
+    w = text_width(e->text + i, 1);
+    col -= w;
+    if (col < 0)
+      break;
+  }
+
+  return i;
+}
+
+/** Get display width of text
+ *
+ * Non-printable characters count as a single column.
+ */
+int text_width(wchar_t *text, int n) {
+  int i, w, width;
+
+  width = 0;
+  for (i = 0; i < n; i++) {
+    w = wcwidth(text[i]);
+    width += w < 0 ? 1 : w;
+  }
+
+  return width;
+}
+
+/** Read pasted text up to the end marker
+ *
+ * Line breaks are kept as `\n`, other non-printable characters
+ * are dropped.
+ *
+ * @return false if nothing has been pasted
+ */
+bool paste_read() {
+  wchar_t input, *new;
+  int type, size;
+
+  Paste.length = 0;
+  timeout(PASTE_TIMEOUT);
+  while (true) {
+    type = get_wch((wint_t *)&input);
+    if (type == ERR)
+      break;
+    if (type == KEY_CODE_YES) {
+      if (input == KEY_PASTE_END)
+        break;
+      if (input != KEY_ENTER)
+        continue;
+      input = L'\n';
+    }
+    if (input == L'\r')
+      input = L'\n';
+    else if (input == L'\t')
+      input = Mode == EDIT ? L' ' : L'\t';
+    else if ((input != L'\n') && !iswprint(input))
+      continue;
+
+    if (Paste.length + 2 > Paste.size) {
+      size = Paste.size ? Paste.size * 2 : LINE_MAX_LEN;
+      if (!(new = realloc(Paste.text, size * sizeof(wchar_t))))
+        break;
+      Paste.text = new;
+      Paste.size = size;
+    }
+    Paste.text[Paste.length++] = input;
+  }
+  timeout(-1);
+
+  while (Paste.length && (Paste.text[Paste.length - 1] == L'\n'))
+    Paste.length--;
+  if (Paste.length)
+    Paste.text[Paste.length] = L'\0';
+
+  return Paste.length > 0;
+}
+
+/** Handle pasted text
+ *
+ * A single line pasted in edit mode is inserted at the cursor in one
+ * go. Otherwise the text is parsed as a list and its entries are
+ * inserted after the current one.
+ */
+void paste_do() {
+  Result res;
+  Entry *c, *n, *last;
+
+  if ((Mode == EDIT) && !wcschr(Paste.text, L'\n')) {
+    edit_insert_text(Paste.text, Paste.length);
+    return;
+  }
+
+  res = paste_parse();
+  if (!res.success) {
+    dlg_error(res.msg);
+    return;
+  }
+
+  if (Mode == EDIT) {
+    Mode = BROWSE;
+    curs_set(false);
+  }
+  c = Current->entry;
+  n = c->next;
+  last = entry_splice(c, (Entry *)res.data);
+  res = vitree_update(Current, vitree_find(n), last);
+  if (!res.success) {
+    dlg_error(res.msg);
+    return;
+  }
+  update(ALL);
+}
+
+/** Parse pasted text into a list of entries
+ *
+ * Every non-empty line becomes an entry, with any leading `-`, `*` or
+ * `+` bullet removed. Nesting follows leading tabs, or leading spaces
+ * in units of the smallest indentation found.
+ */
+Result paste_parse() {
+  Result res;
+  struct Parser *p;
+  wchar_t *line, *end, *text;
+  char *buffer, *bigger;
+  size_t size, need, n, length;
+  int unit, spaces, level, last;
+
+  unit = 0;
+  for (line = Paste.text; line; line = end ? end + 1 : NULL) {
+    end = wcschr(line, L'\n');
+    for (spaces = 0; line[spaces] == L' '; spaces++);
+    if ((spaces > 0) && ((unit == 0) || (spaces < unit)))
+      unit = spaces;
   }
+
+  res = parser_new();
+  if (!res.success)
+    return res;
+  p = (struct Parser *)res.data;
+  buffer = NULL;
+  size = 0;
+  last = -1;
+  for (line = Paste.text; line; line = end ? end + 1 : NULL) {
+    if ((end = wcschr(line, L'\n')))
+      *end = L'\0';
+    for (level = 0; line[level] == L'\t'; level++);
+    text = line + level;
+    for (spaces = 0; text[spaces] == L' '; spaces++);
+    if (unit)
+      level += spaces / unit;
+    text += spaces;
+    if (((text[0] == L'-') || (text[0] == L'*') || (text[0] == L'+')) && (text[1] == L' '))
+      text += 2;
+    if (text[0] == L'\0')
+      continue;
+
+    if (level > last + 1)
+      level = last + 1;
+    last = level;
+    need = level + 3 + wcslen(text) * MB_CUR_MAX + 1;
+    if (size < need) {
+      if (!(bigger = realloc(buffer, need))) {
+        free(buffer);
+        parser_finish(p);
+        return result_new(false, NULL, L"Couldn't allocate paste buffer");
+      }
+      buffer = bigger;
+      size = need;
+    }
+    memset(buffer, '\t', level);
+    memcpy(buffer + level, "- ", 2);
+    n = level + 2;
+    if ((length = wcstombs(buffer + n, text, size - n)) == (size_t)-1) {
+      free(buffer);
+      parser_finish(p);
+      return result_new(false, NULL, L"Invalid character in pasted text");
+    }
+    n += length;
+    buffer[n++] = '\n';
+    parser_feed(p, buffer, n);
+  }
+  free(buffer);
+  res = parser_finish(p);
+
+  if (res.success && !res.data)
+    return result_new(false, NULL, L"Nothing to paste");
+  return res;
 }
 
 /** Add element open cache item
@@ -850,13 +2424,19 @@ void edit_remove(int offset) {
  * @param e Entry for which to add the cache element
  */
 Result elmopen_new(Entry *e) {
+  Result res;
   ElmOpen *new;
 
-  new = malloc(sizeof(ElmOpen));
+  res = entrymap_room(&ElmOpenMap);
+  if (!res.success)
+    return res;
+  new = pool_get(&ElmOpenPool);
   if (!new)
     return result_new(false, NULL, L"Couldn't allocate ElmOpen");
+  entrymap_put(&ElmOpenMap, e, new);
   new->is = false;
   new->entry = e;
+  new->element = NULL;
   new->next = NULL;
   new->prev = ElmOpenLast;
   if (new->prev)
@@ -884,7 +2464,10 @@ void elmopen_set(bool to, Entry *s, Entry *e) {
   act = s ? false : true;
   t = ElmOpenRoot;
   do {
+    ui_steps++;
     if (e && (t->entry == e)) break;
+    if (act && to && t->entry->lazy)
+      entry_expand(t->entry);
     if (act && (t->entry->child))
       t->is = to;
     else if (t->entry == s)
@@ -895,29 +2478,27 @@ void elmopen_set(bool to, Entry *s, Entry *e) {
 /** Find an element open cache item for an entry
  */
 Result elmopen_get(Entry *e) {
-  ElmOpen *t;
+  void **slot;
 
-  t = ElmOpenRoot;
-  while (t) {
-    if (t->entry == e) break;
-    t = t->next;
-  }
-
-  if (!t)
+  if (!(slot = entrymap_get(&ElmOpenMap, e)))
     return elmopen_new(e);
 
-  return result_new(true, t, L"Found ElemOpen in cache");
+  return result_new(true, *slot, L"Found ElemOpen in cache");
 }
 
 /** Remove an element open cache item for an entry
  */
 void elmopen_forget(Entry *e) {
-  ElmOpen *t;
+  void **slot;
 
-  t = ElmOpenRoot;
-  while ((t->entry != e) && (t = t->next));
-  if (!t)
-    return;
+  if ((slot = entrymap_get(&ElmOpenMap, e)))
+    elmopen_remove((ElmOpen *)*slot);
+}
+
+/** Unlink and release an element open cache item
+ */
+void elmopen_remove(ElmOpen *t) {
+  entrymap_del(&ElmOpenMap, t->entry);
   if (t->prev)
     t->prev->next = t->next;
   else
@@ -926,26 +2507,147 @@ void elmopen_forget(Entry *e) {
     t->next->prev = t->prev;
   else
     ElmOpenLast = t->prev;
-  free(t);
+  layout_free(&t->layout);
+  pool_put(&ElmOpenPool, t);
 }
 
 /** Clear element open cache
+ *
+ * All items go back to the pool in one go.
  */
 void elmopen_clear() {
-  ElmOpen *t, *n;
+  ElmOpen *t;
 
-  if (!ElmOpenRoot)
-    return;
+  for (t = ElmOpenRoot; t; t = t->next)
+    layout_free(&t->layout);
+  pool_reset(&ElmOpenPool);
+  ElmOpenRoot = ElmOpenLast = NULL;
+  entrymap_free(&ElmOpenMap);
+  bzero(&ElmOpenMap, sizeof(EntryMap));
+}
 
-  t = ElmOpenRoot;
-  while (true) {
-    n = t->next;
-    free(t);
-    if (!n) break;
-    t = n;
+/** Make a lookup table for up to count entries
+ */
+Result entrymap_new(EntryMap *m, int count) {
+  for (m->mask = 1; m->mask < count * 2; m->mask <<= 1);
+  m->keys = calloc(m->mask, sizeof(Entry *));
+  m->values = calloc(m->mask, sizeof(void *));
+  m->mask--;
+  m->count = 0;
+  if (!m->keys || !m->values) {
+    entrymap_free(m);
+    return result_new(false, NULL, L"Couldn't allocate EntryMap");
   }
 
-  ElmOpenRoot = ElmOpenLast = NULL;
+  return result_new(true, m, L"Allocated EntryMap");
+}
+
+/** Make room for one more entry in a lookup table
+ *
+ * The table doubles once it is half full, so that it can grow with the
+ * tree instead of being sized up front. A zeroed table is fine.
+ */
+Result entrymap_room(EntryMap *m) {
+  Result res;
+  EntryMap bigger;
+  int i;
+
+  if (m->keys && ((m->count + 1) * 2 <= m->mask + 1))
+    return result_new(true, m, L"EntryMap has room");
+  res = entrymap_new(&bigger, m->keys ? m->mask + 1 : 16);
+  if (!res.success)
+    return res;
+  if (m->keys) {
+    for (i = 0; i <= m->mask; i++)
+      if (m->keys[i])
+        entrymap_put(&bigger, m->keys[i], m->values[i]);
+    entrymap_free(m);
+  }
+  *m = bigger;
+
+  return result_new(true, m, L"Grown EntryMap");
+}
+
+/** Find the slot of an entry, or the free slot it would go to
+ */
+unsigned long entrymap_slot(EntryMap *m, Entry *e) {
+  unsigned long i;
+
+  i = ((unsigned long)e >> 4) * 2654435761UL;
+  while (m->keys[i & m->mask] && (m->keys[i & m->mask] != e)) {
+    ui_steps++;
+    i++;
+  }
+
+  return i & m->mask;
+}
+
+/** Add an entry to a lookup table
+ */
+void entrymap_put(EntryMap *m, Entry *e, void *value) {
+  unsigned long i;
+
+  i = entrymap_slot(m, e);
+  if (!m->keys[i])
+    m->count++;
+  m->keys[i] = e;
+  m->values[i] = value;
+}
+
+/** Find an entry in a lookup table
+ *
+ * @return Pointer to the value, or NULL if there is no such entry
+ */
+void **entrymap_get(EntryMap *m, Entry *e) {
+  unsigned long i;
+
+  if (!m->keys)
+    return NULL;
+  i = entrymap_slot(m, e);
+
+  return m->keys[i] ? &m->values[i] : NULL;
+}
+
+/** Remove an entry from a lookup table
+ *
+ * Entries after it in the same run move back into the gap, so that
+ * lookups never stop short of them.
+ */
+void entrymap_del(EntryMap *m, Entry *e) {
+  unsigned long i, j, home;
+
+  if (!m->keys || !m->keys[i = entrymap_slot(m, e)])
+    return;
+  for (j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+    ui_steps++;
+    home = (((unsigned long)m->keys[j] >> 4) * 2654435761UL) & m->mask;
+    if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+      m->keys[i] = m->keys[j];
+      m->values[i] = m->values[j];
+      i = j;
+    }
+  }
+  m->keys[i] = NULL;
+  m->values[i] = NULL;
+  m->count--;
+}
+
+/** Free a lookup table
+ */
+void entrymap_free(EntryMap *m) {
+  free(m->keys);
+  free(m->values);
+}
+
+/** Next entry in a depth-first walk over a tree
+ */
+Entry *entry_walk(Entry *e) {
+  if (e->child)
+    return e->child;
+  while (!e->next && e->parent)
+    e = e->parent;
+
+  return e->next;
 }
 
 /** Backup given element, for simple undo
@@ -975,10 +2677,6 @@ Result undo_set(Entry *e) {
   } else
     Undo.other = NULL;
   Undo.crossed = e->crossed;
-  if (e == Root->entry)
-    Undo.root = true;
-  else
-    Undo.root = false;
   Undo.present = true;
 
   return result_new(true, NULL, L"Backed up entry");
@@ -997,12 +2695,20 @@ Result undo_restore() {
     if (!res.success)
       return res;
     n = (Entry *)res.data;
-  } else
+  } else {
     n = Root->entry;
+    res = entry_own(n);
+    if (!res.success)
+      return res;
+    entry_touch(n);
+  }
   wcscpy(n->text, Undo.text);
   n->length = wcslen(n->text);
+  if (!Undo.other)
+    layout_invalidate(&Root->open->layout);
   n->crossed = Undo.crossed;
-  if (Undo.root) {
+  // Other entries may have moved since, so where it went decides
+  if (Undo.other && !n->prev && !n->parent) {
     res = element_new(n);
     if (!res.success)
       return res;
@@ -1040,15 +2746,12 @@ Result vitree_rebuild(Element *s, Element *e) {
     last = e->entry;
 
   while (run) {
+    ui_steps++;
     s->level = level;
     s->lx = level * BULLET_WIDTH;
-    s->width = scr_width - (level + 1) * BULLET_WIDTH;
-    s->lines = s->entry->length / s->width;
-    if (s->entry->length % s->width > 0)
-      s->lines++;
-    if (s->lines < 1)
-      s->lines++;
 
+    if (s->open->is && s->entry->lazy)
+      entry_expand(s->entry);
     if (s->open->is && !s->entry->child)
       s->open->is = false;
 
@@ -1093,36 +2796,231 @@ Result vitree_rebuild(Element *s, Element *e) {
   return result_new(true, s, L"Cache rebuilt");
 }
 
+/** Bring the visual tree in line with changed entries
+ *
+ * Elements of entries that are still visible, in the same order, are
+ * kept along with their layouts. Only elements around the changes are
+ * freed or made. If Current is gone, the first new element that took
+ * its place becomes current, or the next element if there is none.
+ *
+ * @param first First top level entry
+ */
+Result vitree_sync(Entry *first) {
+  Result res;
+  EntryMap map;
+  Element *e, *f, *n, *last, *made;
+  Entry *en;
+  void **slot;
+  bool lost;
+  int count, level;
+
+  count = 0;
+  for (e = Root; e; e = e->next)
+    count++;
+  res = entrymap_new(&map, count);
+  if (!res.success)
+    return res;
+  for (e = Root; e; e = e->next)
+    entrymap_put(&map, e->entry, e);
+
+  e = Root;
+  last = made = NULL;
+  lost = false;
+  level = 0;
+  en = first;
+  while (en) {
+    ui_steps++;
+    slot = entrymap_get(&map, en);
+    if (slot && *slot) {
+      f = (Element *)*slot;
+      *slot = NULL;
+      while (e != f) {
+        n = e->next;
+        vitree_drop(&map, e, &lost);
+        e = n;
+      }
+      if (lost)
+        Current = made ? made : f;
+      lost = false;
+      made = NULL;
+      e = f->next;
+    } else {
+      res = element_new(en);
+      if (!res.success)
+        break;
+      f = (Element *)res.data;
+      if (!made)
+        made = f;
+    }
+
+    f->prev = last;
+    if (last)
+      last->next = f;
+    last = f;
+    f->next = e;
+
+    f->level = level;
+    f->lx = level * BULLET_WIDTH;
+    if (f->open->is && en->lazy)
+      entry_expand(en);
+    if (f->open->is && !en->child)
+      f->open->is = false;
+
+    if (f->open->is) {
+      en = en->child;
+      level++;
+    } else {
+      while (en && !en->next) {
+        en = en->parent;
+        level--;
+      }
+      if (en)
+        en = en->next;
+    }
+  }
+
+  while (e) {
+    n = e->next;
+    vitree_drop(&map, e, &lost);
+    e = n;
+  }
+  entrymap_free(&map);
+
+  if (!res.success)
+    return res;
+
+  last->next = NULL;
+  for (Root = last; Root->prev; Root = Root->prev);
+  if (lost)
+    Current = made ? made : last;
+
+  return result_new(true, Root, L"Visual tree synced");
+}
+
+/** Free an element that is no longer in the visual tree
+ */
+void vitree_drop(EntryMap *map, Element *e, bool *lost) {
+  void **slot;
+
+  if ((slot = entrymap_get(map, e->entry)) && (*slot == e))
+    *slot = NULL;
+  if (e == Current)
+    *lost = true;
+  element_free(e);
+}
+
 /** Find a visual tree element for an entry
  *
  * As the visual tree is being rebuild on changes the pointer
  * you may currently hold is probably invalid.
  *
- * @param e Start element
+ * Every entry has at most one element and its cache item points to it,
+ * so the lookup takes the same time wherever the element is.
+ *
  * @param en Entry to find an element for
- * @param dir Direction of search relative to e
- * @return Will return NULL if not found
+ * @return Will return NULL if the entry isn't visible
  */
-Element *vitree_find(Element *e, Entry *en, search_t dir) {
-  if (!en)
+Element *vitree_find(Entry *en) {
+  void **slot;
+
+  if (!en || !(slot = entrymap_get(&ElmOpenMap, en)))
     return NULL;
 
-  switch (dir) {
-    case BACKWARD:
-      do {
-        if (e->entry == en)
-          return e;
-      } while ((e = e->prev));
-      break;
-    case FORWARD:
-      do {
-        if (e->entry == en)
-          return e;
-      } while ((e = e->next));
-      break;
+  return ((ElmOpen *)*slot)->element;
+}
+
+/** Make the element of an entry current
+ *
+ * If the entry has no element an earlier change lost track of it, so
+ * the whole visual tree is brought in line first.
+ */
+void vitree_focus(Entry *en) {
+  Result res;
+  Element *f;
+
+  if ((f = vitree_find(en))) {
+    Current = f;
+    return;
   }
+  res = vitree_reset(en);
+  if (!res.success)
+    dlg_error(res.msg);
+}
 
-  return NULL;
+/** Rebuild the visual tree after a change and make an entry current
+ *
+ * @param s Start element, untouched by the change, or NULL if it
+ * couldn't be found, to bring the whole visual tree in line instead
+ * @param e End element
+ * @param en Entry to make current
+ */
+Result vitree_update(Element *s, Element *e, Entry *en) {
+  Result res;
+
+  if (!s)
+    return vitree_reset(en);
+  res = vitree_rebuild(s, e);
+  if (res.success)
+    vitree_focus(en);
+
+  return res;
+}
+
+/** Bring the whole visual tree in line with the entries
+ *
+ * Slower than rebuilding around a change, but it only relies on
+ * elements still linked from Root.
+ *
+ * @param en Entry to make current, if it is visible
+ */
+Result vitree_reset(Entry *en) {
+  Result res;
+  Element *f;
+  Entry *first;
+
+  for (first = en; first->parent; first = first->parent);
+  while (first->prev)
+    first = first->prev;
+  Current = Root;
+  res = vitree_sync(first);
+  if (res.success && (f = vitree_find(en)))
+    Current = f;
+
+  return res;
+}
+
+/** Make an element for a newly inserted entry, if it is visible
+ *
+ * Unlike vitree_update() only the new element is made, in between the
+ * elements around it, and Current stays where it was. The entry must
+ * not have children yet.
+ *
+ * @param en Inserted entry
+ */
+Result vitree_insert(Entry *en) {
+  Element *s, *e;
+  Entry *p, *nx;
+  void **slot;
+
+  for (p = en->parent; p; p = p->parent)
+    if (!(slot = entrymap_get(&ElmOpenMap, p)) || !((ElmOpen *)*slot)->is)
+      return result_new(true, NULL, L"Entry is hidden");
+
+  // Last visible entry before it, deepest first
+  p = en->prev ? en->prev : en->parent;
+  while ((s = vitree_find(p)) && (p != en->parent) && s->open->is && p->child)
+    for (p = p->child; p->next; p = p->next);
+  for (nx = en; !nx->next && nx->parent; nx = nx->parent);
+  e = nx->next ? vitree_find(nx->next) : NULL;
+
+  if (!s || (s->next != e) || (nx->next && !e)) {
+    for (p = en; p->parent; p = p->parent);
+    while (p->prev)
+      p = p->prev;
+    return vitree_sync(p);
+  }
+
+  return vitree_rebuild(s, e);
 }
 
 /** Remove visual tree elements
@@ -1139,8 +3037,9 @@ void vitree_clear(Element *s, Element *e) {
     return;
 
   while (true) {
+    ui_steps++;
     n = s->next;
-    free(s);
+    element_free(s);
 
     if (!n) break;
     if (e && (n == e)) break;
@@ -1163,7 +3062,7 @@ bool browse_do(int type, wchar_t input) {
     case OK:
       switch (input) {
         case KEY_OPEN_F:
-          if (dlg_bool(DLG_OPEN, DLG_MSG_SURE, COLOR_WARN)) {
+          if (!file_dirty() || dlg_bool(DLG_OPEN, DLG_MSG_SURE, COLOR_WARN)) {
             if ((path = dlg_open()) != NULL)
               file_load(path);
           }
@@ -1171,13 +3070,15 @@ bool browse_do(int type, wchar_t input) {
         case KEY_RELOAD_F:
           if (UI_File.loaded) {
             if (dlg_reload())
-              file_load(UI_File.path);
+              file_reload();
           } else
             dlg_error(DLG_ERR_RELOAD);
           break;
         case KEY_SAVE_F:
           if (UI_File.loaded) {
-            if (dlg_save())
+            if (!file_dirty())
+              status_show(STATUS_CLEAN);
+            else if (disk_changed(NULL) ? dlg_file(DLG_SAVE, DLG_MSG_CLOBBER) : dlg_save())
               file_save(UI_File.path);
           } else
             dlg_error(DLG_ERR_SAVE);
@@ -1188,17 +3089,22 @@ bool browse_do(int type, wchar_t input) {
               file_save(path);
           }
           break;
+        case KEY_EXPORT_F:
+          if ((path = dlg_export()) != NULL) {
+            file_export(path);
+            free(path);
+          }
+          break;
         case KEY_INSERT_E:
           res = entry_insert(c, AFTER, scr_width);
           if (res.success) {
             o = (Entry *)res.data;
             o->length = 0;
-            r = vitree_rebuild(Current, vitree_find(Current, c->next, FORWARD));
+            r = vitree_update(Current, vitree_find(o->next), o);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Current, o, FORWARD);
             update(ALL);
           } else {
             dlg_error(res.msg);
@@ -1210,18 +3116,19 @@ bool browse_do(int type, wchar_t input) {
           curs_set(true);
           cursor_update();
           cursor_end();
-          wrefresh(scr_main);
           break;
         case KEY_QUIT:
-          if (dlg_bool(DLG_QUIT, DLG_MSG_QUIT, COLOR_WARN))
+          if (!file_dirty() || dlg_bool(DLG_QUIT, DLG_MSG_QUIT, COLOR_WARN))
             return false;
           break;
         case KEY_CROSS_E:
           Current->entry->crossed = !Current->entry->crossed;
+          entry_touch(Current->entry);
           update(CURRENT);
           break;
         case KEY_BOLD_E:
           Current->entry->bold = !Current->entry->bold;
+          entry_touch(Current->entry);
           update(CURRENT);
           break;
         case KEY_UNDO_E:
@@ -1230,13 +3137,11 @@ bool browse_do(int type, wchar_t input) {
             if (!res.success)
               dlg_error(res.msg);
             else {
-              o = (Entry *)res.data;
-              res = vitree_rebuild(Root, NULL);
+              res = vitree_update(Root, NULL, (Entry *)res.data);
               if (!res.success) {
                 dlg_error(res.msg);
                 break;
               }
-              Current = vitree_find(Root, o, FORWARD);
               update(ALL);
             }
           }
@@ -1251,16 +3156,15 @@ bool browse_do(int type, wchar_t input) {
             if (Current == Root) {
               new = Current->next;
               new->prev = NULL;
-              free(Root);
+              element_free(Root);
               Root = Current = new;
             } else
               new = Current->prev;
-            r = vitree_rebuild(new, Current->next);
+            r = vitree_update(new, Current->next, (Entry *)res.data);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Root, (Entry *)res.data, FORWARD);
             if (Current->next == Current)
               Root->next = Root->prev = NULL;
             update(ALL);
@@ -1276,14 +3180,14 @@ bool browse_do(int type, wchar_t input) {
               o = c->next;
             else if (c->parent)
               o = c->parent->next;
-            r = vitree_rebuild(Current, vitree_find(Current, o, FORWARD));
+            r = vitree_rebuild(Current, vitree_find(o));
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
             new = Current;
           } else if (c->parent)
-            new = vitree_find(Current, c->parent, BACKWARD);
+            new = vitree_find(c->parent);
           if (new) {
             Current = new;
             update(ALL);
@@ -1298,9 +3202,9 @@ bool browse_do(int type, wchar_t input) {
             update(CURRENT);
           } else {
             if (c->next)
-              new = vitree_find(Current, c->next, FORWARD);
+              new = vitree_find(c->next);
             else if (c->parent && c->parent->next)
-              new = vitree_find(Current, c->parent->next, FORWARD);
+              new = vitree_find(c->parent->next);
             if (new) {
               Current = new;
               update(ALL);
@@ -1316,9 +3220,9 @@ bool browse_do(int type, wchar_t input) {
             update(CURRENT);
           } else {
             if (c->prev)
-              new = vitree_find(Current, c->prev, BACKWARD);
+              new = vitree_find(c->prev);
             else if (c->parent)
-              new = vitree_find(Current, c->parent, BACKWARD);
+              new = vitree_find(c->parent);
             if (new) {
               Current = new;
               update(ALL);
@@ -1328,7 +3232,12 @@ bool browse_do(int type, wchar_t input) {
         case KEY_RIGHT_E:
           if (Current->open->is)
             new = Current->next;
-          else if (c->child) {
+          else if (c->child || c->lazy) {
+            r = entry_expand(c);
+            if (!r.success) {
+              dlg_error(r.msg);
+              break;
+            }
             Current->open->is = true;
             r = vitree_rebuild(Current, Current->next);
             if (!r.success) {
@@ -1343,60 +3252,66 @@ bool browse_do(int type, wchar_t input) {
           }
           break;
         case KEY_DEDENT_E:
-          if (c->parent)
+          if (c->parent) {
+            new = vitree_find(c->parent);
             o = c->parent->next;
+          }
           if (o)
             o = o->next;
           if (entry_indent(c, LEFT)) {
-            r = vitree_rebuild(Root, vitree_find(Root, o, FORWARD));
+            r = vitree_update(new, vitree_find(o), c);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Root, c, FORWARD);
             update(ALL);
           }
           break;
         case KEY_MOVEUP_E:
           o = c->next;
           if (entry_move(c, DOWN)) {
-            if (Current == Root) {
-              new = Root;
-              Root = vitree_find(Root, o, FORWARD);
+            if (Current != Root)
+              new = Current->prev;
+            else if ((new = vitree_find(o))) {
+              vitree_clear(Root, new);
+              Root = new;
               Root->prev = NULL;
-              free(new);
             }
-            if (c->parent && c->parent->next)
+            if (c->next)
+              o = c->next;
+            else if (c->parent)
               o = c->parent->next;
             else
-              o = c->next;
-            r = vitree_rebuild(Root, vitree_find(Current, o, FORWARD));
+              o = NULL;
+            r = vitree_update(new, vitree_find(o), c);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Root, c, FORWARD);
             update(ALL);
           }
           break;
         case KEY_MOVEDOWN_E:
           o = c->prev;
           if (entry_move(c, UP)) {
-            if (o && (o == Root->entry)) {
-              free(Root);
-              Root = Current;
+            if (o == Root->entry) {
+              vitree_clear(Root, Current);
+              Root = new = Current;
               Root->prev = NULL;
-            }
-            if (c->parent && c->parent->next)
+            } else if ((new = vitree_find(o)))
+              new = new->prev;
+            // What followed Current before the move now follows o
+            if (o->next)
+              o = o->next;
+            else if (c->parent)
               o = c->parent->next;
             else
-              o = c->next;
-            r = vitree_rebuild(Root, vitree_find(Current, o, FORWARD));
+              o = NULL;
+            r = vitree_update(new, vitree_find(o), c);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Root, c, FORWARD);
             update(ALL);
           }
           break;
@@ -1407,14 +3322,17 @@ bool browse_do(int type, wchar_t input) {
           else
             oo = c->next;
           if (entry_indent(c, RIGHT)) {
-            new = vitree_find(Root, o, FORWARD);
-            new->open->is = true;
-            r = vitree_rebuild(new, vitree_find(Root, oo, FORWARD));
+            res = elmopen_get(o);
+            if (!res.success) {
+              dlg_error(res.msg);
+              break;
+            }
+            ((ElmOpen *)res.data)->is = true;
+            r = vitree_update(vitree_find(o), vitree_find(oo), c);
             if (!r.success) {
               dlg_error(r.msg);
               break;
             }
-            Current = vitree_find(Root, c, FORWARD);
             update(ALL);
           }
           break;
@@ -1436,23 +3354,21 @@ bool browse_do(int type, wchar_t input) {
             new = new->prev;
           o = new->entry;
           elmopen_set(false, NULL, NULL);
-          r = vitree_rebuild(Root, NULL);
+          r = vitree_update(Root, NULL, o);
           if (!r.success) {
             dlg_error(r.msg);
             break;
           }
-          Current = vitree_find(Root, o, FORWARD);
           update(ALL);
           break;
         case KEY_EXPAND:
           o = Current->entry;
           elmopen_set(true, NULL, NULL);
-          r = vitree_rebuild(Root, NULL);
+          r = vitree_update(Root, NULL, o);
           if (!r.success) {
             dlg_error(r.msg);
             break;
           }
-          Current = vitree_find(Root, o, FORWARD);
           update(ALL);
           break;
         case KEY_TOP:
@@ -1461,19 +3377,17 @@ bool browse_do(int type, wchar_t input) {
           break;
         case KEY_BOTTOM:
           o = Root->entry;
-          while (o->next)
+          while (o->next) {
+            ui_steps++;
             o = o->next;
-          Current = vitree_find(Current, o, FORWARD);
+          }
+          vitree_focus(o);
           update(ALL);
           break;
       }
       break;
     case KEY_CODE_YES:
       switch (input) {
-        case KEY_RESIZE:
-          ui_stop();
-          ui_start();
-          break;
         case KEY_F(1):
           dlg_info_file();
           break;
@@ -1500,11 +3414,9 @@ bool edit_do(int type, wchar_t input) {
           break;
         case 2: // Ctrl-B
           cursor_move(C_LEFT);
-          wrefresh(scr_main);
           break;
         case 6: // Ctrl-F
           cursor_move(C_RIGHT);
-          wrefresh(scr_main);
           break;
         case 127: // Ctrl-H, Backspace
         case 8:
@@ -1520,27 +3432,21 @@ bool edit_do(int type, wchar_t input) {
       switch (input) {
         case KEY_HOME:
           cursor_home();
-          wrefresh(scr_main);
           break;
         case KEY_END:
           cursor_end();
-          wrefresh(scr_main);
           break;
         case KEY_UP:
           cursor_move(C_UP);
-          wrefresh(scr_main);
           break;
         case KEY_DOWN:
           cursor_move(C_DOWN);
-          wrefresh(scr_main);
           break;
         case KEY_LEFT:
           cursor_move(C_LEFT);
-          wrefresh(scr_main);
           break;
         case KEY_RIGHT:
           cursor_move(C_RIGHT);
-          wrefresh(scr_main);
           break;
         case 263: // Yeah, that's probably not the best way...
         case 127: // Ctrl-H, Backspace
@@ -1566,155 +3472,281 @@ Result element_new(Entry *e) {
   Result res;
   Element *new;
 
-  new = malloc(sizeof(Element));
-  if (!new)
-    return result_new(false, NULL, L"Couldn't allocate Element");
   res = elmopen_get(e);
-  if (!res.success) {
-    free(new);
+  if (!res.success)
     return res;
-  }
-  bzero(new, sizeof(Element));
+  new = pool_get(&ElementPool);
+  if (!new)
+    return result_new(false, NULL, L"Couldn't allocate Element");
   new->entry = e;
   new->open = (ElmOpen *)res.data;
+  new->open->element = new;
 
   return result_new(true, new, L"Allocated new Element");
 }
 
-/** Draw a single element
+/** Release an element back to the pool
+ */
+void element_free(Element *e) {
+  if (e->open && (e->open->element == e))
+    e->open->element = NULL;
+  pool_put(&ElementPool, e);
+}
+
+/** Update element width and lines from the entry layout
+ *
+ * This is done lazily, only for elements that are about to be drawn
+ * or edited, and is cheap if the cached layout is still valid.
+ */
+void element_layout(Element *e) {
+  e->width = scr_width - (e->level + 1) * BULLET_WIDTH;
+  if (e->width < 1)
+    e->width = 1;
+  layout_update(&e->open->layout, e->entry, e->width);
+  e->lines = e->open->layout.lines;
+}
+
+/** Put an element on frame rows starting at y
+ *
+ * This also updates the element's screen position.
+ *
+ * @return Row just after the element
  */
-void element_draw(Element *e) {
+int frame_element(Row *rows, Element *e, int y) {
   Entry *en;
-  wchar_t *bullet;
-  int x, y, p;
-  int offset;
+  Row *r;
+  int l;
 
   en = e->entry;
-  getyx(scr_main, y, x);
   e->ly = y;
-
-  wattron(scr_main, A_BOLD);
-  if (e == Current) {
-    wattron(scr_main, COLOR_PAIR(COLOR_CURRENT));
-    if (Mode == EDIT)
-      wattron(scr_main, A_REVERSE);
-  }
+  element_layout(e);
+  l = ((e == Current) && Partial.is) ? Partial.offset : 0;
+  for (; (l < e->lines) && (y < LINES); l++, y++)
+    row_set(&rows[y], e, l);
+
+  if (e->ly >= LINES)
+    return y;
+  r = &rows[e->ly];
   if ((e == Current) && Partial.is)
-    bullet = BULLET_PARTIAL;
+    r->bullet = B_PARTIAL;
   else if (e->open->is)
-    bullet = BULLET_OPENED;
-  else {
-    if (en->child)
-      bullet = BULLET_CLOSED;
-    else {
-      if (en->crossed)
-        bullet = BULLET_CROSSED;
-      else
-        bullet = BULLET_SINGLE;
-    }
-  }
-  mvwaddwstr(scr_main, e->ly, e->lx, bullet);
+    r->bullet = B_OPENED;
+  else if (en->child || en->lazy)
+    r->bullet = B_CLOSED;
+  else if (en->crossed)
+    r->bullet = B_CROSSED;
+  else
+    r->bullet = B_SINGLE;
   if (Partial.is && (e->ly + 1 < LINES)) {
     if (Partial.more && Partial.less)
-      bullet = BULLET_ML;
+      r[1].bullet = B_ML;
     else if (Partial.more)
-      bullet = BULLET_MORE;
+      r[1].bullet = B_MORE;
     else
-      bullet = BULLET_LESS;
-    mvwaddwstr(scr_main, e->ly + 1, e->lx, bullet);
+      r[1].bullet = B_LESS;
+  }
+  if ((l < e->lines) && !Partial.is)
+    rows[LINES - 1].attrs |= ROW_MORE;
+
+  return y;
+}
+
+/** Make sure frame buffers match the screen height
+ *
+ * Also forgets what was drawn, so the next flush draws every row.
+ */
+void frame_resize() {
+  Row *rows, *next;
+
+  if (Frame.size != LINES) {
+    rows = realloc(Frame.rows, LINES * sizeof(Row));
+    next = realloc(Frame.next, LINES * sizeof(Row));
+    if (!(rows && next)) {
+      endwin();
+      fwprintf(stderr, L"Can't allocate frame buffers\n");
+      exit(1);
+    }
+    Frame.rows = rows;
+    Frame.next = next;
+    Frame.size = LINES;
+  }
+  bzero(Frame.rows, Frame.size * sizeof(Row));
+  bzero(Frame.next, Frame.size * sizeof(Row));
+}
+
+/** Draw rows that differ from what is on the screen
+ *
+ * If the current element has only moved up or down the window is
+ * scrolled first, so that the terminal can shift lines instead of
+ * repainting them.
+ */
+void frame_flush() {
+  Row *rows, *next;
+  int y, old, shift;
+
+  rows = Frame.rows;
+  next = Frame.next;
+
+  shift = 0;
+  if ((Current->ly < LINES) && next[Current->ly].elm) {
+    for (old = 0; old < LINES; old++)
+      if ((rows[old].version == next[Current->ly].version) &&
+          (rows[old].line == next[Current->ly].line)) {
+        shift = old - Current->ly;
+        break;
+      }
+  }
+  if (shift) {
+    scrollok(scr_main, true);
+    wscrl(scr_main, shift);
+    scrollok(scr_main, false);
+    if (shift > 0) {
+      memmove(rows, rows + shift, (LINES - shift) * sizeof(Row));
+      bzero(rows + LINES - shift, shift * sizeof(Row));
+    } else {
+      memmove(rows - shift, rows, (LINES + shift) * sizeof(Row));
+      bzero(rows, -shift * sizeof(Row));
+    }
   }
+
+  for (y = 0; y < LINES; y++) {
+    if (row_same(&rows[y], &next[y]))
+      continue;
+    rows[y] = next[y];
+    row_draw(y, &rows[y]);
+  }
+}
+
+/** Describe a row showing given line of an element
+ */
+void row_set(Row *r, Element *e, int line) {
+  r->elm = e;
+  r->version = e->open->layout.version;
+  r->line = line;
+  r->lx = e->lx;
+  r->bullet = B_NONE;
+  r->attrs = 0;
   if (e == Current) {
-    wattroff(scr_main, COLOR_PAIR(COLOR_CURRENT));
+    r->attrs |= ROW_CURRENT;
     if (Mode == EDIT)
-      wattroff(scr_main, A_REVERSE);
+      r->attrs |= ROW_EDIT;
   }
-  wattroff(scr_main, A_BOLD);
+  if (e->entry->crossed)
+    r->attrs |= ROW_CROSSED;
+  if (e->entry->bold)
+    r->attrs |= ROW_BOLD;
+}
+
+/** Draw a single row
+ */
+void row_draw(int y, Row *r) {
+  Entry *en;
+  int *breaks;
+
+  wmove(scr_main, y, 0);
+  wclrtoeol(scr_main);
+  if (!r->elm)
+    return;
+  en = r->elm->entry;
 
-  x = e->lx + BULLET_WIDTH;
+  if (r->bullet != B_NONE) {
+    wattron(scr_main, A_BOLD);
+    if (r->attrs & ROW_CURRENT)
+      wattron(scr_main, COLOR_PAIR(COLOR_CURRENT));
+    if (r->attrs & ROW_EDIT)
+      wattron(scr_main, A_REVERSE);
+    mvwaddwstr(scr_main, y, r->lx, Bullets[r->bullet]);
+    if (r->attrs & ROW_EDIT)
+      wattroff(scr_main, A_REVERSE);
+    if (r->attrs & ROW_CURRENT)
+      wattroff(scr_main, COLOR_PAIR(COLOR_CURRENT));
+    wattroff(scr_main, A_BOLD);
+  }
 
-  if (en->crossed)
+  if (r->attrs & ROW_CROSSED)
     wattron(scr_main, A_BOLD | COLOR_PAIR(COLOR_CROSSED));
-  if (en->bold)
+  if (r->attrs & ROW_BOLD)
     wattron(scr_main, BOLD_ATTRS);
-  if ((e == Current) && Partial.is) {
-    offset = Partial.offset * e->width;
-    p = 2 + Partial.offset;
-  } else {
-    offset = 0;
-    p = 2;
-  }
-  mvwaddnwstr(scr_main, y, x, en->text+offset, e->width);
-  for (; p <= e->lines; p++) {
-    y++;
-    if (y >= LINES) break;
-    mvwaddnwstr(scr_main, y, x, en->text+((p-1)*e->width), e->width);
-  }
-  if (en->bold)
+  breaks = r->elm->open->layout.breaks;
+  mvwaddnwstr(scr_main, y, r->lx + BULLET_WIDTH, en->text+breaks[r->line],
+              breaks[r->line+1] - breaks[r->line]);
+  if (r->attrs & ROW_BOLD)
     wattroff(scr_main, BOLD_ATTRS);
-  if (en->crossed)
+  if (r->attrs & ROW_CROSSED)
     wattroff(scr_main, A_BOLD | COLOR_PAIR(COLOR_CROSSED));
-  if (y >= LINES) {
-    if (!Partial.is)
-      mvwaddwstr(scr_main, LINES - 1, scr_width - 1, TEXT_MORE);
-  } else
-    waddwstr(scr_main, L"\n");
+
+  if (r->attrs & ROW_LESS)
+    mvwaddwstr(scr_main, y, r->lx + (BULLET_WIDTH / 2), TEXT_MORE);
+  if (r->attrs & ROW_MORE)
+    mvwaddwstr(scr_main, y, scr_width - 1, TEXT_MORE);
 }
 
-/** Update screen
+/** Check if two rows would look the same
+ */
+bool row_same(Row *a, Row *b) {
+  if (!(a->elm && b->elm))
+    return a->elm == b->elm;
+
+  return (a->version == b->version) && (a->line == b->line) && (a->lx == b->lx) &&
+         (a->bullet == b->bullet) && (a->attrs == b->attrs);
+}
+
+/** Draw screen
  *
  * This works in either single item update or whole screen update,
- * unless the current item doesn't fit on the screen.
+ * unless the current item doesn't fit on the screen. Either way only
+ * the rows that have changed get drawn, and the result is only queued
+ * for output with wnoutrefresh().
  */
-void update(update_t mode) {
+void draw(update_t mode) {
   Element *e, *p;
+  Row *next;
   int y, yy;
 
   if (!Current)
     return;
 
+  next = Frame.next;
+  element_layout(Current);
   if (Current->lines > LINES) {
     if (!Partial.is) {
       Partial.is = true;
-      Partial.less = false;
-      Partial.more = true;
       Partial.offset = 0;
-      Partial.limit = Current->lines - LINES;
     }
-
-    if (mode == ALL)
-      wclear(scr_main);
-    wmove(scr_main, 0, Current->lx);
-    element_draw(Current);
+    Partial.limit = Current->lines - LINES;
+    if (Partial.offset > Partial.limit)
+      Partial.offset = Partial.limit;
+    Partial.less = Partial.offset > 0;
+    Partial.more = Partial.offset < Partial.limit;
+
+    bzero(next, LINES * sizeof(Row));
+    frame_element(next, Current, 0);
   } else {
     Partial.is = false;
     y = (LINES / 2) - (Current->lines / 2);
 
     switch (mode) {
       case ALL:
-        wclear(scr_main);
+        bzero(next, LINES * sizeof(Row));
 
         e = Current;
         if (Current != Root) {
-          while (e->prev && (y - e->prev->lines >= 0)) {
+          while (e->prev) {
+            element_layout(e->prev);
+            if (y - e->prev->lines < 0) break;
             e = e->prev;
             y -= e->lines;
           }
           if ((y - 1 >= 0) && (e->prev)) {
-            yy = y - 1;
             p = e->prev;
-            while (yy >= 0) {
-              mvwaddnwstr(scr_main, yy, p->lx + BULLET_WIDTH,
-                          p->entry->text+((p->lines-(y-yy))*p->width), p->width);
-              yy--;
-            }
-            mvwaddwstr(scr_main, 0, p->lx + (BULLET_WIDTH / 2), TEXT_MORE);
+            for (yy = y - 1; yy >= 0; yy--)
+              row_set(&next[yy], p, p->lines - (y - yy));
+            next[0].attrs |= ROW_LESS;
           }
         }
 
-        wmove(scr_main, y, 0);
         while (y < LINES) {
-          element_draw(e);
-          y += e->lines;
+          y = frame_element(next, e, y);
 
           if (e->next)
             e = e->next;
@@ -1723,13 +3755,26 @@ void update(update_t mode) {
         }
         break;
       case CURRENT:
-        wmove(scr_main, Current->ly, Current->lx);
-        element_draw(Current);
+        memcpy(next, Frame.rows, LINES * sizeof(Row));
+        frame_element(next, Current, Current->ly);
         break;
+      case NONE:
+        return;
     }
   }
 
-  wrefresh(scr_main);
+  frame_flush();
+  wnoutrefresh(scr_main);
+}
+
+/** Mark screen for update
+ *
+ * Actual drawing is done by ui_render() once all pending input has
+ * been handled, so a burst of keys results in a single redraw.
+ */
+void update(update_t mode) {
+  if (mode > Damage)
+    Damage = mode;
 }
 
 /** Set root item for the UI
@@ -1738,11 +3783,14 @@ Result ui_set_root(Entry *e) {
   Result res;
 
   elmopen_clear();
+  free(Undo.text);
   Undo.text = NULL;
   Undo.size = 0;
+  Undo.present = false;
 
-  if (Root)
-    vitree_clear(Root, NULL);
+  // The whole visual tree goes, so skip walking it
+  pool_reset(&ElementPool);
+  Root = Current = NULL;
 
   res = element_new(e);
   if (!res.success)
@@ -1763,9 +3811,17 @@ Result ui_get_root() {
 }
 
 /** Start the UI
+ *
+ * The terminal is stdin and stdout, unless ui_term_out is set, which
+ * lets the UI run on other streams, even on /dev/null.
  */
 void ui_start() {
-  initscr();
+  if (!ui_term_out)
+    initscr();
+  else if (!newterm(NULL, ui_term_out, ui_term_in ? ui_term_in : stdin)) {
+    fwprintf(stderr, L"Can't start the terminal\n");
+    exit(1);
+  }
   start_color();
   BG_COLOR = COLOR_BLACK;
   if (use_term_colors && (use_default_colors() == OK))
@@ -1780,23 +3836,28 @@ void ui_start() {
   if (scr_main)
     delwin(scr_main);
 
-  if (ui_scr_width)
-    scr_width = COLS < ui_scr_width ? (COLS - 2) : ui_scr_width;
-  else
-    scr_width = COLS;
-  scr_x = ((COLS - scr_width) / 2) - 1;
-  scr_x = scr_x < 0 ? 0 : scr_x;
+  ui_size();
   if (!(scr_main = newwin(LINES, scr_width, 0, scr_x))) {
     endwin();
     fwprintf(stderr, L"Can't make a new main window\n");
     exit(1);
   }
-  dlg_min = scr_width - DLG_MIN_SPACE;
-  if (dlg_min < 0)
-    dlg_min = 0;
+
+  idlok(scr_main, true);
+  frame_resize();
+
+  if ((Wake[0] < 0) && (pipe(Wake) == 0)) {
+    fcntl(Wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(Wake[1], F_SETFL, O_NONBLOCK);
+  }
+
+  define_key("\033[200~", KEY_PASTE_START);
+  define_key("\033[201~", KEY_PASTE_END);
 
   clear();
   refresh();
+  fputs(PASTE_ON, ui_term_out ? ui_term_out : stdout);
+  fflush(ui_term_out ? ui_term_out : stdout);
 
   update(ALL);
 }
@@ -1804,6 +3865,8 @@ void ui_start() {
 /** Stop the UI
  */
 void ui_stop() {
+  fputs(PASTE_OFF, ui_term_out ? ui_term_out : stdout);
+  fflush(ui_term_out ? ui_term_out : stdout);
   delwin(scr_main);
   endwin();
 }
@@ -1814,33 +3877,272 @@ void ui_stop() {
  */
 void ui_refresh() {
   update(ALL);
+  ui_render();
+}
+
+/** Dispatch a single key based on mode
+ */
+bool ui_dispatch(int type, wchar_t input) {
+  if (scr_status && !Save.active)
+    status_hide();
+  if (type == KEY_CODE_YES) {
+    switch (input) {
+      case KEY_PASTE_START:
+        if (paste_read())
+          paste_do();
+        return true;
+      case KEY_RESIZE:
+        timer_set(TIMER_RESIZE, RESIZE_DELAY);
+        return true;
+    }
+  }
+
+  switch (Mode) {
+    case BROWSE:
+      return browse_do(type, input);
+    case EDIT:
+      return edit_do(type, input);
+  }
+
+  return true;
+}
+
+/** Draw whatever changed and flush it to the terminal
+ */
+void ui_render() {
+  if (timer_active(TIMER_RESIZE))
+    return;
+  if (Mode == EDIT) {
+    cursor_update();
+    cursor_recalc();
+  }
+  if (Damage != NONE) {
+    draw(Damage);
+    Damage = NONE;
+  }
+  status_refresh();
+  if (Mode == EDIT) {
+    cursor_fix();
+    wnoutrefresh(scr_main);
+  }
+  doupdate();
+}
+
+/** Compute main window size and position
+ */
+void ui_size() {
+  if (ui_scr_width)
+    scr_width = COLS < ui_scr_width ? (COLS - 2) : ui_scr_width;
+  else
+    scr_width = COLS;
+  scr_x = ((COLS - scr_width) / 2) - 1;
+  scr_x = scr_x < 0 ? 0 : scr_x;
+  dlg_min = scr_width - DLG_MIN_SPACE;
+  if (dlg_min < 0)
+    dlg_min = 0;
+}
+
+/** Adapt to the new terminal size
+ *
+ * Only the window is resized here. Elements pick up the new width
+ * when they are drawn next, so nothing off screen is laid out again.
+ */
+void ui_resize() {
+  ui_size();
+  wresize(scr_main, LINES, scr_width);
+  mvwin(scr_main, 0, scr_x);
+  frame_resize();
+  werase(scr_main);
+  erase();
+  wnoutrefresh(stdscr);
+  clearok(curscr, true);
+  update(ALL);
+  if (status_msg)
+    status_show(status_msg);
+}
+
+/** Wake up the main loop from another thread
+ */
+void ui_wake() {
+  char c = 0;
+
+  if (write(Wake[1], &c, 1) < 0) {
+    // The pipe is full, so the main loop will wake up anyway
+  }
+}
+
+/** Arm a timer to fire in ms milliseconds
+ */
+void timer_set(ui_timer_t id, int ms) {
+  struct timespec *at;
+
+  at = &Timers[id].at;
+  clock_gettime(CLOCK_MONOTONIC, at);
+  at->tv_sec += ms / 1000;
+  at->tv_nsec += (ms % 1000) * 1000000L;
+  if (at->tv_nsec >= 1000000000L) {
+    at->tv_sec++;
+    at->tv_nsec -= 1000000000L;
+  }
+  Timers[id].active = true;
+}
+
+/** Check if a timer is armed
+ */
+bool timer_active(ui_timer_t id) {
+  return Timers[id].active;
+}
+
+/** Milliseconds until the closest timer fires
+ *
+ * @return -1 if there are no timers armed
+ */
+int timer_next() {
+  struct timespec now;
+  long ms, next;
+  int i;
+
+  next = -1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < TIMER_COUNT; i++) {
+    if (!Timers[i].active)
+      continue;
+    ms = (Timers[i].at.tv_sec - now.tv_sec) * 1000 +
+         (Timers[i].at.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    ms = ms < 0 ? 0 : ms;
+    if ((next < 0) || (ms < next))
+      next = ms;
+  }
+
+  return next;
+}
+
+/** Run all timers that are due
+ */
+void timer_fire() {
+  struct timespec now;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < TIMER_COUNT; i++) {
+    if (!Timers[i].active)
+      continue;
+    if ((Timers[i].at.tv_sec > now.tv_sec) || ((Timers[i].at.tv_sec == now.tv_sec) &&
+        (Timers[i].at.tv_nsec > now.tv_nsec)))
+      continue;
+
+    Timers[i].active = false;
+    switch (i) {
+      case TIMER_RESIZE:
+        ui_resize();
+        break;
+      case TIMER_AUTOSAVE:
+        file_autosave();
+        break;
+      case TIMER_WATCH:
+        file_check();
+        break;
+    }
+  }
 }
 
 /** Main input loop
  *
- * Reads a key and dispatches based on mode.
+ * Sleeps until there is input, a background job is finished or
+ * a timer is due. All pending input is handled before the screen
+ * is rendered.
+ *
+ * A resize only arms a timer and rendering waits for it, so that
+ * a burst of resize events is handled as one.
  */
 void ui_mainloop() {
+  struct pollfd fds[4 + CONTROL_CLIENTS];
+  Result res;
+  unsigned long changes;
+  Client *c;
+  char buf[64];
   bool run;
-  int type;
+  int type, keys, i;
   wchar_t input;
 
+  fds[0].fd = STDIN_FILENO;
+  fds[0].events = POLLIN;
+  fds[1].fd = Wake[0];
+  fds[1].events = POLLIN;
+  fds[2].events = POLLIN;
+  fds[3].events = POLLIN;
+
+  disk_read();
+  watch_update();
+  if (!control_open()) {
+    res = result_new(false, NULL, L"Can't listen on %s: %s", ui_socket, strerror(errno));
+    dlg_error(res.msg);
+  }
+
   run = true;
   while (run) {
-    type = get_wch((wint_t *)&input);
-    if (type == ERR)
-      dlg_error(L"Error reading keyboard?");
-    else {
-      switch (Mode) {
-        case BROWSE:
-          run = browse_do(type, input);
-          break;
-        case EDIT:
-          run = edit_do(type, input);
-          break;
+    fds[2].fd = Watch.fd;
+    fds[3].fd = Control.fd;
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+      c = &Control.clients[i];
+      fds[4 + i].fd = c->fd;
+      fds[4 + i].events = (c->held ? 0 : POLLIN) | (c->out_len ? POLLOUT : 0);
+    }
+    if (poll(fds, 4 + CONTROL_CLIENTS, timer_next()) < 0) {
+      for (i = 0; i < 4 + CONTROL_CLIENTS; i++)
+        fds[i].revents = 0;
+      if (errno != EINTR) {
+        dlg_error(L"Error reading keyboard?");
+        continue;
+      }
+    }
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+      break;
+
+    keys = 0;
+    do {
+      timeout(0);
+      type = get_wch((wint_t *)&input);
+      timeout(-1);
+      if (type != ERR) {
+        run = ui_dispatch(type, input);
+        keys++;
       }
+    } while (run && (type != ERR));
+    if (keys && ui_autosave && file_dirty())
+      timer_set(TIMER_AUTOSAVE, ui_autosave * 1000);
+
+    if (fds[1].revents & POLLIN)
+      while (read(Wake[0], buf, sizeof(buf)) > 0);
+    // Before clients, which may wait for the save
+    save_poll();
+    if (fds[2].revents & POLLIN)
+      watch_read();
+    if (fds[3].revents & POLLIN)
+      control_accept();
+    changes = data_changes();
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+      c = &Control.clients[i];
+      if ((c->fd >= 0) && (fds[4 + i].revents & POLLOUT))
+        control_write(c);
+      if ((c->fd >= 0) && c->held)
+        control_run(c);
+      if ((c->fd >= 0) && (fds[4 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+        control_read(c);
     }
+    if ((changes != data_changes()) && ui_autosave && file_dirty())
+      timer_set(TIMER_AUTOSAVE, ui_autosave * 1000);
+    timer_fire();
+
+    if (run)
+      ui_render();
   }
+  save_wait();
+  control_close();
+  if (Watch.fd >= 0)
+    close(Watch.fd);
+  free(Watch.path);
   if (Undo.text)
     free(Undo.text);
+  free(Paste.text);
 }
@@ -6,15 +6,25 @@
 struct UI_File {
   bool loaded;
   char *path;
+  unsigned long saved;
 } UI_File;
 
 int ui_scr_width;
+int ui_autosave;
+int ui_lazy;
+int ui_compress;
+char *ui_socket;
+FILE *ui_term_in;
+FILE *ui_term_out;
+unsigned long ui_steps;
 
 Result ui_set_root(Entry *e);
 Result ui_get_root();
 void ui_start();
 void ui_stop();
 void ui_refresh();
+bool ui_dispatch(int type, wchar_t input);
+void ui_render();
 void ui_mainloop();
 
 #endif
@@ -7,15 +7,27 @@
 
 // snb.c
 //#define DEFAULT_FILE    "/path/to/the/file.md"
+#define ENTRY_PATH_SEP  " > "
 
 // data.c
 #define LINE_MAX_LEN    4096
 #define ERR_MAX_LEN     512
+#define SHARD_MANIFEST  "manifest"
+#define SHARD_SUFFIX    ".md"
+#define SHARD_THREADS   8
 
 // ui.c
 #define SCR_WIDTH       80
 #define FORCE_BLACK_BG  false
 #define BOLD_ATTRS      A_BOLD
+#define RESIZE_DELAY    50
+#define AUTOSAVE_IDLE   0
+#define LAZY_DEPTH      0
+#define LOAD_POLL       100
+#define WATCH_DELAY     200
+#define COMPRESS_LEVEL  6
+#define CONTROL_CLIENTS 4
+#define CONTROL_LINE_MAX 65536
 
 #define BULLET_WIDTH    3
 #define BULLET_CROSSED  L" · "
@@ -35,6 +47,7 @@
 #define KEY_RELOAD_F    L'r'
 #define KEY_SAVE_F      L's'
 #define KEY_SAVEAS_F    L'S'
+#define KEY_EXPORT_F    L'E'
 #define KEY_INSERT_E    L'i'
 #define KEY_EDIT_E      L'\n'
 #define KEY_QUIT        L'Q'
@@ -56,6 +69,7 @@
 #define KEY_EXPAND      L'e'
 #define KEY_TOP         L'g'
 #define KEY_BOTTOM      L'G'
+#define KEY_ABORT       L'\033'
 
 #define DLG_YESNO       L" y/n "
 #define DLG_INFO        L" INFO "
@@ -64,7 +78,19 @@
 #define DLG_OPEN        L" OPEN "
 #define DLG_SAVE        L" SAVE "
 #define DLG_SAVEAS      L" SAVE AS "
+#define DLG_EXPORT      L" EXPORT "
 #define DLG_QUIT        L" QUIT "
+#define DLG_LOAD        L" LOADING "
+#define DLG_CHANGED     L" CHANGED "
+
+#define STATUS_SAVING   L" saving… "
+#define STATUS_SAVED    L" saved "
+#define STATUS_CLEAN    L" no changes "
+#define STATUS_RELOADED L" reloaded "
+#define STATUS_EXPORTED L" exported "
+
+#define PROGRESS_DONE   L'█'
+#define PROGRESS_LEFT   L'░'
 
 #define DLG_MSG_SAVE    L"Overwrite %s?"
 #define DLG_MSG_RELOAD  L"Reload %s?"
@@ -74,8 +100,12 @@
 #define DLG_MSG_INVALID L"Invalid directory, retry?"
 #define DLG_MSG_ERROR   L"File access error, retry?"
 #define DLG_MSG_QUIT    L"Sure to quit?"
+#define DLG_MSG_CHANGED L"%s changed on disk, reload?"
+#define DLG_MSG_CLOBBER L"%s changed on disk, overwrite?"
 
 #define DLG_ERR_RELOAD  L"There is no file to reload."
 #define DLG_ERR_SAVE    L"There is no file to save."
+#define DLG_ERR_SAVING  L"Saving is already in progress."
+#define DLG_ERR_EXPORT  L"Export needs a .html, .json or .opml file name."
 
 #endif
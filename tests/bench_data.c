@@ -0,0 +1,411 @@
+/** @file
+ * Data layer benchmarks on generated notebooks
+ *
+ * Usage: bench_data [-r RUNS] [-s SHAPE] [SIZE...]
+ *        bench_data -g SHAPE SIZE
+ *
+ * Notebooks are generated from a fixed seed, so the same shape and size
+ * always gives the same input. Results go to stdout as tab separated
+ * lines under a header, best time out of RUNS, so that runs of
+ * different versions can be compared with any tool. Progress goes to
+ * stderr. With -g only the notebook is written to stdout, as input for
+ * other tools.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <locale.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/types.h>
+
+#include "../src/user.h"
+#include "../src/data.h"
+
+// Sizes used when none are given
+#define BENCH_SIZES     {1000, 10000, 100000, 1000000}
+// Runs of every function, the best one counts
+#define BENCH_RUNS      3
+// Most entry operations timed per run
+#define BENCH_OPS       100000
+
+// Kind of generated notebook
+typedef struct Shape {
+  const char *name;
+  int deeper, depth;          // percent chance of going a level deeper, deepest level
+  int words_min, words_max;   // words per entry
+  bool unicode;
+} Shape;
+
+// Best times of one shape and size
+typedef struct Timing {
+  const char *function;
+  long items;
+  size_t bytes;
+  double best;
+} Timing;
+
+static const Shape shapes[] = {
+  {"wide", 1, 2, 2, 8, false},
+  {"deep", 50, 1000, 2, 8, false},
+  {"long", 20, 8, 150, 500, false},
+  {"unicode", 20, 8, 2, 12, true},
+};
+
+static const char *ascii[] = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+  "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "a",
+};
+
+static const char *unicode[] = {
+  "zażółć", "gęślą", "jaźń", "naïve", "façade", "Straße", "καλημέρα", "κόσμε", "привет",
+  "мир", "日本語", "テキスト", "中文", "한국어", "עברית", "مرحبا", "😀", "🚀", "∑∫√", "→",
+};
+
+static unsigned long long seed;
+static Timing timings[16];
+static int timed;
+
+/** Next pseudo-random number, xorshift64
+ */
+static unsigned long long bench_random() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+
+  return seed;
+}
+
+/** Pick a number from min to max, both included
+ */
+static int bench_pick(int min, int max) {
+  return min + (int)(bench_random() % (max - min + 1));
+}
+
+/** Get a monotonic clock reading in seconds
+ */
+static double bench_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Record a time, keeping the best of all runs
+ */
+static void bench_time(const char *function, long items, size_t bytes, double start) {
+  double took;
+  int i;
+
+  took = bench_now() - start;
+  for (i = 0; i < timed; i++)
+    if (!strcmp(timings[i].function, function))
+      break;
+  if (i == timed) {
+    timings[timed].function = function;
+    timings[timed++].best = took;
+  } else if (took < timings[i].best)
+    timings[i].best = took;
+  timings[i].items = items;
+  timings[i].bytes = bytes;
+}
+
+/** Generate a notebook
+ *
+ * @return Buffer with the notebook, its size stored in `length`
+ */
+static char *bench_generate(const Shape *s, long entries, size_t *length) {
+  const char **words, *word;
+  char *data, *bigger;
+  size_t size, at, need;
+  int level, count, n, mark;
+  long i;
+
+  seed = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)entries;
+  words = s->unicode ? unicode : ascii;
+  count = (s->unicode ? sizeof(unicode) : sizeof(ascii)) / sizeof(char *);
+  size = 1 << 20;
+  if (!(data = malloc(size)))
+    return NULL;
+
+  at = 0;
+  level = 0;
+  for (i = 0; i < entries; i++) {
+    if (i && (level < s->depth) && (bench_pick(1, 100) <= s->deeper))
+      ++level;
+    else
+      level -= bench_pick(0, level < 2 ? level : 2);
+    n = bench_pick(s->words_min, s->words_max);
+    need = level + 3 + 4 + n * 16 + 4 + 1;
+    if (size < at + need) {
+      while (size < at + need)
+        size *= 2;
+      if (!(bigger = realloc(data, size))) {
+        free(data);
+        return NULL;
+      }
+      data = bigger;
+    }
+
+    memset(data + at, '\t', level);
+    at += level;
+    memcpy(data + at, "- ", 2);
+    at += 2;
+    mark = bench_pick(1, 20);
+    if (mark == 1) {
+      memcpy(data + at, "~~", 2);
+      at += 2;
+    } else if (mark == 2) {
+      memcpy(data + at, "**", 2);
+      at += 2;
+    }
+    while (n--) {
+      word = words[bench_random() % count];
+      memcpy(data + at, word, strlen(word));
+      at += strlen(word);
+      data[at++] = n ? ' ' : '\n';
+    }
+    if (mark <= 2) {
+      memcpy(data + at - 1, mark == 1 ? "~~\n" : "**\n", 3);
+      at += 2;
+    }
+  }
+  *length = at;
+
+  return data;
+}
+
+/** Count entries of a scan
+ */
+static bool bench_scan(Entry *e, int level, void *arg) {
+  ++*(long *)arg;
+
+  return true;
+}
+
+/** Collect entries in order
+ */
+static long bench_collect(Entry *e, Entry **all) {
+  long count;
+
+  count = 0;
+  while (e) {
+    all[count++] = e;
+    if (e->child) {
+      e = e->child;
+      continue;
+    }
+    while (e && !e->next)
+      e = e->parent;
+    if (e)
+      e = e->next;
+  }
+
+  return count;
+}
+
+/** Stop on an error that shouldn't happen
+ */
+static void bench_check(Result res, const char *function) {
+  if (res.success)
+    return;
+  fprintf(stderr, "%s failed: %ls\n", function, res.msg);
+  exit(EXIT_FAILURE);
+}
+
+/** Time every data layer function on one notebook
+ */
+static void bench_run(const Shape *s, long entries, int runs) {
+  Result res;
+  Entry *tree, *e, **all, **added;
+  FILE *input, *output;
+  char *data;
+  size_t length;
+  long count, ops, i;
+  double start;
+  int run;
+
+  fprintf(stderr, "%s %ld: generating\n", s->name, entries);
+  if (!(data = bench_generate(s, entries, &length)) ||
+      !(all = malloc(entries * sizeof(Entry *))) ||
+      !(added = malloc(BENCH_OPS * sizeof(Entry *))) ||
+      !(input = tmpfile()) || !(output = tmpfile()) ||
+      (fwrite(data, 1, length, input) != length) || fflush(input)) {
+    perror("Can't prepare input");
+    exit(EXIT_FAILURE);
+  }
+  ops = entries < BENCH_OPS ? entries : BENCH_OPS;
+
+  timed = 0;
+  for (run = 1; run <= runs; run++) {
+    fprintf(stderr, "%s %ld: run %d of %d\n", s->name, entries, run, runs);
+
+    rewind(input);
+    start = bench_now();
+    res = data_load(input);
+    bench_time("data_load", entries, length, start);
+    bench_check(res, "data_load");
+    data_unload((Entry *)res.data);
+
+    rewind(input);
+    start = bench_now();
+    res = data_load_lazy(input, 1, NULL);
+    bench_time("data_load_lazy", entries, length, start);
+    bench_check(res, "data_load_lazy");
+    data_unload((Entry *)res.data);
+
+    rewind(input);
+    count = 0;
+    start = bench_now();
+    res = data_scan(input, bench_scan, &count);
+    bench_time("data_scan", count, length, start);
+    bench_check(res, "data_scan");
+
+    start = bench_now();
+    res = data_parse(data, length);
+    bench_time("data_parse", entries, length, start);
+    bench_check(res, "data_parse");
+    tree = (Entry *)res.data;
+
+    rewind(output);
+    start = bench_now();
+    res = data_dump(tree, output);
+    fflush(output);
+    bench_time("data_dump", entries, ftello(output), start);
+    bench_check(res, "data_dump");
+
+    rewind(output);
+    start = bench_now();
+    res = data_export(tree, EXPORT_JSON, output);
+    fflush(output);
+    bench_time("data_export", entries, ftello(output), start);
+    bench_check(res, "data_export");
+
+    start = bench_now();
+    for (e = tree; e; e = e->next)
+      entry_hash(e, true);
+    bench_time("entry_hash", entries, 0, start);
+
+    start = bench_now();
+    res = data_snapshot(tree);
+    bench_check(res, "data_snapshot");
+    snapshot_free((Snapshot *)res.data);
+    bench_time("data_snapshot", entries, 0, start);
+
+    count = bench_collect(tree, all);
+    seed = 0x2545f4914f6cdd1dULL;
+    start = bench_now();
+    for (i = 0; i < ops; i++) {
+      res = entry_insert(all[bench_random() % count], AFTER, 16);
+      bench_check(res, "entry_insert");
+      added[i] = (Entry *)res.data;
+    }
+    bench_time("entry_insert", ops, 0, start);
+
+    start = bench_now();
+    for (i = 0; i < ops; i++)
+      entry_move(added[i], UP);
+    bench_time("entry_move", ops, 0, start);
+
+    start = bench_now();
+    for (i = 0; i < ops; i++)
+      if (entry_indent(added[i], RIGHT))
+        entry_indent(added[i], LEFT);
+    bench_time("entry_indent", ops * 2, 0, start);
+
+    start = bench_now();
+    for (i = 0; i < ops; i++)
+      bench_check(entry_delete(added[i]), "entry_delete");
+    bench_time("entry_delete", ops, 0, start);
+
+    start = bench_now();
+    data_unload(tree);
+    bench_time("data_unload", entries, 0, start);
+  }
+
+  for (i = 0; i < timed; i++)
+    printf("%s\t%ld\t%zu\t%s\t%d\t%.6f\t%.0f\t%.2f\n", s->name, entries, length,
+           timings[i].function, runs, timings[i].best, timings[i].items / timings[i].best,
+           timings[i].bytes / timings[i].best / 1e6);
+  fflush(stdout);
+
+  fclose(output);
+  fclose(input);
+  free(added);
+  free(all);
+  free(data);
+}
+
+int main(int argc, char *argv[]) {
+  long defaults[] = BENCH_SIZES, size;
+  const char *only;
+  char *data;
+  size_t length;
+  bool generate;
+  int runs, opt, i, j;
+
+  // Generated notebooks are UTF-8 whatever the environment says
+  if (!setlocale(LC_ALL, "") || (MB_CUR_MAX == 1))
+    setlocale(LC_ALL, "C.UTF-8");
+  runs = BENCH_RUNS;
+  only = NULL;
+  generate = false;
+  while ((opt = getopt(argc, argv, "r:s:g:")) != -1) {
+    switch (opt) {
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'g':
+        generate = true;
+      // fall through
+      case 's':
+        only = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-r RUNS] [-s SHAPE] [SIZE...]\n"
+                "       %s -g SHAPE SIZE\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (runs < 1)
+    runs = 1;
+
+  if (generate) {
+    for (i = 0; i < sizeof(shapes) / sizeof(Shape); i++)
+      if (!strcmp(only, shapes[i].name))
+        break;
+    if ((i == sizeof(shapes) / sizeof(Shape)) || (optind + 1 != argc) ||
+        ((size = atol(argv[optind])) <= 0)) {
+      fprintf(stderr, "Usage: %s -g SHAPE SIZE\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (!(data = bench_generate(&shapes[i], size, &length)) ||
+        (fwrite(data, 1, length, stdout) != length) || fflush(stdout)) {
+      perror("Can't generate notebook");
+      return EXIT_FAILURE;
+    }
+    free(data);
+    return EXIT_SUCCESS;
+  }
+
+  printf("shape\tentries\tbytes\tfunction\truns\tseconds\titems_per_second\tmb_per_second\n");
+  for (i = 0; i < sizeof(shapes) / sizeof(Shape); i++) {
+    if (only && strcmp(only, shapes[i].name))
+      continue;
+    if (optind < argc) {
+      for (j = optind; j < argc; j++)
+        if ((size = atol(argv[j])) > 0)
+          bench_run(&shapes[i], size, runs);
+    } else {
+      for (j = 0; j < sizeof(defaults) / sizeof(long); j++)
+        bench_run(&shapes[i], defaults[j], runs);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+/** @file
+ * Allocation budgets of hot paths
+ *
+ * The test is linked with malloc, calloc, realloc and free wrapped by
+ * the linker, so that every allocation made by the notebook code is
+ * counted, while those of libraries such as ncurses aren't. Navigation
+ * must not allocate at all, typing only now and then as the text buffer
+ * grows, and inserting an entry once for its text, with pool slabs and
+ * lookup tables growing from time to time on top of that.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <check.h>
+#include <locale.h>
+#include <ncurses.h>
+#include <string.h>
+#include <wchar.h>
+#include <sys/types.h>
+
+#include "../src/user.h"
+#include "../src/data.h"
+#include "../src/ui.h"
+
+// Entries of the notebook
+#define ALLOC_SIZE      2000
+// Times every operation is repeated
+#define ALLOC_TIMES     500
+// Allocations allowed per operation
+#define ALLOC_MOVE      0
+#define ALLOC_TYPE      0.05
+#define ALLOC_INSERT    1
+// Allocations allowed on top, for pools and tables that grow
+#define ALLOC_SLACK     16
+// Terminal the UI is drawn for
+#define ALLOC_TERM      "xterm-256color"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+unsigned long allocs, frees;
+bool verbose;
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  allocs++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr)
+    frees++;
+  __real_free(ptr);
+}
+
+/** Show a generated notebook in the UI, with a child under every fourth entry
+ */
+static Entry *alloc_show() {
+  Result res;
+  char *data;
+  size_t at;
+  long i;
+
+  ck_assert_ptr_ne(data = malloc(ALLOC_SIZE * 32), NULL);
+  for (at = 0, i = 0; i < ALLOC_SIZE; i++) {
+    if (i % 4 == 3)
+      at += sprintf(data + at, "\t- child %ld\n", i);
+    else
+      at += sprintf(data + at, "- entry %ld\n", i);
+  }
+  res = data_parse(data, at);
+  free(data);
+  ck_assert(res.success);
+  ck_assert(ui_set_root((Entry *)res.data).success);
+  ui_refresh();
+
+  return (Entry *)res.data;
+}
+
+/** Type keys, repeated a number of times
+ *
+ * @return Allocations made
+ */
+static unsigned long alloc_keys(const wchar_t *keys, int times) {
+  const wchar_t *k;
+  unsigned long before;
+
+  before = allocs;
+  while (times--) {
+    for (k = keys; *k; k++) {
+      ck_assert(ui_dispatch(KEY_TYPE, *k));
+      ui_render();
+    }
+  }
+
+  return allocs - before;
+}
+
+/** Check allocations of an operation against its budget
+ */
+static void alloc_check(const char *name, unsigned long count, double budget) {
+  if (verbose)
+    printf("%s: %lu allocations for %d times, %.0f allowed\n", name, count, ALLOC_TIMES,
+           budget * ALLOC_TIMES + ALLOC_SLACK);
+  ck_assert_msg(count <= budget * ALLOC_TIMES + ALLOC_SLACK,
+                "%s made %lu allocations for %d times", name, count, ALLOC_TIMES);
+}
+
+START_TEST(test_navigate) {
+  Entry *tree;
+
+  tree = alloc_show();
+  alloc_keys(L"e", 1);
+
+  // Not even the first time an entry comes into view
+  ck_assert_int_eq(alloc_keys(L"j", ALLOC_TIMES), 0);
+  ck_assert_int_eq(alloc_keys(L"k", ALLOC_TIMES), 0);
+  ck_assert_int_eq(alloc_keys(L"G", 1), 0);
+  ck_assert_int_eq(alloc_keys(L"g", 1), 0);
+  ck_assert_int_eq(alloc_keys(L"nm", ALLOC_TIMES), ALLOC_MOVE);
+
+  data_unload(tree);
+}
+END_TEST
+
+START_TEST(test_type) {
+  Entry *tree;
+  unsigned long count;
+
+  tree = alloc_show();
+  alloc_keys(L"\n", 1);
+  count = alloc_keys(L"x", ALLOC_TIMES);
+  alloc_check("typing", count, ALLOC_TYPE);
+  count = alloc_keys(L"\x7f", ALLOC_TIMES);
+  alloc_check("deleting", count, 0);
+  alloc_keys(L"\n", 1);
+
+  data_unload(tree);
+}
+END_TEST
+
+START_TEST(test_insert) {
+  Entry *tree;
+  unsigned long count, before;
+
+  tree = alloc_show();
+  alloc_keys(L"e", 1);
+
+  before = frees;
+  count = alloc_keys(L"inew entry\n", ALLOC_TIMES);
+  alloc_check("inserting", count, ALLOC_INSERT);
+  ck_assert_int_le(frees - before, ALLOC_SLACK);
+
+  // Deleted entries go back to their pools
+  count = alloc_keys(L"D", ALLOC_TIMES);
+  alloc_check("deleting", count, 0);
+  count = alloc_keys(L"inew entry\n", ALLOC_TIMES);
+  alloc_check("inserting again", count, ALLOC_INSERT);
+
+  data_unload(tree);
+}
+END_TEST
+
+Suite *alloc_suite(void) {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("Allocations");
+
+  tc = tcase_create("Navigating");
+  tcase_add_test(tc, test_navigate);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Typing");
+  tcase_add_test(tc, test_type);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Inserting");
+  tcase_add_test(tc, test_insert);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  Suite *s;
+  SRunner *sr;
+  char *tmp;
+  int nr_failed;
+
+  if (!setlocale(LC_ALL, "") || (MB_CUR_MAX == 1))
+    setlocale(LC_ALL, "C.UTF-8");
+
+  verbose = false;
+  if ((tmp = getenv("CK_VERBOSITY")) && (tmp[0] == 'v'))
+    verbose = true;
+
+  setenv("TERM", ALLOC_TERM, 1);
+  setenv("COLUMNS", "100", 1);
+  setenv("LINES", "40", 1);
+  if (!(ui_term_out = fopen("/dev/null", "w")) || !(ui_term_in = fopen("/dev/null", "r"))) {
+    perror("Can't open /dev/null");
+    return EXIT_FAILURE;
+  }
+  ui_start();
+
+  s = alloc_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_ENV);
+  nr_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  ui_stop();
+  fclose(ui_term_in);
+  fclose(ui_term_out);
+
+  return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
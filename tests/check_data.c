@@ -5,10 +5,13 @@
 #include <check.h>
 #include <locale.h>
 #include <string.h>
+#include <unistd.h>
 #include <wchar.h>
+#include <sys/stat.h>
 
 #include "../src/user.h"
 #include "../src/data.h"
+#include "../src/compress.h"
 
 FILE *fp, *sink;
 Result res;
@@ -52,6 +55,29 @@ bool dump_error(Result res) {
   return false;
 }
 
+bool same_output(FILE *a, FILE *b) {
+  struct stat sa, sb;
+  char *ba, *bb;
+  bool same;
+
+  fflush(a);
+  fflush(b);
+  if (fstat(fileno(a), &sa) || fstat(fileno(b), &sb))
+    return false;
+  if (sa.st_size != sb.st_size)
+    return false;
+
+  ba = malloc(sa.st_size);
+  bb = malloc(sb.st_size);
+  same = (pread(fileno(a), ba, sa.st_size, 0) == sa.st_size) &&
+         (pread(fileno(b), bb, sb.st_size, 0) == sb.st_size) &&
+         !memcmp(ba, bb, sa.st_size);
+  free(ba);
+  free(bb);
+
+  return same;
+}
+
 void dump_root() {
   if (verbose) {
     data_debug_dump(root, stderr);
@@ -83,6 +109,7 @@ START_TEST(test_load_dump) {
 END_TEST
 
 START_TEST(test_build_tree) {
+  unsigned long changes;
   Entry *e;
 
   res = entry_new(8);
@@ -154,8 +181,12 @@ START_TEST(test_build_tree) {
   ck_assert(entry_indent(root->child->next, RIGHT));
   ck_assert(tree[3]->parent == tree[4]);
   ck_assert(entry_indent(root->next->next, RIGHT));
+  changes = data_changes();
   ck_assert(entry_indent(root->next, RIGHT));
+  ck_assert(data_changes() != changes);
+  changes = data_changes();
   ck_assert(!entry_indent(root, RIGHT));
+  ck_assert(data_changes() == changes);
   ck_assert(entry_indent(tree[1], RIGHT));
 
   //dump_root();
@@ -207,6 +238,911 @@ START_TEST(test_build_tree) {
 }
 END_TEST
 
+START_TEST(test_snapshot) {
+  Snapshot *snap;
+  FILE *before, *after;
+  Entry *e;
+
+  if (!(fp = fopen("./tests/data.txt", "r"))) {
+    perror("Can't open test data");
+    ck_abort_msg("Can't open test data");
+  }
+  res = data_load(fp);
+  fclose(fp);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  root = (Entry *)res.data;
+
+  before = tmpfile();
+  after = tmpfile();
+  ck_assert(before && after);
+  ck_assert(data_dump(root, before).success);
+
+  res = data_snapshot(root);
+  if (dump_error(res))
+    ck_abort_msg("Snapshot error");
+  snap = (Snapshot *)res.data;
+  ck_assert(!data_snapshot(root).success);
+
+  // Modify the tree the way the UI does while a save is running
+  e = root->next;
+  res = entry_own(e);
+  ck_assert(res.success);
+  e->text[0] = L'X';
+  e->crossed = !e->crossed;
+  ck_assert(entry_own(e).success);
+  res = entry_insert(e, AFTER, 4);
+  ck_assert(res.success);
+  wcscpy(((Entry *)res.data)->text, L"new!");
+  ck_assert(entry_own((Entry *)res.data).success);
+  res = entry_delete(e->prev);
+  ck_assert(res.success);
+  root = e;
+
+  ck_assert(snapshot_dump(snap, after).success);
+  ck_assert(same_output(before, after));
+  snapshot_free(snap);
+
+  fclose(before);
+  fclose(after);
+  data_unload(root);
+}
+END_TEST
+
+Entry *load_test_data() {
+  if (!(fp = fopen("./tests/data.txt", "r"))) {
+    perror("Can't open test data");
+    ck_abort_msg("Can't open test data");
+  }
+  res = data_load(fp);
+  fclose(fp);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+
+  return (Entry *)res.data;
+}
+
+START_TEST(test_merge) {
+  Entry *old, *new, *dropped, *nested, *one, *three, *e;
+  FILE *expected, *merged;
+  int count;
+
+  old = load_test_data();
+  new = load_test_data();
+
+  // Old: Next one, ..., First nested stuff {One, Two, Three}, Second...
+  nested = old->next->next->next->next->next->next;
+  one = nested->child;
+  three = one->next->next;
+
+  // Change a line, remove a child and add a new line at the end
+  e = new->next->next->next->next;
+  wcscpy(e->text, L"Next two");
+  ck_assert(entry_delete(e->next->next->child->next).success);
+  for (e = new; e->next; e = e->next);
+  res = entry_insert(e, AFTER, 4);
+  ck_assert(res.success);
+  wcscpy(((Entry *)res.data)->text, L"Last");
+
+  expected = tmpfile();
+  merged = tmpfile();
+  ck_assert(expected && merged);
+  ck_assert(data_dump(new, expected).success);
+
+  root = data_merge(old, new, &dropped);
+  ck_assert(root == old);
+  ck_assert(root->next->next->next->next->next->next == nested);
+  ck_assert(nested->child == one);
+  ck_assert(one->next == three);
+  ck_assert(three->prev == one);
+  ck_assert(three->parent == nested);
+
+  count = 0;
+  for (e = dropped; e; e = e->next) {
+    ck_assert(!e->parent);
+    ck_assert(!wcscmp(e->text, L"Next one") || !wcscmp(e->text, L"Two"));
+    count++;
+  }
+  ck_assert_int_eq(count, 2);
+  data_unload(dropped);
+
+  ck_assert(data_dump(root, merged).success);
+  ck_assert(same_output(expected, merged));
+
+  fclose(expected);
+  fclose(merged);
+  data_unload(root);
+}
+END_TEST
+
+Entry *load_lazy_data(int depth) {
+  if (!(fp = fopen("./tests/data.txt", "r"))) {
+    perror("Can't open test data");
+    ck_abort_msg("Can't open test data");
+  }
+  res = data_load_lazy(fp, depth, NULL);
+  fclose(fp);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+
+  return (Entry *)res.data;
+}
+
+START_TEST(test_lazy) {
+  Entry *eager, *lazy, *other, *dropped, *e, *l;
+  FILE *expected, *output, *input;
+  Snapshot *snap;
+  int count;
+
+  eager = load_test_data();
+  lazy = load_lazy_data(1);
+  expected = tmpfile();
+  ck_assert(expected);
+  ck_assert(data_dump(eager, expected).success);
+
+  // Only the top level is parsed, unparsed entries are dumped as is
+  count = 0;
+  for (e = lazy; e; e = e->next) {
+    ck_assert(!e->child);
+    if (e->lazy)
+      count++;
+  }
+  ck_assert_int_eq(count, 4);
+  output = tmpfile();
+  ck_assert(data_dump(lazy, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  res = data_snapshot(lazy);
+  ck_assert(res.success);
+  snap = (Snapshot *)res.data;
+  output = tmpfile();
+  ck_assert(snapshot_dump(snap, output).success);
+  snapshot_free(snap);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  // Reloading an unchanged file keeps everything
+  other = load_lazy_data(1);
+  ck_assert(data_merge(lazy, other, &dropped) == lazy);
+  ck_assert(!dropped);
+
+  // Unparsed lines follow their entry to another level
+  for (e = eager, l = lazy; !l->lazy || !l->prev; e = e->next, l = l->next);
+  ck_assert(entry_indent(e, RIGHT));
+  ck_assert(entry_indent(l, RIGHT));
+  ck_assert(l->lazy && !l->child);
+  fclose(expected);
+  expected = tmpfile();
+  output = tmpfile();
+  ck_assert(expected && output);
+  ck_assert(data_dump(eager, expected).success);
+  ck_assert(data_dump(lazy, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  // Parsing everything gives the same tree
+  for (e = lazy; e; ) {
+    ck_assert(entry_expand(e).success);
+    ck_assert(!e->lazy);
+    if (e->child) {
+      e = e->child;
+      continue;
+    }
+    while (!e->next && e->parent)
+      e = e->parent;
+    e = e->next;
+  }
+  for (e = eager, l = lazy; e && l; e = e->next, l = l->next)
+    ck_assert(entry_same(e, l, true));
+  output = tmpfile();
+  ck_assert(data_dump(lazy, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  fclose(expected);
+  data_unload(eager);
+  data_unload(lazy);
+
+  // Expanding broken lines fails and leaves the entry as it was
+  input = tmpfile();
+  ck_assert(input);
+  ck_assert(fputs("- a\n\t- b\n- c\n\t- d\n\t\t\t- e\n", input) != EOF);
+  rewind(input);
+  res = data_load_lazy(input, 1, NULL);
+  ck_assert(res.success);
+  lazy = (Entry *)res.data;
+  e = lazy->next;
+  ck_assert(!entry_expand(e).success);
+  ck_assert(e->lazy && !e->child);
+
+  // Unparsed lines moved to another level can't be read from a file
+  // modified in place
+  ck_assert(entry_indent(e, RIGHT));
+  ck_assert(fseek(input, 0, SEEK_END) == 0);
+  ck_assert(fwrite("- More\n", 1, 7, input) == 7);
+  fflush(input);
+  output = tmpfile();
+  ck_assert(output);
+  ck_assert(!data_dump(lazy, output).success);
+  fclose(output);
+
+  fclose(input);
+  data_unload(lazy);
+}
+END_TEST
+
+/** Find an entry by its text, depth first
+ */
+Entry *find_entry(Entry *e, const wchar_t *text) {
+  Entry *found;
+
+  for (; e; e = e->next) {
+    if (!wcscmp(e->text, text))
+      return e;
+    if ((found = find_entry(e->child, text)))
+      return found;
+  }
+
+  return NULL;
+}
+
+void edit_entry(Entry *e) {
+  ck_assert(entry_own(e).success);
+  e->text[0] = L'X';
+  entry_touch(e);
+}
+
+START_TEST(test_ranges) {
+  Entry *eager, *copied;
+  FILE *input, *original, *expected, *output;
+  Snapshot *snap;
+  char buf[4096];
+  size_t n;
+
+  // Work on a copy that can be modified behind the loader's back
+  if (!(fp = fopen("./tests/data.txt", "r"))) {
+    perror("Can't open test data");
+    ck_abort_msg("Can't open test data");
+  }
+  input = tmpfile();
+  original = tmpfile();
+  ck_assert(input && original);
+  while ((n = fread(buf, 1, sizeof(buf), fp))) {
+    ck_assert(fwrite(buf, 1, n, input) == n);
+    ck_assert(fwrite(buf, 1, n, original) == n);
+  }
+  fclose(fp);
+  rewind(input);
+  res = data_load_lazy(input, 0, NULL);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  copied = (Entry *)res.data;
+  eager = load_test_data();
+
+  // Nothing changed, the file is copied as is
+  output = tmpfile();
+  ck_assert(data_dump(copied, output).success);
+  ck_assert(same_output(original, output));
+  fclose(output);
+
+  // Changed entries are written out, their neighbours still copied
+  edit_entry(find_entry(eager, L"Nothing else matters"));
+  edit_entry(find_entry(copied, L"Nothing else matters"));
+  ck_assert(entry_indent(find_entry(eager, L"Two"), RIGHT));
+  ck_assert(entry_indent(find_entry(copied, L"Two"), RIGHT));
+  expected = tmpfile();
+  output = tmpfile();
+  ck_assert(expected && output);
+  ck_assert(data_dump(eager, expected).success);
+  ck_assert(data_dump(copied, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  res = data_snapshot(copied);
+  ck_assert(res.success);
+  snap = (Snapshot *)res.data;
+  output = tmpfile();
+  ck_assert(snapshot_dump(snap, output).success);
+  snapshot_free(snap);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  // A file modified in place can't be copied from anymore
+  ck_assert(pwrite(fileno(input), "- Changed\n", 10, 0) == 10);
+  ck_assert(fseek(input, 0, SEEK_END) == 0);
+  ck_assert(fwrite("- More\n", 1, 7, input) == 7);
+  fflush(input);
+  output = tmpfile();
+  ck_assert(data_dump(copied, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+
+  fclose(expected);
+  fclose(original);
+  fclose(input);
+  data_unload(eager);
+  data_unload(copied);
+}
+END_TEST
+
+/** Open a directory as a stream, the way it's done for files
+ */
+FILE *open_dir(char *path) {
+  FILE *dir;
+
+  if (!(dir = fopen(path, "r")))
+    ck_abort_msg("Can't open test directory");
+
+  return dir;
+}
+
+int count_shards(FILE *dir) {
+  char **names;
+  int count;
+
+  res = data_manifest(fileno(dir));
+  ck_assert(res.success);
+  names = (char **)res.data;
+  for (count = 0; names[count]; count++);
+  manifest_free(names);
+
+  return count;
+}
+
+START_TEST(test_shards) {
+  Entry *eager, *sharded, *other, *e;
+  FILE *dir, *expected, *output;
+  struct stat before[16], after;
+  char path[] = "/tmp/snb-check-XXXXXX";
+  char **names;
+  int count, changed, i;
+
+  ck_assert(mkdtemp(path));
+  eager = load_test_data();
+  for (count = 0, e = eager; e; e = e->next, count++);
+
+  // Every top level entry gets its own shard
+  dir = open_dir(path);
+  ck_assert(data_dump(eager, dir).success);
+  ck_assert_int_eq(count_shards(dir), count);
+  for (e = eager; e; e = e->next)
+    ck_assert(e->shard);
+  fclose(dir);
+
+  dir = open_dir(path);
+  res = data_load_lazy(dir, 1, NULL);
+  fclose(dir);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  sharded = (Entry *)res.data;
+  expected = tmpfile();
+  output = tmpfile();
+  ck_assert(expected && output);
+  ck_assert(data_dump(eager, expected).success);
+  ck_assert(data_dump(sharded, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(expected);
+  fclose(output);
+
+  // Only the changed shard is written again
+  dir = open_dir(path);
+  res = data_manifest(fileno(dir));
+  ck_assert(res.success);
+  names = (char **)res.data;
+  for (i = 0; names[i]; i++)
+    ck_assert(!fstatat(fileno(dir), names[i], before + i, 0));
+  for (e = sharded; e; ) {
+    ck_assert(entry_expand(e).success);
+    if (e->child) {
+      e = e->child;
+      continue;
+    }
+    while (!e->next && e->parent)
+      e = e->parent;
+    e = e->next;
+  }
+  edit_entry(find_entry(eager, L"Nothing else matters"));
+  edit_entry(find_entry(sharded, L"Nothing else matters"));
+  ck_assert(data_dump_dir(sharded, fileno(dir)).success);
+  for (i = changed = 0; names[i]; i++) {
+    ck_assert(!fstatat(fileno(dir), names[i], &after, 0));
+    if (after.st_ino != before[i].st_ino)
+      changed++;
+  }
+  ck_assert_int_eq(changed, 1);
+
+  // Shards of deleted entries are removed
+  e = find_entry(sharded, L"Next one");
+  ck_assert(entry_delete(e).success);
+  ck_assert(entry_delete(find_entry(eager, L"Next one")).success);
+  ck_assert(data_dump_dir(sharded, fileno(dir)).success);
+  ck_assert_int_eq(count_shards(dir), count - 1);
+  for (i = changed = 0; names[i]; i++)
+    if (fstatat(fileno(dir), names[i], &after, 0))
+      changed++;
+  ck_assert_int_eq(changed, 1);
+  fclose(dir);
+
+  dir = open_dir(path);
+  res = data_load(dir);
+  fclose(dir);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  data_unload(sharded);
+  sharded = (Entry *)res.data;
+  for (e = eager, other = sharded; e && other; e = e->next, other = other->next)
+    ck_assert(entry_same(e, other, true));
+  ck_assert(!(e || other));
+
+  dir = open_dir(path);
+  for (i = 0; names[i]; i++)
+    unlinkat(fileno(dir), names[i], 0);
+  unlinkat(fileno(dir), SHARD_MANIFEST, 0);
+  fclose(dir);
+  rmdir(path);
+  manifest_free(names);
+  data_unload(eager);
+  data_unload(sharded);
+}
+END_TEST
+
+START_TEST(test_compressed) {
+  Entry *eager, *copied, *loaded;
+  FILE *expected, *packed, *out, *output;
+  Snapshot *snap;
+  struct stat st;
+
+  eager = load_test_data();
+  expected = tmpfile();
+  packed = tmpfile();
+  ck_assert(expected && packed);
+  ck_assert(data_dump(eager, expected).success);
+
+  // Written through a compressing stream, read back by magic bytes
+  ck_assert((out = compress_writer(fileno(packed), COMPRESS_GZIP, 9)) != NULL);
+  ck_assert(data_dump(eager, out).success);
+  ck_assert(fclose(out) == 0);
+  ck_assert_int_eq(compress_detect(fileno(packed), 0), COMPRESS_GZIP);
+  ck_assert_int_eq(compress_type("notes.md.gz"), COMPRESS_GZIP);
+  ck_assert_int_eq(compress_type("notes.md.zst"), COMPRESS_ZSTD);
+  ck_assert_int_eq(compress_type("notes.md"), COMPRESS_NONE);
+
+  rewind(packed);
+  res = data_load(packed);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  loaded = (Entry *)res.data;
+  output = tmpfile();
+  ck_assert(data_dump(loaded, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+  data_unload(loaded);
+
+  // Lazy loading parses compressed files whole
+  rewind(packed);
+  res = data_load_lazy(packed, 1, NULL);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  loaded = (Entry *)res.data;
+  ck_assert(loaded->lazy == NULL);
+  output = tmpfile();
+  ck_assert(data_dump(loaded, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+  data_unload(loaded);
+
+  // Ranges of a plain file are copied into compressed output
+  ck_assert((fp = fopen("./tests/data.txt", "r")) != NULL);
+  res = data_load_lazy(fp, 1, NULL);
+  fclose(fp);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  copied = (Entry *)res.data;
+  res = data_snapshot(copied);
+  ck_assert(res.success);
+  snap = (Snapshot *)res.data;
+  ck_assert(ftruncate(fileno(packed), 0) == 0);
+  ck_assert((out = compress_writer(fileno(packed), COMPRESS_GZIP, 1)) != NULL);
+  ck_assert(snapshot_dump(snap, out).success);
+  ck_assert(fclose(out) == 0);
+  snapshot_free(snap);
+  data_unload(copied);
+  rewind(packed);
+  res = data_load(packed);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  loaded = (Entry *)res.data;
+  output = tmpfile();
+  ck_assert(data_dump(loaded, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+  data_unload(loaded);
+
+  // Cut short data is an error, not a shorter tree
+  ck_assert(fstat(fileno(packed), &st) == 0);
+  ck_assert(ftruncate(fileno(packed), st.st_size / 2) == 0);
+  rewind(packed);
+  res = data_load(packed);
+  ck_assert(!res.success);
+
+  fclose(packed);
+  fclose(expected);
+  data_unload(eager);
+}
+END_TEST
+
+Entry *load_path(char *path) {
+  FILE *input;
+
+  ck_assert((input = fopen(path, "r")) != NULL);
+  res = data_load(input);
+  fclose(input);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+
+  return (Entry *)res.data;
+}
+
+START_TEST(test_append) {
+  Entry *loaded, *e, *item;
+  FILE *dir;
+  char path[] = "/tmp/snb-check-XXXXXX", file[64];
+  char **names;
+  struct stat before, after;
+  int count, i;
+
+  ck_assert(mkdtemp(path));
+  sprintf(file, "%s/notes.md", path);
+  res = entry_new(8);
+  ck_assert(res.success);
+  item = (Entry *)res.data;
+  wcscpy(item->text, L"Remember");
+  ck_assert((fp = fopen(file, "w")) != NULL);
+  ck_assert(fputs("- Inbox\n\t- Old\n- Later", fp) != EOF);  // no newline at the end
+  fclose(fp);
+
+  // At the end the file is only appended to
+  ck_assert(stat(file, &before) == 0);
+  ck_assert(data_append(file, item, NULL).success);
+  ck_assert(stat(file, &after) == 0);
+  ck_assert(before.st_ino == after.st_ino);
+  ck_assert(data_append(file, item, L"Remember").success);
+  ck_assert(stat(file, &after) == 0);
+  ck_assert(before.st_ino == after.st_ino);
+
+  // In the middle the file is replaced
+  ck_assert(data_append(file, item, L"Inbox").success);
+  ck_assert(stat(file, &after) == 0);
+  ck_assert(before.st_ino != after.st_ino);
+  ck_assert_int_eq(after.st_mode, before.st_mode);
+  ck_assert(!data_append(file, item, L"Nowhere").success);
+
+  loaded = load_path(file);
+  e = find_entry(loaded, L"Inbox");
+  ck_assert(e && e->child && e->child->next && !e->child->next->next);
+  ck_assert(!wcscmp(e->child->next->text, L"Remember"));
+  e = find_entry(loaded, L"Later");
+  ck_assert(e && e->next && !wcscmp(e->next->text, L"Remember"));
+  ck_assert(e->next->child && !wcscmp(e->next->child->text, L"Remember"));
+  for (count = 0, e = loaded; e; e = e->next, count++);
+  ck_assert_int_eq(count, 3);
+  data_unload(loaded);
+  unlink(file);
+
+  // A missing file is created
+  ck_assert(data_append(file, item, NULL).success);
+  ck_assert(stat(file, &after) == 0);
+  unlink(file);
+
+  // Notebook directories get a new shard, or the shard of the parent
+  loaded = load_test_data();
+  dir = open_dir(path);
+  ck_assert(data_dump(loaded, dir).success);
+  count = count_shards(dir);
+  ck_assert(data_append(path, item, NULL).success);
+  ck_assert_int_eq(count_shards(dir), count + 1);
+  ck_assert(!data_append(path, item, L"Ala ma kota").success);
+  ck_assert(data_append(path, item, L"Second nested stuff").success);
+  ck_assert_int_eq(count_shards(dir), count + 1);
+  data_unload(loaded);
+
+  rewind(dir);
+  res = data_load(dir);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  loaded = (Entry *)res.data;
+  e = find_entry(loaded, L"Second nested stuff");
+  for (e = e->child; e->next; e = e->next);
+  ck_assert(!wcscmp(e->text, L"Remember"));
+  for (e = loaded; e->next; e = e->next);
+  ck_assert(!wcscmp(e->text, L"Remember"));
+  data_unload(loaded);
+
+  res = data_manifest(fileno(dir));
+  ck_assert(res.success);
+  names = (char **)res.data;
+  for (i = 0; names[i]; i++)
+    unlinkat(fileno(dir), names[i], 0);
+  unlinkat(fileno(dir), SHARD_MANIFEST, 0);
+  fclose(dir);
+  rmdir(path);
+  manifest_free(names);
+  data_unload(item);
+}
+END_TEST
+
+bool scan_dump(Entry *e, int level, void *arg) {
+  ck_assert(e->parent == NULL && e->child == NULL);
+  return entry_dump(e, level, (FILE *)arg);
+}
+
+bool scan_stop(Entry *e, int level, void *arg) {
+  return ++*(int *)arg < 3;
+}
+
+START_TEST(test_scan) {
+  Entry *eager;
+  FILE *expected, *output;
+  int count;
+
+  eager = load_test_data();
+  expected = tmpfile();
+  output = tmpfile();
+  ck_assert(expected && output);
+  ck_assert(data_dump(eager, expected).success);
+
+  // Entry by entry, the same as the whole tree
+  ck_assert((fp = fopen("./tests/data.txt", "r")) != NULL);
+  res = data_scan(fp, scan_dump, output);
+  fclose(fp);
+  if (dump_error(res))
+    ck_abort_msg("Scanning error");
+  ck_assert(same_output(expected, output));
+
+  // Stops when asked to
+  count = 0;
+  ck_assert((fp = fopen("./tests/data.txt", "r")) != NULL);
+  ck_assert(data_scan(fp, scan_stop, &count).success);
+  fclose(fp);
+  ck_assert_int_eq(count, 3);
+
+  // Errors are reported like when loading
+  count = 0;
+  ck_assert(ftruncate(fileno(output), 0) == 0);
+  rewind(output);
+  ck_assert(fputs("- One\n\t\t- Three\n", output) != EOF);
+  fflush(output);
+  rewind(output);
+  res = data_scan(output, scan_stop, &count);
+  ck_assert(!res.success);
+  ck_assert_int_eq(count, 1);
+
+  fclose(output);
+  fclose(expected);
+  data_unload(eager);
+}
+END_TEST
+
+bool export_same(Entry *e, export_t format, const char *expected) {
+  FILE *a, *b;
+  bool same;
+
+  ck_assert((a = tmpfile()) && (b = tmpfile()));
+  ck_assert(fputs(expected, a) != EOF);
+  ck_assert(data_export(e, format, b).success);
+  same = same_output(a, b);
+  fclose(a);
+  fclose(b);
+
+  return same;
+}
+
+START_TEST(test_export) {
+  Entry *eager, *lazy, *small;
+  FILE *expected, *output;
+  Export x;
+  export_t format;
+
+  ck_assert(export_type("notes.JSON", &format) && (format == EXPORT_JSON));
+  ck_assert(export_type("opml", &format) && (format == EXPORT_OPML));
+  ck_assert(!export_type("notes.md", &format));
+
+  // Escaping and marks
+  ck_assert((fp = tmpfile()) != NULL);
+  ck_assert(fputs("- A & <B>\n\t- ~~**\"x\"\\**~~\n- C\n", fp) != EOF);
+  rewind(fp);
+  res = data_load(fp);
+  fclose(fp);
+  ck_assert(res.success);
+  small = (Entry *)res.data;
+  ck_assert(export_same(small, EXPORT_HTML,
+                        "<ul>\n\t<li>A &amp; &lt;B&gt;\n\t<ul>\n"
+                        "\t\t<li><del><strong>&quot;x&quot;\\</strong></del></li>\n"
+                        "\t</ul>\n\t</li>\n\t<li>C</li>\n</ul>\n"));
+  ck_assert(export_same(small, EXPORT_JSON,
+                        "[\n\t{\"text\": \"A & <B>\", \"crossed\": false, \"bold\": false, "
+                        "\"children\": [\n\t\t{\"text\": \"\\\"x\\\"\\\\\", \"crossed\": true, "
+                        "\"bold\": true}\n\t]},\n"
+                        "\t{\"text\": \"C\", \"crossed\": false, \"bold\": false}\n]\n"));
+  ck_assert(export_same(small, EXPORT_OPML,
+                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<opml version=\"2.0\">\n"
+                        "<head></head>\n<body>\n\t<outline text=\"A &amp; &lt;B&gt;\">\n"
+                        "\t\t<outline text=\"&lt;b&gt;&quot;x&quot;\\&lt;/b&gt;\" _complete=\"true\"/>\n"
+                        "\t</outline>\n\t<outline text=\"C\"/>\n</body>\n</opml>\n"));
+  data_unload(small);
+
+  // Parsed, unparsed and scanned entries export the same
+  eager = load_test_data();
+  lazy = load_lazy_data(1);
+  for (format = EXPORT_HTML; format <= EXPORT_OPML; format++) {
+    expected = tmpfile();
+    output = tmpfile();
+    ck_assert(expected && output);
+    ck_assert(data_export(eager, format, expected).success);
+    ck_assert(data_export(lazy, format, output).success);
+    ck_assert(same_output(expected, output));
+
+    ck_assert(ftruncate(fileno(output), 0) == 0);
+    rewind(output);
+    ck_assert((fp = fopen("./tests/data.txt", "r")) != NULL);
+    ck_assert(export_start(&x, format, output));
+    ck_assert(data_scan(fp, export_entry, &x).success);
+    ck_assert(export_finish(&x));
+    fclose(fp);
+    ck_assert(same_output(expected, output));
+
+    fclose(output);
+    fclose(expected);
+  }
+  data_unload(lazy);
+  data_unload(eager);
+}
+END_TEST
+
+Entry *import_text(const char *text, export_t format) {
+  FILE *input;
+
+  ck_assert((input = tmpfile()) != NULL);
+  ck_assert(fputs(text, input) != EOF);
+  rewind(input);
+  res = data_import(input, format);
+  fclose(input);
+
+  return res.success ? (Entry *)res.data : NULL;
+}
+
+START_TEST(test_import) {
+  Entry *eager, *imported;
+  FILE *expected, *output;
+  export_t format;
+
+  // Exported notebooks come back the same
+  eager = load_test_data();
+  expected = tmpfile();
+  ck_assert(expected && data_dump(eager, expected).success);
+  for (format = EXPORT_JSON; format <= EXPORT_OPML; format++) {
+    output = tmpfile();
+    ck_assert(output && data_export(eager, format, output).success);
+    rewind(output);
+    res = data_import(output, format);
+    if (dump_error(res))
+      ck_abort_msg("Import error");
+    imported = (Entry *)res.data;
+    ck_assert(ftruncate(fileno(output), 0) == 0);
+    rewind(output);
+    ck_assert(data_dump(imported, output).success);
+    ck_assert(same_output(expected, output));
+    data_unload(imported);
+    fclose(output);
+  }
+  fclose(expected);
+  data_unload(eager);
+
+  // Fields in any order, unknown ones skipped
+  imported = import_text("{\"children\": [{\"id\": [1, {\"a\": \"]\"}], \"text\": \"\\u00e9\\n\"}],"
+                         " \"crossed\": true, \"text\": \"Top\"}", EXPORT_JSON);
+  ck_assert(imported && !imported->next && imported->crossed && !imported->bold);
+  ck_assert(!wcscmp(imported->text, L"Top"));
+  ck_assert(imported->child && !wcscmp(imported->child->text, L"é "));
+  data_unload(imported);
+
+  // Only outlines count
+  imported = import_text("<?xml version=\"1.0\"?>\n<opml><head><title>T</title></head><body>\n"
+                         "<!-- <outline text=\"No\"/> -->\n<outline text='&lt;b&gt;A &amp; "
+                         "&#x42;&lt;/b&gt;' _complete=\"true\">\n<outline text=\"C\"/></outline>"
+                         "</body></opml>\n", EXPORT_OPML);
+  ck_assert(imported && !imported->next && imported->crossed && imported->bold);
+  ck_assert(!wcscmp(imported->text, L"A & B"));
+  ck_assert(imported->child && !wcscmp(imported->child->text, L"C"));
+  data_unload(imported);
+
+  // Errors tell where they are
+  ck_assert(!import_text("[{\"text\": \"a\"},\n  {\"text\" \"b\"}]", EXPORT_JSON));
+  ck_assert(!wcscmp(res.msg, L"Expected ':' at line 2, column 11"));
+  ck_assert(!import_text("<opml><body>\n<outline text=\"a\">\n</body></opml>", EXPORT_OPML));
+  ck_assert(wcsstr(res.msg, L"Unclosed outline at line 3") != NULL);
+  ck_assert(!import_text("[", EXPORT_JSON));
+  ck_assert(!import_text("- Markdown", EXPORT_JSON));
+  ck_assert(import_text("[]", EXPORT_JSON) == NULL && res.success);
+}
+END_TEST
+
+/** Check that a parsed tree dumps the same as the test data
+ */
+void parse_same(Entry *parsed, FILE *expected) {
+  FILE *output;
+
+  output = tmpfile();
+  ck_assert(output && data_dump(parsed, output).success);
+  ck_assert(same_output(expected, output));
+  fclose(output);
+  data_unload(parsed);
+}
+
+START_TEST(test_parse) {
+  struct Parser *p;
+  FILE *expected;
+  Entry *e;
+  char data[4096];
+  size_t length, at, step;
+  int pipes[2];
+
+  e = load_test_data();
+  expected = tmpfile();
+  ck_assert(expected && data_dump(e, expected).success);
+  data_unload(e);
+  ck_assert(fp = fopen("./tests/data.txt", "r"));
+  length = fread(data, 1, sizeof(data), fp);
+  ck_assert(length && feof(fp));
+  fclose(fp);
+
+  // A buffer parses the same as a file
+  res = data_parse(data, length);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  parse_same((Entry *)res.data, expected);
+
+  // Chunks may split lines and characters anywhere
+  for (step = 1; step < 12; step += 5) {
+    res = parser_new();
+    ck_assert(res.success);
+    p = (struct Parser *)res.data;
+    for (at = 0; at < length; at += step)
+      ck_assert(parser_feed(p, data + at, (length - at < step) ? length - at : step).success);
+    res = parser_finish(p);
+    if (dump_error(res))
+      ck_abort_msg("Parsing error");
+    parse_same((Entry *)res.data, expected);
+  }
+
+  // So does a pipe
+  ck_assert(pipe(pipes) == 0);
+  ck_assert(write(pipes[1], data, length) == length);
+  close(pipes[1]);
+  res = data_load_fd(pipes[0], NULL);
+  close(pipes[0]);
+  if (dump_error(res))
+    ck_abort_msg("Parsing error");
+  parse_same((Entry *)res.data, expected);
+  fclose(expected);
+
+  // The last line needs no newline
+  res = data_parse("- a\n\t- b\xc3\xa9", 11);
+  e = (Entry *)res.data;
+  ck_assert(res.success && e && e->child && !wcscmp(e->child->text, L"bé"));
+  data_unload(e);
+
+  // Errors stick
+  p = (struct Parser *)parser_new().data;
+  ck_assert(!parser_feed(p, "- a\n\t\t- b\n", 10).success);
+  ck_assert(!parser_feed(p, "- c\n", 4).success);
+  res = parser_finish(p);
+  ck_assert(!res.success && !wcscmp(res.msg, L"Ambiguous indentation at line 2"));
+  ck_assert(!data_parse("- a\xc3", 4).success);
+}
+END_TEST
+
 Suite *data_suite(void) {
   Suite *s;
   TCase *tc;
@@ -221,6 +1157,50 @@ Suite *data_suite(void) {
   tcase_add_test(tc, test_build_tree);
   suite_add_tcase(s, tc);
 
+  tc = tcase_create("Merging");
+  tcase_add_test(tc, test_merge);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Snapshots");
+  tcase_add_test(tc, test_snapshot);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Lazy loading");
+  tcase_add_test(tc, test_lazy);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Copying ranges");
+  tcase_add_test(tc, test_ranges);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Sharded directories");
+  tcase_add_test(tc, test_shards);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Compressed files");
+  tcase_add_test(tc, test_compressed);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Scanning");
+  tcase_add_test(tc, test_scan);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Appending");
+  tcase_add_test(tc, test_append);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Exporting");
+  tcase_add_test(tc, test_export);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Importing");
+  tcase_add_test(tc, test_import);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Parsing buffers");
+  tcase_add_test(tc, test_parse);
+  suite_add_tcase(s, tc);
+
   return s;
 }
 
@@ -0,0 +1,384 @@
+/** @file
+ * Scalability regression tests
+ *
+ * Every operation runs on a notebook of SCALE_SIZE entries and on one
+ * SCALE_GROWTH times bigger, and fails when its cost grows far more than
+ * its complexity allows. UI operations are judged by ui_steps, which
+ * counts loop iterations over elements and lookups, so that they don't
+ * depend on how busy the machine is. Data operations have no counter
+ * and are judged by their best time out of SCALE_RUNS, with more slack.
+ *
+ * Changes that rebuild only part of the visual tree rely on it being in
+ * line with the entries, so edits that used to leave it out of line are
+ * replayed here as well.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <check.h>
+#include <locale.h>
+#include <ncurses.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <sys/types.h>
+
+#include "../src/user.h"
+#include "../src/data.h"
+#include "../src/ui.h"
+
+// Entries of the smaller notebook
+#define SCALE_SIZE      20000
+// How many times bigger the other notebook is
+#define SCALE_GROWTH    10
+// Runs of every operation, the best one counts
+#define SCALE_RUNS      3
+// Times an operation may grow beyond its complexity, counted or timed
+#define SCALE_SLACK     1.5
+#define SCALE_TIME_SLACK 3.0
+// Terminal the UI is drawn for
+#define SCALE_TERM      "xterm-256color"
+
+// Cost of one operation
+typedef struct Cost {
+  double seconds;
+  unsigned long steps;
+} Cost;
+
+FILE *sink;
+bool verbose;
+
+/** Get a monotonic clock reading in seconds
+ */
+static double scale_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Generate a notebook, with a child under every eighth entry
+ *
+ * @return Buffer with the notebook, its size stored in `length`
+ */
+static char *scale_notebook(long entries, size_t *length) {
+  char *data;
+  size_t at;
+  long i;
+
+  ck_assert_ptr_ne(data = malloc(entries * 32), NULL);
+  at = 0;
+  for (i = 0; i < entries; i++) {
+    if (i % 8 == 7)
+      at += sprintf(data + at, "\t- child %ld\n", i);
+    else
+      at += sprintf(data + at, "- entry %ld\n", i);
+  }
+  *length = at;
+
+  return data;
+}
+
+/** Show a notebook of the given size in the UI
+ */
+static Entry *scale_show(long entries) {
+  Result res;
+  char *data;
+  size_t length;
+
+  data = scale_notebook(entries, &length);
+  res = data_parse(data, length);
+  free(data);
+  ck_assert(res.success);
+  ck_assert(ui_set_root((Entry *)res.data).success);
+  ui_refresh();
+
+  return (Entry *)res.data;
+}
+
+/** Type keys, repeated a number of times
+ */
+static Cost scale_keys(const wchar_t *keys, int times) {
+  const wchar_t *k;
+  Cost cost;
+
+  ui_steps = 0;
+  cost.seconds = scale_now();
+  while (times--) {
+    for (k = keys; *k; k++) {
+      ck_assert(ui_dispatch(KEY_TYPE, *k));
+      ui_render();
+    }
+  }
+  cost.seconds = scale_now() - cost.seconds;
+  cost.steps = ui_steps;
+
+  return cost;
+}
+
+/** Keep the cheaper of two costs
+ */
+static void scale_best(Cost *best, Cost cost) {
+  if (cost.seconds < best->seconds)
+    best->seconds = cost.seconds;
+  if (cost.steps < best->steps)
+    best->steps = cost.steps;
+}
+
+/** Check how much the cost of an operation grew with the notebook
+ *
+ * @param growth Expected growth, SCALE_GROWTH for linear and 1 for constant
+ * @param counted Whether steps are counted, otherwise time is compared
+ */
+static void scale_check(const char *name, Cost small, Cost big, double growth, bool counted) {
+  double ratio;
+
+  if (counted) {
+    ck_assert_msg(small.steps, "%s counted no steps", name);
+    ratio = (double)big.steps / small.steps;
+  } else
+    ratio = big.seconds / (small.seconds > 1e-6 ? small.seconds : 1e-6);
+  if (verbose)
+    printf("%s: %lu -> %lu steps, %.6f -> %.6f s, ratio %.2f of %.2f allowed\n", name,
+           small.steps, big.steps, small.seconds, big.seconds, ratio,
+           growth * (counted ? SCALE_SLACK : SCALE_TIME_SLACK));
+  ck_assert_msg(ratio <= growth * (counted ? SCALE_SLACK : SCALE_TIME_SLACK),
+                "%s grew %.1f times for %d times the entries", name, ratio, SCALE_GROWTH);
+}
+
+/** Next entry in a depth-first walk over a tree
+ */
+static Entry *scale_walk(Entry *e) {
+  if (e->child)
+    return e->child;
+  while (!e->next && e->parent)
+    e = e->parent;
+
+  return e->next;
+}
+
+/** Check that every entry can be reached in order from the top
+ *
+ * Top level entries are walked first, then all of them once every level
+ * is expanded, which takes one expand per level.
+ *
+ * @return First top level entry
+ */
+static Entry *scale_visible() {
+  Entry *first, *e;
+
+  for (first = (Entry *)ui_get_root().data; first->parent; first = first->parent);
+  while (first->prev)
+    first = first->prev;
+
+  scale_keys(L"g", 1);
+  for (e = first; e; e = e->next) {
+    ck_assert_ptr_eq(ui_get_root().data, e);
+    scale_keys(L"j", 1);
+  }
+  scale_keys(L"eeeeeeeeg", 1);
+  for (e = first; e; e = scale_walk(e)) {
+    ck_assert_ptr_eq(ui_get_root().data, e);
+    scale_keys(L"n", 1);
+  }
+
+  return first;
+}
+
+START_TEST(test_load_dump) {
+  Result res;
+  Cost load[2], dump[2], cost;
+  char *data;
+  size_t length;
+  int size, run;
+
+  cost.steps = 0;
+  for (size = 0; size < 2; size++) {
+    data = scale_notebook(size ? SCALE_SIZE * SCALE_GROWTH : SCALE_SIZE, &length);
+    load[size] = dump[size] = cost;
+    load[size].seconds = dump[size].seconds = 1e9;
+    for (run = 0; run < SCALE_RUNS; run++) {
+      cost.seconds = scale_now();
+      res = data_parse(data, length);
+      cost.seconds = scale_now() - cost.seconds;
+      scale_best(&load[size], cost);
+      ck_assert(res.success);
+
+      cost.seconds = scale_now();
+      ck_assert(data_dump((Entry *)res.data, sink).success);
+      fflush(sink);
+      cost.seconds = scale_now() - cost.seconds;
+      scale_best(&dump[size], cost);
+      data_unload((Entry *)res.data);
+    }
+    free(data);
+  }
+
+  scale_check("load", load[0], load[1], SCALE_GROWTH, false);
+  scale_check("dump", dump[0], dump[1], SCALE_GROWTH, false);
+}
+END_TEST
+
+START_TEST(test_expand) {
+  Entry *tree;
+  Cost expand[2];
+  int size, run;
+
+  for (size = 0; size < 2; size++) {
+    tree = scale_show(size ? SCALE_SIZE * SCALE_GROWTH : SCALE_SIZE);
+    expand[size].seconds = 1e9;
+    expand[size].steps = -1;
+    for (run = 0; run < SCALE_RUNS; run++) {
+      scale_keys(L"c", 1);
+      scale_best(&expand[size], scale_keys(L"e", 1));
+    }
+    data_unload(tree);
+  }
+
+  scale_check("expand all", expand[0], expand[1], SCALE_GROWTH, true);
+  scale_check("expand all", expand[0], expand[1], SCALE_GROWTH, false);
+}
+END_TEST
+
+START_TEST(test_bottom) {
+  Entry *tree;
+  Cost bottom[2];
+  int size, run;
+
+  for (size = 0; size < 2; size++) {
+    tree = scale_show(size ? SCALE_SIZE * SCALE_GROWTH : SCALE_SIZE);
+    scale_keys(L"e", 1);
+    bottom[size].seconds = 1e9;
+    bottom[size].steps = -1;
+    for (run = 0; run < SCALE_RUNS; run++) {
+      scale_keys(L"g", 1);
+      scale_best(&bottom[size], scale_keys(L"G", 1));
+    }
+    data_unload(tree);
+  }
+
+  scale_check("jump to bottom", bottom[0], bottom[1], SCALE_GROWTH, true);
+}
+END_TEST
+
+START_TEST(test_indent) {
+  Entry *tree;
+  Cost indent[2], move[2];
+  int size, run;
+
+  for (size = 0; size < 2; size++) {
+    tree = scale_show(size ? SCALE_SIZE * SCALE_GROWTH : SCALE_SIZE);
+    scale_keys(L"eGkkk", 1);
+    indent[size].seconds = move[size].seconds = 1e9;
+    indent[size].steps = move[size].steps = -1;
+    for (run = 0; run < SCALE_RUNS; run++) {
+      scale_best(&indent[size], scale_keys(L"LH", 100));
+      scale_best(&move[size], scale_keys(L"KJ", 100));
+    }
+    data_unload(tree);
+  }
+
+  // Work near the bottom must not depend on what is above it
+  scale_check("indent deep in a list", indent[0], indent[1], 1, true);
+  scale_check("indent deep in a list", indent[0], indent[1], 1, false);
+  scale_check("move deep in a list", move[0], move[1], 1, true);
+  scale_check("move deep in a list", move[0], move[1], 1, false);
+}
+END_TEST
+
+START_TEST(test_replay) {
+  const wchar_t *keys[] = {
+    L"", L"DJUK", L"DjKUL", L"Dixy\nKUK", L"DJUKJJKK", L"DjKULHHJK", L"GDUKKKDgUJJ",
+    L"jjjjjjjDUKKKKKKKK", L"GkDUJJJ", L"jjjjjjjjLLJJKKHHUD", NULL,
+  };
+  Result res;
+  FILE *fp;
+  int i;
+
+  for (i = 0; keys[i]; i++) {
+    ck_assert_ptr_ne(fp = fopen("./tests/data.txt", "r"), NULL);
+    res = data_load(fp);
+    fclose(fp);
+    ck_assert(res.success);
+    ck_assert(ui_set_root((Entry *)res.data).success);
+    ui_refresh();
+
+    scale_keys(keys[i], 1);
+    data_unload(scale_visible());
+  }
+}
+END_TEST
+
+Suite *scale_suite(void) {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("Scale");
+
+  tc = tcase_create("Loading and dumping");
+  tcase_add_test(tc, test_load_dump);
+  tcase_set_timeout(tc, 60);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Expanding all");
+  tcase_add_test(tc, test_expand);
+  tcase_set_timeout(tc, 60);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Jumping to bottom");
+  tcase_add_test(tc, test_bottom);
+  tcase_set_timeout(tc, 60);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Indenting deep");
+  tcase_add_test(tc, test_indent);
+  tcase_set_timeout(tc, 60);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("Editing around moves");
+  tcase_add_test(tc, test_replay);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  Suite *s;
+  SRunner *sr;
+  char *tmp;
+  int nr_failed;
+
+  if (!setlocale(LC_ALL, "") || (MB_CUR_MAX == 1))
+    setlocale(LC_ALL, "C.UTF-8");
+
+  verbose = false;
+  if ((tmp = getenv("CK_VERBOSITY")) && (tmp[0] == 'v'))
+    verbose = true;
+
+  setenv("TERM", SCALE_TERM, 1);
+  setenv("COLUMNS", "100", 1);
+  setenv("LINES", "40", 1);
+  if (!(sink = fopen("/dev/null", "w")) || !(ui_term_out = fopen("/dev/null", "w")) ||
+      !(ui_term_in = fopen("/dev/null", "r"))) {
+    perror("Can't open /dev/null");
+    return EXIT_FAILURE;
+  }
+  ui_start();
+
+  s = scale_suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_ENV);
+  nr_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  ui_stop();
+  fclose(ui_term_in);
+  fclose(ui_term_out);
+  fclose(sink);
+
+  return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
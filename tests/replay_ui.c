@@ -0,0 +1,231 @@
+/** @file
+ * Headless replay of key scripts through the UI
+ *
+ * Usage: replay_ui [-w WIDTH] [-h HEIGHT] [-f SCRIPT] [NOTEBOOK]
+ *
+ * The notebook is read from stdin when no path is given, so that it can
+ * be piped from `bench_data -g`. The UI runs on /dev/null, which needs
+ * no terminal, and every key goes through the same dispatch and render
+ * as in the main loop. Every line of a script reads `NAME COUNT KEYS`,
+ * with `\n`, `\t`, `\e` and `\\` escapes in KEYS; lines starting with
+ * `#` are skipped. Each of the COUNT times KEYS are replayed is one
+ * sample of the command NAME. Keys that ask a yes/no question would wait
+ * forever for an answer that never comes, so scripts can't use them.
+ *
+ * Results go to stdout as tab separated lines under a header, one per
+ * command, with latency percentiles in microseconds.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <locale.h>
+#include <ncurses.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/types.h>
+
+#include "../src/user.h"
+#include "../src/data.h"
+#include "../src/ui.h"
+
+// Terminal the UI is drawn for
+#define REPLAY_TERM     "xterm-256color"
+// Longest script line
+#define REPLAY_LINE     1024
+
+// Script used when none is given
+static const char *script[] = {
+  "expand 1 e",
+  "bottom 1 G",
+  "top 1 g",
+  "walk 1000 j",
+  "indent 200 LH",
+  "move 100 JK",
+  "cross 200 d",
+  "edit 100 \\nxyz\\n",
+  "insert 50 inew entry\\n",
+  "back 1000 k",
+  "collapse 1 c",
+  NULL,
+};
+
+/** Get a monotonic clock reading in microseconds
+ */
+static double replay_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** Order samples for percentiles
+ */
+static int replay_cmp(const void *a, const void *b) {
+  double x, y;
+
+  x = *(const double *)a;
+  y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/** Turn escapes in keys into what they stand for, in place
+ */
+static void replay_unescape(char *keys) {
+  char *from;
+
+  for (from = keys; *from; from++) {
+    if ((*from == '\\') && from[1]) {
+      switch (*++from) {
+        case 'n':
+          *keys++ = '\n';
+          continue;
+        case 't':
+          *keys++ = '\t';
+          continue;
+        case 'e':
+          *keys++ = '\033';
+          continue;
+      }
+    }
+    *keys++ = *from;
+  }
+  *keys = '\0';
+}
+
+/** Replay a script line and report its latencies
+ *
+ * @return false if the line is malformed or the UI quit
+ */
+static bool replay_line(char *line) {
+  wchar_t keys[REPLAY_LINE], *k;
+  double *samples, start;
+  char name[64];
+  int count, skip, i;
+  bool run;
+
+  line[strcspn(line, "\n")] = '\0';
+  if ((line[0] == '#') || (line[strspn(line, " \t")] == '\0'))
+    return true;
+  if ((sscanf(line, "%63s %d %n", name, &count, &skip) != 2) || (count < 1)) {
+    fprintf(stderr, "Malformed script line: %s\n", line);
+    return false;
+  }
+  replay_unescape(line + skip);
+  if (mbstowcs(keys, line + skip, REPLAY_LINE) == (size_t)-1) {
+    fprintf(stderr, "Invalid keys for %s\n", name);
+    return false;
+  }
+  if (!(samples = malloc(count * sizeof(double)))) {
+    perror("Can't allocate samples");
+    return false;
+  }
+
+  run = true;
+  for (i = 0; run && (i < count); i++) {
+    start = replay_now();
+    for (k = keys; run && *k; k++) {
+      run = ui_dispatch(KEY_TYPE, *k);
+      ui_render();
+    }
+    samples[i] = replay_now() - start;
+  }
+  count = i;
+
+  qsort(samples, count, sizeof(double), replay_cmp);
+  for (start = 0, i = 0; i < count; i++)
+    start += samples[i];
+  printf("%s\t%d\t%.1f\t%.1f\t%.1f\t%.3f\n", name, count, samples[(count - 1) / 2],
+         samples[(count * 99 + 99) / 100 - 1], samples[count - 1], start / 1e3);
+  fflush(stdout);
+  free(samples);
+
+  return run;
+}
+
+int main(int argc, char *argv[]) {
+  Result res;
+  FILE *fp, *rs;
+  char line[REPLAY_LINE], *width, *height;
+  int opt, i;
+
+  if (!setlocale(LC_ALL, "") || (MB_CUR_MAX == 1))
+    setlocale(LC_ALL, "C.UTF-8");
+  width = "100";
+  height = "40";
+  rs = NULL;
+  while ((opt = getopt(argc, argv, "w:h:f:")) != -1) {
+    switch (opt) {
+      case 'w':
+        width = optarg;
+        break;
+      case 'h':
+        height = optarg;
+        break;
+      case 'f':
+        if (!(rs = fopen(optarg, "r"))) {
+          perror("Can't open script");
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-w WIDTH] [-h HEIGHT] [-f SCRIPT] [NOTEBOOK]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    if (!(fp = fopen(argv[optind], "r"))) {
+      perror("Can't open notebook");
+      return EXIT_FAILURE;
+    }
+    res = data_load(fp);
+    fclose(fp);
+  } else
+    res = data_load_fd(STDIN_FILENO, NULL);
+  if (!res.success || !res.data) {
+    fprintf(stderr, "Can't load notebook: %ls\n", res.success ? L"empty" : res.msg);
+    return EXIT_FAILURE;
+  }
+
+  setenv("TERM", REPLAY_TERM, 1);
+  setenv("COLUMNS", width, 1);
+  setenv("LINES", height, 1);
+  if (!(ui_term_out = fopen("/dev/null", "w")) || !(ui_term_in = fopen("/dev/null", "r"))) {
+    perror("Can't open /dev/null");
+    return EXIT_FAILURE;
+  }
+  ui_start();
+  res = ui_set_root((Entry *)res.data);
+  if (!res.success) {
+    ui_stop();
+    fprintf(stderr, "Can't show notebook: %ls\n", res.msg);
+    return EXIT_FAILURE;
+  }
+  ui_refresh();
+
+  printf("command\tsamples\tp50_us\tp99_us\tmax_us\ttotal_ms\n");
+  if (rs) {
+    while (fgets(line, sizeof(line), rs) && replay_line(line));
+    fclose(rs);
+  } else {
+    for (i = 0; script[i]; i++) {
+      strcpy(line, script[i]);
+      if (!replay_line(line))
+        break;
+    }
+  }
+
+  ui_stop();
+  res = ui_get_root();
+  data_unload((Entry *)res.data);
+  fclose(ui_term_in);
+  fclose(ui_term_out);
+
+  return EXIT_SUCCESS;
+}